@@ -0,0 +1,702 @@
+// bench.cpp : Host kernel benchmarks and end-to-end runs on the simulator.
+//
+#include "stdafx.h"
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "bench.h"
+#include "crc.h"
+#include "gff.h"
+#include "i2c.h"
+#include "statuspoll.h"
+#include "rtdsim.h"
+#include "session.h"
+#include "thread.h"
+
+#define BENCH_DATA_SIZE (4 * 1024 * 1024)
+#define BENCH_MIN_CLOCKS (CLOCKS_PER_SEC / 2)
+// Image programmed and dumped by the end-to-end runs.
+#define BENCH_E2E_SIZE (256 * 1024)
+
+#define BENCH_MAX_RESULTS 128
+#define BENCH_MAX_METRICS 6
+
+// One measurement, kept for the JSON report. Keys are string literals.
+struct BenchResult
+{
+    const char* group;
+    char        name[64];
+    bool        ok;
+    int         metrics;
+    const char* keys[BENCH_MAX_METRICS];
+    double      values[BENCH_MAX_METRICS];
+};
+
+static BenchResult g_Results[BENCH_MAX_RESULTS];
+static int g_NumResults = 0;
+
+static BenchResult* AddResult(const char* group, const char* name, bool ok)
+{
+    static BenchResult overflow;
+    BenchResult* result = g_NumResults < BENCH_MAX_RESULTS ? &g_Results[g_NumResults++] : &overflow;
+    memset(result, 0, sizeof(*result));
+    result->group = group;
+    strncpy(result->name, name, sizeof(result->name) - 1);
+    result->ok = ok;
+    return result;
+}
+
+static void AddMetric(BenchResult* result, const char* key, double value)
+{
+    if (result->metrics < BENCH_MAX_METRICS)
+    {
+        result->keys[result->metrics] = key;
+        result->values[result->metrics++] = value;
+    }
+}
+
+static void WriteJsonString(FILE* fp, const char* text)
+{
+    fputc('"', fp);
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            fputc('\\', fp);
+        if ((unsigned char)*text >= 0x20)
+            fputc(*text, fp);
+    }
+    fputc('"', fp);
+}
+
+static bool WriteBenchJson(const char* json_file, bool ok)
+{
+    FILE* fp = fopen(json_file, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Can't create %s\n", json_file);
+        return false;
+    }
+    fprintf(fp, "{\n  \"ok\": %s,\n  \"results\": [", ok ? "true" : "false");
+    for (int i = 0; i < g_NumResults; i++)
+    {
+        const BenchResult* result = &g_Results[i];
+        fprintf(fp, "%s\n    {\"group\": \"%s\", \"name\": ", i ? "," : "", result->group);
+        WriteJsonString(fp, result->name);
+        fprintf(fp, ", \"ok\": %s", result->ok ? "true" : "false");
+        for (int m = 0; m < result->metrics; m++)
+            fprintf(fp, ", \"%s\": %.6g", result->keys[m], result->values[m]);
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    bool written = fclose(fp) == 0;
+    fprintf(stderr, "Results %s %s\n", written ? "written to" : "can't be written to", json_file);
+    return written;
+}
+
+static double MBPerSec(double bytes, clock_t clocks)
+{
+    if (clocks < 1)
+        clocks = 1;
+    return bytes / (1024 * 1024) / ((double)clocks / CLOCKS_PER_SEC);
+}
+
+// Fill the buffer with repeatable pseudo random data.
+static void FillBenchData(uint8_t* data, uint32_t len)
+{
+    uint32_t x = 0x12345678;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        x = x * 1103515245 + 12345;
+        data[i] = (uint8_t)(x >> 16);
+    }
+}
+
+// Time every CRC implementation over the same data, checking that they all
+// agree with the bit loop.
+static bool BenchCRC(const uint8_t* data, uint32_t len)
+{
+    bool ok = true;
+    double base_mbs = 0;
+    uint8_t expected = 0;
+    for (int impl = E_CRC_BITWISE; impl < E_CRC_AUTO; impl++)
+    {
+        const char* name = CRCImplName((ECRCImpl)impl);
+        if (!CRCImplSupported((ECRCImpl)impl))
+        {
+            fprintf(stderr, "crc %-8s not supported by this CPU\n", name);
+            continue;
+        }
+        CRCContext ctx;
+        uint32_t runs = 0;
+        clock_t start = clock();
+        clock_t elapsed;
+        do
+        {
+            CRCInit(&ctx);
+            CRCUpdateWith((ECRCImpl)impl, &ctx, data, len);
+            runs++;
+            elapsed = clock() - start;
+        }
+        while (elapsed < BENCH_MIN_CLOCKS);
+
+        // Unaligned, odd sized pieces must give the same result.
+        CRCContext pieces;
+        CRCInit(&pieces);
+        for (uint32_t pos = 0, step = 1; pos < len; pos += step, step = step * 3 % 1021 + 1)
+        {
+            uint32_t n = (len - pos < step) ? len - pos : step;
+            CRCUpdateWith((ECRCImpl)impl, &pieces, data + pos, n);
+        }
+
+        uint8_t crc = CRCFinal(&ctx);
+        if (impl == E_CRC_BITWISE)
+            expected = crc;
+        double mbs = (double)len * runs / (1024 * 1024) / ((double)elapsed / CLOCKS_PER_SEC);
+        if (impl == E_CRC_BITWISE)
+            base_mbs = mbs;
+        bool match = crc == expected && CRCFinal(&pieces) == expected;
+        ok = ok && match;
+        fprintf(stderr, "crc %-8s %9.1f MB/s %6.1fx  crc %02x %s\n", name, mbs,
+                mbs / base_mbs, crc, match ? "" : "MISMATCH");
+        AddMetric(AddResult("crc", name, match), "mb_per_s", mbs);
+    }
+    return ok;
+}
+
+// Decode with the bit-at-a-time decoder, the way ReadFile used to.
+static uint8_t* BenchDecodeGffBitwise(uint8_t* data, uint32_t len, uint32_t* size)
+{
+    *size = ComputeGffDecodedSize(data, len);
+    if (*size == 0)
+        return NULL;
+    uint8_t* dest = new uint8_t[*size];
+    if (!DecodeGff(data, len, dest))
+    {
+        delete [] dest;
+        return NULL;
+    }
+    return dest;
+}
+
+// Both decoders must agree on 'stream' (which needs one readable byte past
+// 'len', the bit-at-a-time decoder reads it).
+static bool BenchGffSame(uint8_t* stream, uint32_t len)
+{
+    uint32_t size_ref = 0;
+    uint32_t size_new = 0;
+    uint8_t* ref = BenchDecodeGffBitwise(stream, len, &size_ref);
+    uint8_t* dec = DecodeGffStream(stream, len, &size_new);
+    bool same = (ref == NULL) == (dec == NULL) &&
+                (ref == NULL || (size_ref == size_new && memcmp(ref, dec, size_ref) == 0));
+    delete [] ref;
+    delete [] dec;
+    return same;
+}
+
+// Check the table driven GFF decoder against the bit-at-a-time one on
+// generated streams, including damaged and truncated ones, then compare
+// their throughput.
+static bool BenchGff(const uint8_t* data, uint32_t len)
+{
+    // Firmware-like input: random code with runs of 0xff and zeros.
+    uint8_t* image = new uint8_t[len];
+    memcpy(image, data, len);
+    for (uint32_t i = 0; i < len; i += 65536)
+    {
+        memset(image + i, 0xff, 4096);
+        memset(image + i + 8192, 0x00, 2048);
+    }
+    uint8_t* file = new uint8_t[GffEncodedMaxSize(len) + 1];
+    uint32_t stream_len = EncodeGff(image, len, file) - GFF_HEADER_SIZE;
+    uint8_t* stream = file + GFF_HEADER_SIZE;
+    stream[stream_len] = 0;
+
+    bool ok = true;
+    uint32_t bad = 0;
+    uint32_t x = 1;
+    for (uint32_t t = 0; t < 2000; t++)
+    {
+        // Small streams, some of them with flipped bits or cut short.
+        uint8_t small_file[GFF_HEADER_SIZE + 2 * 64 + 2];
+        uint8_t* small = small_file + GFF_HEADER_SIZE;
+        uint32_t n = t % 64 + 1;
+        uint32_t small_len = EncodeGff(image + t * 97 % (len - 64), n, small_file) - GFF_HEADER_SIZE;
+        small[small_len] = 0;
+        for (uint32_t f = 0; f < t % 3; f++)
+        {
+            x = x * 1103515245 + 12345;
+            small[(x >> 8) % small_len] ^= 1 << ((x >> 4) & 7);
+        }
+        if (t % 5 == 4)
+            small[--small_len] = 0;
+        if (!BenchGffSame(small, small_len))
+            bad++;
+    }
+    ok = ok && bad == 0;
+
+    uint32_t size_ref = 0;
+    uint32_t size_new = 0;
+    clock_t start = clock();
+    uint8_t* ref = BenchDecodeGffBitwise(stream, stream_len, &size_ref);
+    clock_t ref_clocks = clock() - start;
+    uint32_t runs = 0;
+    uint8_t* dec = NULL;
+    start = clock();
+    do
+    {
+        delete [] dec;
+        dec = DecodeGffStream(stream, stream_len, &size_new);
+        runs++;
+    }
+    while (clock() - start < BENCH_MIN_CLOCKS);
+    clock_t new_clocks = (clock() - start) / runs;
+
+    bool match = ref != NULL && dec != NULL && size_ref == len && size_new == len &&
+                 memcmp(ref, image, len) == 0 && memcmp(dec, image, len) == 0;
+    ok = ok && match;
+    double ref_mbs = (double)stream_len / (1024 * 1024) / ((double)(ref_clocks + 1) / CLOCKS_PER_SEC);
+    double new_mbs = (double)stream_len / (1024 * 1024) / ((double)(new_clocks + 1) / CLOCKS_PER_SEC);
+    fprintf(stderr, "gff bitwise  %9.1f MB/s\n", ref_mbs);
+    fprintf(stderr, "gff table    %9.1f MB/s %6.1fx  %s, %u of 2000 small streams differ\n",
+            new_mbs, new_mbs / ref_mbs, match ? "bit-exact" : "MISMATCH", bad);
+    AddMetric(AddResult("gff_decode", "bitwise", match), "mb_per_s", ref_mbs);
+    BenchResult* result = AddResult("gff_decode", "table", match && bad == 0);
+    AddMetric(result, "mb_per_s", new_mbs);
+    AddMetric(result, "small_streams_differ", bad);
+
+    delete [] ref;
+    delete [] dec;
+    delete [] file;
+    delete [] image;
+    return ok;
+}
+
+// Encode and decode 'data' back, returning true when it survives. Also
+// checks that the bit-at-a-time decoder reads the same.
+static bool BenchGffRoundTrip(const uint8_t* data, uint32_t len)
+{
+    uint8_t* file = new uint8_t[GffEncodedMaxSize(len) + 1];
+    uint32_t file_len = EncodeGff(data, len, file);
+    file[file_len] = 0;
+    uint32_t size = 0;
+    uint8_t* dec = DecodeGffStream(file + GFF_HEADER_SIZE, file_len - GFF_HEADER_SIZE, &size);
+    bool ok = memcmp(file, "GMI GFF V1.0", 12) == 0 &&
+              dec != NULL && size == len && memcmp(dec, data, len) == 0 &&
+              BenchGffSame(file + GFF_HEADER_SIZE, file_len - GFF_HEADER_SIZE);
+    delete [] dec;
+    delete [] file;
+    return ok;
+}
+
+// Round trip a corpus of edge cases: every byte value alone and repeated,
+// all code lengths at every bit alignment, and random data of every length
+// up to 1KB.
+static bool BenchGffCorpus(const uint8_t* random)
+{
+    uint32_t cases = 0;
+    uint32_t failed = 0;
+    uint8_t buffer[1024];
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        for (uint32_t n = 1; n <= 17; n += 8)
+        {
+            memset(buffer, b, n);
+            cases++;
+            failed += BenchGffRoundTrip(buffer, n) ? 0 : 1;
+        }
+    }
+    for (uint32_t shift = 0; shift < 8; shift++)
+    {
+        // A 1 bit code 'shift' times moves the rest to every alignment.
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            for (uint32_t i = 0; i < shift; i++)
+                buffer[i] = 0x00;
+            buffer[shift] = (uint8_t)b;
+            buffer[shift + 1] = (uint8_t)~b;
+            cases++;
+            failed += BenchGffRoundTrip(buffer, shift + 2) ? 0 : 1;
+        }
+    }
+    for (uint32_t n = 1; n <= sizeof(buffer); n++)
+    {
+        cases++;
+        failed += BenchGffRoundTrip(random + n * 31, n) ? 0 : 1;
+    }
+    fprintf(stderr, "gff round trip: %u of %u cases failed\n", failed, cases);
+    BenchResult* result = AddResult("gff_corpus", "round trip", failed == 0);
+    AddMetric(result, "cases", cases);
+    AddMetric(result, "failed", failed);
+    return failed == 0;
+}
+
+// Encode/decode throughput and compression ratio of one image.
+static bool BenchGffImage(const char* name, const uint8_t* data, uint32_t len)
+{
+    uint8_t* file = new uint8_t[GffEncodedMaxSize(len) + 1];
+    uint32_t file_len = 0;
+    uint32_t runs = 0;
+    clock_t start = clock();
+    do
+    {
+        file_len = EncodeGff(data, len, file);
+        runs++;
+    }
+    while (clock() - start < BENCH_MIN_CLOCKS);
+    double enc_mbs = (double)len * runs / (1024 * 1024) / ((double)(clock() - start) / CLOCKS_PER_SEC);
+
+    uint8_t* dec = NULL;
+    uint32_t size = 0;
+    runs = 0;
+    start = clock();
+    do
+    {
+        delete [] dec;
+        dec = DecodeGffStream(file + GFF_HEADER_SIZE, file_len - GFF_HEADER_SIZE, &size);
+        runs++;
+    }
+    while (clock() - start < BENCH_MIN_CLOCKS);
+    double dec_mbs = (double)len * runs / (1024 * 1024) / ((double)(clock() - start) / CLOCKS_PER_SEC);
+
+    bool ok = dec != NULL && size == len && memcmp(dec, data, len) == 0;
+    fprintf(stderr, "gff %-24s %8u -> %8u bytes (%5.1f%%)  encode %7.1f MB/s  decode %7.1f MB/s %s\n",
+            name, len, file_len, 100.0 * file_len / len, enc_mbs, dec_mbs, ok ? "" : "MISMATCH");
+    BenchResult* result = AddResult("gff_image", name, ok);
+    AddMetric(result, "ratio", (double)file_len / len);
+    AddMetric(result, "encode_mb_per_s", enc_mbs);
+    AddMetric(result, "decode_mb_per_s", dec_mbs);
+
+    // The size pass the old decoder ran before decoding.
+    runs = 0;
+    uint32_t decoded_size = 0;
+    file[file_len] = 0;
+    start = clock();
+    do
+    {
+        decoded_size = ComputeGffDecodedSize(file + GFF_HEADER_SIZE, file_len - GFF_HEADER_SIZE);
+        runs++;
+    }
+    while (clock() - start < BENCH_MIN_CLOCKS);
+    double size_mbs = MBPerSec((double)len * runs, clock() - start);
+    fprintf(stderr, "gff %-24s decoded size %7.1f MB/s %s\n", name, size_mbs,
+            decoded_size == len ? "" : "MISMATCH");
+    AddMetric(AddResult("gff_decoded_size", name, decoded_size == len), "mb_per_s", size_mbs);
+    ok = ok && decoded_size == len;
+    delete [] dec;
+    delete [] file;
+    return ok;
+}
+
+// Load a firmware dump; GFF files are decoded first.
+static uint8_t* BenchLoadImage(const char* file_name, uint32_t* len)
+{
+    FILE* file;
+    fopen_s(&file, file_name, "rb");
+    if (NULL == file)
+    {
+        fprintf(stderr, "Can't open input file %s\n", file_name);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    uint32_t size = (uint32_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* data = new uint8_t[size + 1];
+    size = (uint32_t)fread(data, 1, size, file);
+    fclose(file);
+    if (size > GFF_HEADER_SIZE && memcmp(data, "GMI GFF V1.0", 12) == 0)
+    {
+        data[size] = 0;
+        uint8_t* decoded = DecodeGffStream(data + GFF_HEADER_SIZE, size - GFF_HEADER_SIZE, &size);
+        delete [] data;
+        data = decoded;
+    }
+    if (NULL == data || size == 0)
+    {
+        fprintf(stderr, "Can't load %s\n", file_name);
+        delete [] data;
+        return NULL;
+    }
+    *len = size;
+    return data;
+}
+
+// Scan every page of an image for data to program, the writer's blank
+// page test.
+static bool BenchPageScan(const BenchHooks* hooks, const char* name,
+                          const uint8_t* data, uint32_t len)
+{
+    uint32_t used = 0;
+    uint32_t runs = 0;
+    clock_t start = clock();
+    do
+    {
+        used = 0;
+        for (uint32_t addr = 0; addr + 256 <= len; addr += 256)
+            used += hooks->should_program_page(data + addr, 256) ? 1 : 0;
+        runs++;
+    }
+    while (clock() - start < BENCH_MIN_CLOCKS);
+    double mbs = MBPerSec((double)len * runs, clock() - start);
+    fprintf(stderr, "page scan %-18s %8.1f MB/s  %u of %u pages used\n", name, mbs, used, len / 256);
+    BenchResult* result = AddResult("page_scan", name, true);
+    AddMetric(result, "mb_per_s", mbs);
+    AddMetric(result, "pages_used", used);
+    return true;
+}
+
+// Open and summarize an image file the way the writer does.
+static bool BenchLoad(const BenchHooks* hooks, const char* name, const char* file_name,
+                      uint32_t len)
+{
+    bool ok = true;
+    uint32_t runs = 0;
+    clock_t start = clock();
+    do
+    {
+        ok = hooks->load_image(file_name, 8 * 1024 * 1024) && ok;
+        runs++;
+    }
+    while (ok && clock() - start < BENCH_MIN_CLOCKS);
+    double mbs = MBPerSec((double)len * runs, clock() - start);
+    fprintf(stderr, "load %-23s %8.1f MB/s %s\n", name, mbs, ok ? "" : "FAILED");
+    AddMetric(AddResult("load_image", name, ok), "mb_per_s", mbs);
+    return ok;
+}
+
+// Path of a scratch file in the temporary directory.
+static void BenchTempName(char* path, size_t size, const char* suffix)
+{
+#ifdef _WIN32
+    char dir[MAX_PATH];
+    if (GetTempPathA(sizeof(dir), dir) == 0)
+        strcpy(dir, ".\\");
+    _snprintf(path, size, "%srtd_bench_%lu_%s", dir, (unsigned long)GetCurrentProcessId(), suffix);
+    path[size - 1] = 0;
+#else
+    const char* dir = getenv("TMPDIR");
+    snprintf(path, size, "%s/rtd_bench_%d_%s", dir ? dir : "/tmp", (int)getpid(), suffix);
+#endif
+}
+
+static bool BenchWriteFile(const char* file_name, const uint8_t* data, uint32_t len)
+{
+    FILE* file = fopen(file_name, "wb");
+    if (NULL == file)
+        return false;
+    bool ok = fwrite(data, 1, len, file) == len;
+    return fclose(file) == 0 && ok;
+}
+
+// Whether 'file_name' holds exactly the 'len' bytes of 'data'.
+static bool BenchSameFile(const char* file_name, const uint8_t* data, uint32_t len)
+{
+    FILE* file = fopen(file_name, "rb");
+    if (NULL == file)
+        return false;
+    uint8_t* read = new uint8_t[len + 1];
+    bool ok = fread(read, 1, len + 1, file) == len && memcmp(read, data, len) == 0;
+    fclose(file);
+    delete [] read;
+    return ok;
+}
+
+struct E2EStep
+{
+    const char* name;
+    const char* command;
+    const char* file;
+    bool        check;      // the file written must match the chip contents
+};
+
+struct E2EBench
+{
+    const char*       group;
+    const BenchHooks* hooks;
+    const E2EStep*    steps;
+    int               num_steps;
+    uint32_t          size;
+    const uint8_t*    expect;   // what the chip holds after programming
+};
+
+// Run the steps one after the other on the session's simulated device,
+// which keeps its flash between them, and measure each on the simulated
+// clock. Dumps are compared with the programmed image.
+static bool BenchE2EJob(Session* session, void* arg)
+{
+    const E2EBench* e2e = (const E2EBench*)arg;
+    bool ok = true;
+    for (int i = 0; i < e2e->num_steps; i++)
+    {
+        const E2EStep* step = &e2e->steps[i];
+        ResetPollStats();
+        ResetI2CStats();
+        uint64_t start = GetI2CTimeUs();
+        clock_t host_start = clock();
+        bool step_ok = e2e->hooks->run_device(session, step->command, step->file, e2e->size);
+        double host_s = (double)(clock() - host_start) / CLOCKS_PER_SEC;
+        double sim_s = (GetI2CTimeUs() - start) / 1e6;
+        I2CStats stats = GetI2CStats();
+        PollStats program = GetPollStats(E_POLL_PAGE_PROGRAM);
+        double kb = e2e->size / 1024.0;
+        if (step_ok && step->check && !BenchSameFile(step->file, e2e->expect, e2e->size))
+        {
+            fprintf(stderr, "e2e %s: %s differs from the programmed image\n", step->name, step->file);
+            step_ok = false;
+        }
+
+        BenchResult* result = AddResult(e2e->group, step->name, step_ok);
+        AddMetric(result, "mb_per_s", sim_s > 0 ? kb / 1024 / sim_s : 0);
+        AddMetric(result, "seconds", sim_s);
+        AddMetric(result, "transfers_per_kb", stats.transfers / kb);
+        AddMetric(result, "poll_reads_per_kb", GetPollCount() / kb);
+        AddMetric(result, "poll_reads_per_page",
+                  program.ops ? (double)program.polls / program.ops : 0);
+        AddMetric(result, "host_seconds", host_s);
+        ok = ok && step_ok;
+    }
+    return ok;
+}
+
+// Dump and program a simulated device, reporting the throughput on the
+// simulated clock, the adapter round-trips per KB and the status reads.
+// 'image' is programmed unless a 'firmware' file is given. On Linux the
+// i2c-dev transport runs the same steps against a stand-in for the kernel,
+// with I2C_RDWR and with the SMBus fallback.
+static bool BenchEndToEnd(const BenchHooks* hooks, const uint8_t* image, const char* firmware)
+{
+    char image_file[1024];
+    char dump_file[1024];
+    BenchTempName(image_file, sizeof(image_file), "image.bin");
+    BenchTempName(dump_file, sizeof(dump_file), "dump.bin");
+    if (NULL == firmware && !BenchWriteFile(image_file, image, BENCH_E2E_SIZE))
+    {
+        fprintf(stderr, "Can't create %s\n", image_file);
+        return false;
+    }
+    const char* program = firmware ? firmware : image_file;
+    const E2EStep steps[] =
+    {
+        {"program",              "-w", program,   false},
+        {"program differential", "-d", program,   false},
+        {"dump",                 "-r", dump_file, true},
+    };
+
+    // The chip starts blank, so beyond the end of a shorter firmware the
+    // dump reads erased flash.
+    uint8_t* expect = new uint8_t[BENCH_E2E_SIZE];
+    if (firmware)
+    {
+        uint32_t len = 0;
+        uint8_t* data = BenchLoadImage(firmware, &len);
+        if (NULL == data)
+        {
+            delete [] expect;
+            return false;
+        }
+        if (len > BENCH_E2E_SIZE)
+            len = BENCH_E2E_SIZE;
+        memcpy(expect, data, len);
+        memset(expect + len, 0xff, BENCH_E2E_SIZE - len);
+        delete [] data;
+    }
+    else
+    {
+        memcpy(expect, image, BENCH_E2E_SIZE);
+    }
+
+    SimConfig config;
+    GetSimConfig(&config);
+    config.image_file = NULL;   // the runs start from a blank chip
+    const char* groups[3];
+    I2CTransport* links[3];
+    int num_links = 0;
+    groups[num_links] = "e2e";
+    links[num_links++] = CreateSimTransport(config);
+#ifdef __linux__
+    groups[num_links] = "e2e_i2cdev";
+    links[num_links++] = CreateI2CDevSimTransport(config, false);
+    groups[num_links] = "e2e_smbus";
+    links[num_links++] = CreateI2CDevSimTransport(config, true);
+#endif
+    int first = g_NumResults;
+    bool ok = true;
+    for (int l = 0; l < num_links; l++)
+    {
+        E2EBench e2e = {groups[l], hooks, steps, sizeof(steps) / sizeof(steps[0]),
+                        BENCH_E2E_SIZE, expect};
+        Session session;
+        InitSession(&session, 0, "bench sim", links[l]);
+        ok = RunSessions(&session, 1, 1, BenchE2EJob, &e2e) == 0 && ok;
+    }
+    remove(image_file);
+    remove(dump_file);
+    delete [] expect;
+
+    fprintf(stderr, "\nSimulator: %ukHz, %uus USB latency, %uus page program\n",
+            config.i2c_khz, config.usb_latency_us, config.page_program_us);
+    for (int i = first; i < g_NumResults; i++)
+    {
+        const BenchResult* r = &g_Results[i];
+        fprintf(stderr, "%-10s %-22s %7.3f MB/s %7.2fs %7.2f transfers/KB %6.2f polls/page %s\n",
+                r->group, r->name, r->values[0], r->values[1], r->values[2], r->values[4],
+                r->ok ? "" : "FAILED");
+    }
+    return ok;
+}
+
+int RunBenchmarks(const char* const* files, int num_files, const BenchHooks* hooks,
+                  const char* json_file)
+{
+    uint8_t* data = new uint8_t[BENCH_DATA_SIZE];
+    FillBenchData(data, BENCH_DATA_SIZE);
+    bool ok = BenchCRC(data, BENCH_DATA_SIZE);
+    ok = BenchGff(data, BENCH_DATA_SIZE) && ok;
+    ok = BenchGffCorpus(data) && ok;
+    ok = BenchGffImage("(random 256KB)", data, 256 * 1024) && ok;
+
+    // Firmware-like synthetic image: code with runs of 0xff and zeros and a
+    // blank last quarter.
+    uint8_t* synthetic = new uint8_t[BENCH_E2E_SIZE];
+    memcpy(synthetic, data, BENCH_E2E_SIZE);
+    for (uint32_t i = 0; i < BENCH_E2E_SIZE; i += 16384)
+    {
+        memset(synthetic + i, 0xff, 2048);
+        memset(synthetic + i + 4096, 0x00, 1024);
+    }
+    memset(synthetic + BENCH_E2E_SIZE * 3 / 4, 0xff, BENCH_E2E_SIZE / 4);
+    ok = BenchGffImage("(synthetic 256KB)", synthetic, BENCH_E2E_SIZE) && ok;
+    ok = BenchPageScan(hooks, "(synthetic 256KB)", synthetic, BENCH_E2E_SIZE) && ok;
+    char synthetic_file[1024];
+    BenchTempName(synthetic_file, sizeof(synthetic_file), "synthetic.bin");
+    if (BenchWriteFile(synthetic_file, synthetic, BENCH_E2E_SIZE))
+        ok = BenchLoad(hooks, "(synthetic 256KB)", synthetic_file, BENCH_E2E_SIZE) && ok;
+    remove(synthetic_file);
+
+    for (int i = 0; i < num_files; i++)
+    {
+        uint32_t len = 0;
+        uint8_t* image = BenchLoadImage(files[i], &len);
+        if (NULL == image)
+        {
+            ok = false;
+            continue;
+        }
+        const char* name = strrchr(files[i], '/');
+        if (NULL == name)
+            name = strrchr(files[i], '\\');
+        name = name ? name + 1 : files[i];
+        ok = BenchGffImage(name, image, len) && ok;
+        ok = BenchPageScan(hooks, name, image, len) && ok;
+        ok = BenchLoad(hooks, name, files[i], len) && ok;
+        delete [] image;
+    }
+
+    // The first firmware file, when given, is also the one programmed.
+    ok = BenchEndToEnd(hooks, synthetic, num_files > 0 ? files[0] : NULL) && ok;
+    if (json_file)
+        ok = WriteBenchJson(json_file, ok) && ok;
+    delete [] synthetic;
+    delete [] data;
+    return ok ? 0 : 1;
+}
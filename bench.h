@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Session;
+
+// Writer routines the benchmarks measure, provided by main.cpp which keeps
+// them to itself otherwise.
+struct BenchHooks
+{
+    bool (*should_program_page)(const uint8_t* buffer, uint32_t size);
+    // Open and summarize an image the way the writer does, then free it.
+    bool (*load_image)(const char* file_name, uint32_t max_size);
+    // Run a command line job ("-r", "-w" or "-d" with a file and size) on
+    // the device of 'session', entering ISP mode first.
+    bool (*run_device)(Session* session, const char* command, const char* file, uint32_t size);
+};
+
+// Benchmarks, run with "-bench [-json file] (firmware files)". The host
+// kernels need no adapter; the end-to-end runs dump and program a simulated
+// device configured by the RTD_SIM_* variables (see GetSimConfig), on Linux
+// also through the i2c-dev transport. The
+// firmware files, raw dumps or GFF, are used as real world input. Results
+// are also written to 'json_file' unless it is NULL.
+int RunBenchmarks(const char* const* files, int num_files, const BenchHooks* hooks,
+                  const char* json_file);
@@ -0,0 +1,197 @@
+// ch341fake.cpp : In-process stand-in for CH341DLL.
+//
+// Define CH341_FAKE (and drop CH341DLL.LIB from the linker inputs) to run the
+// writer without an adapter. The fake decodes CH341StreamI2C and the packed
+// mCH341A_CMD_I2C_STREAM command streams and feeds the I2C traffic, delays
+// included, to the RTD2662 simulator of rtdsim.cpp, so that the adapter side
+// of the CH341 transport is exercised as well. The simulator is configured
+// from the RTD_SIM_* environment variables (see GetSimConfig).
+#include "stdafx.h"
+
+#ifdef CH341_FAKE
+
+#include "rtdsim.h"
+#include "thread.h"
+
+static CRtdSimulator* fake_sim = NULL;
+static uint32_t fake_packets = 0;
+static uint64_t fake_last_us = 0;
+
+// Start a USB transfer. The transport sleeps on the host between transfers
+// while the chip works; those sleeps (1ms or longer) pass on the simulated
+// chip as well.
+static void FakeBeginTransfer()
+{
+    uint64_t now = HostTimeUs();
+    if (fake_last_us != 0 && now - fake_last_us >= 1000)
+        fake_sim->Wait((uint32_t)(now - fake_last_us));
+    fake_last_us = now;
+    fake_sim->BeginTransfer();
+}
+
+// Decode a packed I2C command stream, returning the number of bytes read.
+static ULONG FakeStream(const UCHAR* stream, ULONG len, UCHAR* out, ULONG out_len)
+{
+    ULONG got = 0;
+    for (ULONG pkt = 0; pkt < len; pkt += mCH341_PACKET_LENGTH)
+    {
+        fake_packets++;
+        ULONG end = pkt + mCH341_PACKET_LENGTH;
+        if (end > len)
+            end = len;
+        if (stream[pkt] != mCH341A_CMD_I2C_STREAM)
+            continue;
+        for (ULONG i = pkt + 1; i < end; )
+        {
+            UCHAR cmd = stream[i++];
+            if (cmd == mCH341A_CMD_I2C_STM_END)
+                break;
+            if (cmd == mCH341A_CMD_I2C_STM_STA)
+            {
+                fake_sim->Start();
+            }
+            else if (cmd == mCH341A_CMD_I2C_STM_STO)
+            {
+                fake_sim->Stop();
+            }
+            else if ((cmd & 0xc0) == mCH341A_CMD_I2C_STM_OUT)
+            {
+                ULONG n = cmd & 0x3f;
+                if (n == 0)
+                    n = 1;
+                for (; n && i < end; n--)
+                    fake_sim->Out(stream[i++]);
+            }
+            else if ((cmd & 0xc0) == mCH341A_CMD_I2C_STM_IN)
+            {
+                ULONG n = cmd & 0x3f;
+                if (n == 0)
+                    n = 1;
+                for (; n; n--)
+                {
+                    uint8_t b = fake_sim->In();
+                    if (got < out_len)
+                        out[got] = b;
+                    got++;
+                }
+            }
+            else if ((cmd & 0xf0) == mCH341A_CMD_I2C_STM_US)
+            {
+                fake_sim->Wait(cmd & 0x0f);
+            }
+            else if ((cmd & 0xf0) == mCH341A_CMD_I2C_STM_MS)
+            {
+                fake_sim->Wait((cmd & 0x0f) * 1000);
+            }
+            // SET commands carry no payload and are ignored.
+        }
+    }
+    return got;
+}
+
+HANDLE WINAPI CH341OpenDevice(ULONG iIndex)
+{
+    SimConfig config;
+    GetSimConfig(&config);
+    fake_sim = new CRtdSimulator(config);
+    fake_packets = 0;
+    fake_last_us = 0;
+    return (HANDLE)(ULONG_PTR)(iIndex + 1);
+}
+
+VOID WINAPI CH341CloseDevice(ULONG /*iIndex*/)
+{
+    fake_sim->PrintStats("CH341 fake");
+    fprintf(stderr, "CH341 fake: %u stream packets\n", fake_packets);
+    delete fake_sim;
+    fake_sim = NULL;
+}
+
+ULONG WINAPI CH341GetVersion()
+{
+    return 0x22;
+}
+
+ULONG WINAPI CH341GetDrvVersion()
+{
+    return 0x22;
+}
+
+PVOID WINAPI CH341GetDeviceName(ULONG /*iIndex*/)
+{
+    return (PVOID)"CH341 fake";
+}
+
+ULONG WINAPI CH341GetVerIC(ULONG /*iIndex*/)
+{
+    return IC_VER_CH341A;
+}
+
+BOOL WINAPI CH341ResetDevice(ULONG /*iIndex*/)
+{
+    return TRUE;
+}
+
+BOOL WINAPI CH341SetStream(ULONG /*iIndex*/, ULONG /*iMode*/)
+{
+    return TRUE;
+}
+
+BOOL WINAPI CH341SetDelaymS(ULONG /*iIndex*/, ULONG /*iDelay*/)
+{
+    return TRUE;
+}
+
+BOOL WINAPI CH341StreamI2C(ULONG /*iIndex*/, ULONG iWriteLength, PVOID iWriteBuffer,
+                           ULONG iReadLength, PVOID oReadBuffer)
+{
+    const UCHAR* wr = (const UCHAR*)iWriteBuffer;
+    UCHAR* rd = (UCHAR*)oReadBuffer;
+    FakeBeginTransfer();
+    if (iWriteLength > 0)
+    {
+        fake_sim->Start();
+        for (ULONG i = 0; i < iWriteLength; i++)
+            fake_sim->Out(wr[i]);
+    }
+    if (iReadLength > 0 && iWriteLength > 0)
+    {
+        fake_sim->Start();
+        fake_sim->Out((UCHAR)(wr[0] | 1));
+        for (ULONG i = 0; i < iReadLength; i++)
+            rd[i] = fake_sim->In();
+    }
+    fake_sim->Stop();
+    return TRUE;
+}
+
+BOOL WINAPI CH341WriteData(ULONG /*iIndex*/, PVOID iBuffer, PULONG ioLength)
+{
+    FakeBeginTransfer();
+    FakeStream((const UCHAR*)iBuffer, *ioLength, NULL, 0);
+    return TRUE;
+}
+
+BOOL WINAPI CH341WriteRead(ULONG /*iIndex*/, ULONG iWriteLength, PVOID iWriteBuffer,
+                           ULONG iReadStep, ULONG iReadTimes,
+                           PULONG oReadLength, PVOID oReadBuffer)
+{
+    FakeBeginTransfer();
+    ULONG got = FakeStream((const UCHAR*)iWriteBuffer, iWriteLength,
+                           (UCHAR*)oReadBuffer, iReadStep * iReadTimes);
+    *oReadLength = got;
+    return TRUE;
+}
+
+BOOL WINAPI CH341WriteI2C(ULONG /*iIndex*/, UCHAR iDevice, UCHAR iAddr, UCHAR iByte)
+{
+    FakeBeginTransfer();
+    fake_sim->Start();
+    fake_sim->Out((UCHAR)(iDevice << 1));
+    fake_sim->Out(iAddr);
+    fake_sim->Out(iByte);
+    fake_sim->Stop();
+    return TRUE;
+}
+
+#endif // CH341_FAKE
@@ -0,0 +1,330 @@
+// chipdb.cpp : Flash chip database.
+//
+// The built-in chips, those of the override file and the ones discovered
+// through SFDP live in one array that never moves, so the descriptions
+// handed out stay valid. An open-addressing hash on the JEDEC ID finds them.
+#include "stdafx.h"
+#include "chipdb.h"
+#include "thread.h"
+
+static const FlashDesc FlashDevices[] =
+{
+    // name,        Jedec ID,    sizeK, page size, block sizeK, erase sizesK,
+    // erase ms, program us, WRSR enable (all 0: the defaults)
+    {"AT25DF041A", 0x1F4401,      512,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"AT25DF161", 0x1F4602, 2 * 1024,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"AT26DF081A", 0x1F4501, 1 * 1024,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"AT26DF0161", 0x1F4600, 2 * 1024,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"AT26DF161A", 0x1F4601, 2 * 1024,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"AT25DF321",  0x1F4701, 4 * 1024,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"AT25DF512B", 0x1F6501,       64,       256, 32, {4, 32, 32}, {0, 0, 0}, 0, 0},
+    {"AT25DF512B", 0x1F6500,       64,       256, 32, {4, 32, 32}, {0, 0, 0}, 0, 0},
+    {"AT25DF021", 0x1F3200,      256,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"AT26DF641",  0x1F4800, 8 * 1024,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    // Manufacturer: ST
+    {"M25P05", 0x202010,       64,       256, 32, {0,  0, 32}, {0, 0, 0}, 0, 0},
+    {"M25P10", 0x202011,      128,       256, 32, {0,  0, 32}, {0, 0, 0}, 0, 0},
+    {"M25P20", 0x202012,      256,       256, 64, {0,  0, 64}, {0, 0, 0}, 0, 0},
+    {"M25P40", 0x202013,      512,       256, 64, {0,  0, 64}, {0, 0, 0}, 0, 0},
+    {"M25P80", 0x202014, 1 * 1024,       256, 64, {0,  0, 64}, {0, 0, 0}, 0, 0},
+    {"M25P16", 0x202015, 2 * 1024,       256, 64, {0,  0, 64}, {0, 0, 0}, 0, 0},
+    {"M25P32", 0x202016, 4 * 1024,       256, 64, {0,  0, 64}, {0, 0, 0}, 0, 0},
+    {"M25P64", 0x202017, 8 * 1024,       256, 64, {0,  0, 64}, {0, 0, 0}, 0, 0},
+    // Manufacturer: Windbond
+    {"W25X10", 0xEF3011,      128,       256, 64, {4,  0, 64}, {0, 0, 0}, 0, 0},
+    {"W25X20", 0xEF3012,      256,       256, 64, {4,  0, 64}, {0, 0, 0}, 0, 0},
+    {"W25X40", 0xEF3013,      512,       256, 64, {4,  0, 64}, {0, 0, 0}, 0, 0},
+    {"W25X80", 0xEF3014, 1 * 1024,       256, 64, {4,  0, 64}, {0, 0, 0}, 0, 0},
+    {"W25Q80", 0xEF4014, 1 * 1024,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    {"GD25Q80", 0xC84014, 1 * 1024,      256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    // Manufacturer: Macronix
+    {"MX25L512", 0xC22010,       64,       256, 64, {4, 64, 64}, {0, 0, 0}, 0, 0},
+    {"25D40",    0xC22013,      512,       256, 64, {4, 64, 64}, {0, 0, 0}, 0, 0},
+    {"MX25L3205", 0xC22016, 4 * 1024,       256, 64, {4, 64, 64}, {0, 0, 0}, 0, 0},
+    {"MX25L6405", 0xC22017, 8 * 1024,       256, 64, {4, 64, 64}, {0, 0, 0}, 0, 0},
+    {"MX25L8005", 0xC22014,     1024,       256, 64, {4, 64, 64}, {0, 0, 0}, 0, 0},
+    // Microchip
+    {"SST25VF512", 0xBF4800,       64,       256, 32, {4, 32,  0}, {0, 0, 0}, 0, 0},
+    {"SST25VF032", 0xBF4A00, 4 * 1024,       256, 32, {4, 32, 64}, {0, 0, 0}, 0, 0},
+    // PMC
+	{"PM25LQ010B", 0x7F9D21,       128,       256, 64, {4, 32, 64}, {0, 0, 0}, 0, 0},
+	// FM
+    {"FM25F04", 0xA14013,    512,       256, 64, {4,  0, 64}, {0, 0, 0}, 0, 0},
+    {NULL, 0, 0, 0, 0, {0, 0, 0}, {0, 0, 0}, 0, 0}
+};
+
+// Chips the database holds, and slots of the hash (a power of two, well
+// above that so probe runs stay short).
+#define CHIPDB_MAX_CHIPS 256
+#define CHIPDB_HASH_SLOTS 1024
+#define CHIPDB_NAME_SIZE 32
+
+struct ChipDatabase
+{
+    FlashDesc chips[CHIPDB_MAX_CHIPS];
+    char      names[CHIPDB_MAX_CHIPS][CHIPDB_NAME_SIZE];
+    uint32_t  count;
+    int16_t   hash[CHIPDB_HASH_SLOTS];   // index into chips, -1 when empty
+    Mutex     lock;                      // for chips added by the sessions
+};
+
+static ChipDatabase g_ChipDB;
+
+static uint32_t HashSlot(uint32_t jedec_id)
+{
+    return (jedec_id * 2654435761u) >> 22;
+}
+
+// Slot holding 'jedec_id', or the empty one it would go to.
+static uint32_t FindSlot(uint32_t jedec_id)
+{
+    uint32_t slot = HashSlot(jedec_id);
+    while (g_ChipDB.hash[slot] >= 0 && g_ChipDB.chips[g_ChipDB.hash[slot]].jedec_id != jedec_id)
+        slot = (slot + 1) % CHIPDB_HASH_SLOTS;
+    return slot;
+}
+
+// Add 'chip' or replace the entry with its ID. Returns the stored copy.
+static const FlashDesc* StoreChip(const FlashDesc* chip)
+{
+    uint32_t slot = FindSlot(chip->jedec_id);
+    int index = g_ChipDB.hash[slot];
+    if (index < 0)
+    {
+        if (g_ChipDB.count == CHIPDB_MAX_CHIPS)
+            return NULL;
+        index = g_ChipDB.count++;
+    }
+    FlashDesc* stored = &g_ChipDB.chips[index];
+    char* name = g_ChipDB.names[index];
+    strncpy(name, chip->device_name, CHIPDB_NAME_SIZE - 1);
+    name[CHIPDB_NAME_SIZE - 1] = 0;
+    *stored = *chip;
+    stored->device_name = name;
+    g_ChipDB.hash[slot] = (int16_t)index;
+    return stored;
+}
+
+static bool IsPowerOfTwo(uint32_t n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+// Whether the programmer can work with 'chip': it writes 256 byte pages
+// and the erase planner aligns addresses to the erase and block sizes.
+static bool IsUsableChip(const FlashDesc* chip)
+{
+    if (chip->size_kb == 0 || chip->page_size != 256 ||
+        !IsPowerOfTwo(chip->block_size_kb) || chip->block_size_kb > chip->size_kb)
+        return false;
+    for (int i = 0; i < 3; i++)
+    {
+        if (chip->erase_kb[i] != 0 &&
+            (!IsPowerOfTwo(chip->erase_kb[i]) || chip->erase_kb[i] > chip->size_kb))
+            return false;
+    }
+    return true;
+}
+
+static bool LoadOverrides(const char* file_name)
+{
+    FILE* fp = NULL;
+    if (fopen_s(&fp, file_name, "r") != 0 || fp == NULL)
+    {
+        fprintf(stderr, "Can't open chip file %s\n", file_name);
+        return false;
+    }
+    char line[256];
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, "RTD chips 1", 11) != 0)
+    {
+        fprintf(stderr, "%s is no chip file\n", file_name);
+        fclose(fp);
+        return false;
+    }
+    bool ok = true;
+    uint32_t added = 0;
+    for (int number = 2; fgets(line, sizeof(line), fp) != NULL; number++)
+    {
+        char name[CHIPDB_NAME_SIZE];
+        unsigned id, size_kb, page_size, block_kb, erase_kb[3];
+        unsigned program_us = 0, erase_ms[3] = {0, 0, 0}, wrsr_enable = 0;
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+            continue;
+        int fields = sscanf(line, "%31s %x %u %u %u %u %u %u %u %u %u %u %x",
+                            name, &id, &size_kb, &page_size, &block_kb,
+                            &erase_kb[0], &erase_kb[1], &erase_kb[2],
+                            &program_us, &erase_ms[0], &erase_ms[1], &erase_ms[2],
+                            &wrsr_enable);
+        if (fields < 8 || (fields > 8 && fields < 12) ||
+            erase_kb[0] > 0xffff || erase_kb[1] > 0xffff || erase_kb[2] > 0xffff)
+        {
+            fprintf(stderr, "%s:%d: bad chip entry\n", file_name, number);
+            ok = false;
+            continue;
+        }
+        FlashDesc chip;
+        memset(&chip, 0, sizeof(chip));
+        chip.device_name = name;
+        chip.jedec_id = id;
+        chip.size_kb = size_kb;
+        chip.page_size = page_size;
+        chip.block_size_kb = block_kb;
+        chip.program_us = program_us;
+        chip.wrsr_enable = (uint8_t)wrsr_enable;
+        for (int i = 0; i < 3; i++)
+        {
+            chip.erase_kb[i] = (uint16_t)erase_kb[i];
+            chip.erase_ms[i] = erase_ms[i];
+        }
+        if (!IsUsableChip(&chip))
+        {
+            fprintf(stderr, "%s:%d: bad chip entry\n", file_name, number);
+            ok = false;
+            continue;
+        }
+        if (StoreChip(&chip) == NULL)
+        {
+            fprintf(stderr, "%s:%d: too many chips\n", file_name, number);
+            ok = false;
+            break;
+        }
+        added++;
+    }
+    fclose(fp);
+    fprintf(stderr, "%u chips from %s\n", added, file_name);
+    return ok;
+}
+
+bool InitChipDatabase(const char* override_file)
+{
+    if (g_ChipDB.lock.handle == NULL)
+        InitMutex(&g_ChipDB.lock);
+    g_ChipDB.count = 0;
+    memset(g_ChipDB.hash, 0xff, sizeof(g_ChipDB.hash));
+    for (const FlashDesc* chip = FlashDevices; chip->jedec_id != 0; chip++)
+    {
+        // The first of two entries with the same ID stays.
+        if (g_ChipDB.hash[FindSlot(chip->jedec_id)] < 0)
+            StoreChip(chip);
+    }
+    return override_file == NULL || LoadOverrides(override_file);
+}
+
+const FlashDesc* FindChip(uint32_t jedec_id)
+{
+    LockMutex(&g_ChipDB.lock);
+    int index = g_ChipDB.hash[FindSlot(jedec_id)];
+    UnlockMutex(&g_ChipDB.lock);
+    return index < 0 ? NULL : &g_ChipDB.chips[index];
+}
+
+// SFDP header and the parameter header of the basic flash parameter table.
+#define SFDP_SIGNATURE 0x50444653   // "SFDP"
+#define SFDP_HEADER_SIZE 16
+// DWORDs of the basic table used below, the longest being the 11th.
+#define BFPT_MAX_DWORDS 16
+
+static uint32_t GetDword(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Typical erase time of erase type 'type' (0-3) from the 10th DWORD.
+static uint32_t EraseTimeMs(uint32_t dword10, int type)
+{
+    static const uint32_t unit_ms[4] = {1, 16, 128, 1000};
+    uint32_t field = (dword10 >> (4 + 7 * type)) & 0x7f;
+    return ((field & 0x1f) + 1) * unit_ms[field >> 5];
+}
+
+const FlashDesc* DiscoverChip(uint32_t jedec_id, SFDPReader read)
+{
+    uint8_t header[SFDP_HEADER_SIZE];
+    if (!read(0, header, sizeof(header)) || GetDword(header) != SFDP_SIGNATURE)
+        return NULL;
+    // The first parameter header is the mandatory basic table.
+    const uint8_t* param = header + 8;
+    uint32_t dwords = param[3];
+    uint32_t table = param[4] | (param[5] << 8) | (param[6] << 16);
+    if (param[0] != 0x00 || dwords < 9)
+        return NULL;
+    if (dwords > BFPT_MAX_DWORDS)
+        dwords = BFPT_MAX_DWORDS;
+    uint8_t bfpt[BFPT_MAX_DWORDS * 4];
+    memset(bfpt, 0, sizeof(bfpt));
+    if (!read(table, bfpt, dwords * 4))
+        return NULL;
+    uint32_t dw1 = GetDword(bfpt);
+    uint32_t density = GetDword(bfpt + 4);
+
+    FlashDesc chip;
+    char name[CHIPDB_NAME_SIZE];
+    memset(&chip, 0, sizeof(chip));
+    sprintf(name, "SFDP %06X", jedec_id);
+    chip.device_name = name;
+    chip.jedec_id = jedec_id;
+    if (density & 0x80000000)
+    {
+        uint32_t log2_bits = density & 0x7fffffff;
+        if (log2_bits < 13 || log2_bits > 34)
+            return NULL;
+        chip.size_kb = 1u << (log2_bits - 13);
+    }
+    else
+    {
+        chip.size_kb = (density / 8 + 1) / 1024;
+    }
+    chip.page_size = 256;
+
+    // Erase types (8th/9th DWORD) with the commands the planner issues.
+    if ((dw1 & 3) == 1 && ((dw1 >> 8) & 0xff) == 0x20)
+        chip.erase_kb[0] = 4;
+    uint32_t dw10 = dwords >= 10 ? GetDword(bfpt + 36) : 0;
+    for (int type = 0; type < 4; type++)
+    {
+        uint32_t erase = GetDword(bfpt + 28 + (type / 2) * 4) >> ((type % 2) * 16);
+        uint32_t log2_size = erase & 0xff;
+        uint8_t opcode = (uint8_t)(erase >> 8);
+        if (log2_size < 10 || log2_size > 16)
+            continue;
+        int i = opcode == 0x20 ? 0 : opcode == 0x52 ? 1 : opcode == 0xd8 ? 2 : -1;
+        if (i < 0)
+            continue;
+        chip.erase_kb[i] = (uint16_t)(1 << (log2_size - 10));
+        if (dw10)
+            chip.erase_ms[i] = EraseTimeMs(dw10, type);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (chip.erase_kb[i] > chip.block_size_kb)
+            chip.block_size_kb = chip.erase_kb[i];
+    }
+
+    // Page size and typical page program time (11th DWORD, JESD216A).
+    if (dwords >= 11)
+    {
+        uint32_t dw11 = GetDword(bfpt + 40);
+        chip.page_size = 1 << ((dw11 >> 4) & 0xf);
+        chip.program_us = (((dw11 >> 8) & 0x1f) + 1) * ((dw11 & (1 << 13)) ? 64 : 8);
+    }
+    // Volatile status register bits are written after EWSR, others after WREN.
+    chip.wrsr_enable = ((dw1 & (1 << 3)) && !(dw1 & (1 << 4))) ? 0x50 : 0x06;
+    if (!IsUsableChip(&chip))
+    {
+        fprintf(stderr, "SFDP: %uKB, %u byte pages, erase %u/%u/%uKB not supported\n",
+                chip.size_kb, chip.page_size, chip.erase_kb[0], chip.erase_kb[1], chip.erase_kb[2]);
+        return NULL;
+    }
+
+    fprintf(stderr, "SFDP: %uKB, %u byte pages, erase %u/%u/%uKB, page program %uus%s%s%s\n",
+            chip.size_kb, chip.page_size, chip.erase_kb[0], chip.erase_kb[1], chip.erase_kb[2],
+            chip.program_us, (dw1 & (1 << 16)) ? ", 1-1-2 read" : "",
+            (dw1 & (1 << 20)) ? ", 1-2-2 read" : "", (dw1 & (1 << 22)) ? ", 1-1-4 read" : "");
+    // Another session may have discovered the chip meanwhile; its entry
+    // stays as it is, being in use.
+    LockMutex(&g_ChipDB.lock);
+    int index = g_ChipDB.hash[FindSlot(jedec_id)];
+    const FlashDesc* stored = index >= 0 ? &g_ChipDB.chips[index] : StoreChip(&chip);
+    UnlockMutex(&g_ChipDB.lock);
+    return stored;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+// A flash chip. The fields from erase_ms on are optional, 0 standing for
+// the defaults: typical times of the Winbond/Macronix parts and the
+// manufacturer's usual status register write enable.
+struct FlashDesc
+{
+    const char* device_name;
+    uint32_t    jedec_id;
+    uint32_t    size_kb;
+    uint32_t    page_size;
+    uint32_t    block_size_kb;
+    // Size in KB erased by the 4KB sector (0x20), 32KB block (0x52) and
+    // 64KB block (0xD8) erase commands, 0 when the chip lacks the command.
+    uint16_t    erase_kb[3];
+    // Typical times of the erase commands above and of a page program, 0
+    // when unknown. They steer the erase planner and the first status polls.
+    uint32_t    erase_ms[3];
+    uint32_t    program_us;
+    // Opcode enabling status register writes, 0x50 (EWSR) or 0x06 (WREN),
+    // 0 for the manufacturer's usual one.
+    uint8_t     wrsr_enable;
+};
+
+// Build the JEDEC ID hash of the built-in chips, then add or replace the
+// entries of 'override_file' (NULL for none), a text file:
+//
+//   RTD chips 1
+//   <name> <JEDEC ID> <size KB> <page size> <block KB> <erase KB x3>
+//          [<program us> <erase ms x3> [<WRSR enable opcode>]]
+//
+// with the JEDEC ID and the opcode in hex. Lines starting with '#' are
+// comments. Entries the programmer can't use (pages other than 256 bytes,
+// block or erase sizes that are no power of two or exceed the chip) are
+// rejected. Call once before the sessions start.
+bool InitChipDatabase(const char* override_file);
+
+// Chip with 'jedec_id', or NULL. Safe from any session.
+const FlashDesc* FindChip(uint32_t jedec_id);
+
+// Reads 'len' bytes of the chip's Serial Flash Discoverable Parameters.
+typedef bool (*SFDPReader)(uint32_t addr, uint8_t* dest, uint32_t len);
+
+// Describe the chip from its JEDEC basic flash parameter table (JESD216):
+// size, page size, erase commands and their typical times, page program
+// time and status register write enable. The chip is added to the
+// database, so later sessions with the same ID find it. Returns NULL when
+// the chip has no SFDP or describes a chip the programmer can't use.
+const FlashDesc* DiscoverChip(uint32_t jedec_id, SFDPReader read);
@@ -1,29 +1,268 @@
 #include "stdafx.h"
 #include "crc.h"
+#include "thread.h"
 
-static unsigned gCrc = 0;
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CRC_HAVE_CLMUL 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC_CLMUL_TARGET
+#else
+#include <cpuid.h>
+#define CRC_CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#endif
+#endif
 
-void InitCRC()
-{
-    gCrc = 0;
-}
+static CRCContext gCrc = {0};
+static THREAD_LOCAL CRCContext* t_Crc = NULL;
 
-void ProcessCRC(const uint8_t *data, int len)
+// crc_table[k][b] is the CRC of byte b followed by k zero bytes.
+static uint8_t crc_table[8][256];
+static bool crc_table_ready = false;
+static bool crc_have_clmul = false;
+// x^128 mod P and x^192 mod P, the folding constants of the CLMUL path.
+static uint64_t crc_fold_k128 = 0;
+static uint64_t crc_fold_k192 = 0;
+
+static uint8_t CRCBitwise(uint8_t crc, const uint8_t* data, size_t len)
 {
-    int i, j;
-    for (j = len; j; j--, data++)
+    unsigned c = crc << 8;
+    for (; len; len--, data++)
     {
-        gCrc ^= (*data << 8);
-        for(i = 8; i; i--)
+        c ^= (*data << 8);
+        for (int i = 8; i; i--)
         {
-            if (gCrc & 0x8000)
-                gCrc ^= (0x1070 << 3);
-            gCrc <<= 1;
+            if (c & 0x8000)
+                c ^= (0x1070 << 3);
+            c <<= 1;
         }
     }
+    return (uint8_t)(c >> 8);
+}
+
+// x^n mod P
+static uint64_t CRCXPowMod(unsigned n)
+{
+    unsigned r = 1;
+    while (n--)
+    {
+        r <<= 1;
+        if (r & 0x100)
+            r ^= 0x107;
+    }
+    return r;
+}
+
+static void CRCSetupTables()
+{
+    if (crc_table_ready)
+        return;
+    for (unsigned b = 0; b < 256; b++)
+    {
+        uint8_t byte = (uint8_t)b;
+        crc_table[0][b] = CRCBitwise(0, &byte, 1);
+    }
+    for (unsigned k = 1; k < 8; k++)
+    {
+        for (unsigned b = 0; b < 256; b++)
+            crc_table[k][b] = crc_table[0][crc_table[k - 1][b]];
+    }
+    crc_fold_k128 = CRCXPowMod(128);
+    crc_fold_k192 = CRCXPowMod(192);
+#ifdef CRC_HAVE_CLMUL
+    unsigned ecx;
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 1);
+    ecx = regs[2];
+#else
+    unsigned eax, ebx, edx;
+    ecx = 0;
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+#endif
+    // PCLMULQDQ (bit 1) and SSSE3 (bit 9) for the byte shuffle.
+    crc_have_clmul = (ecx & (1 << 1)) && (ecx & (1 << 9));
+#endif
+    crc_table_ready = true;
+}
+
+static uint8_t CRCTable(uint8_t crc, const uint8_t* data, size_t len)
+{
+    for (; len; len--, data++)
+        crc = crc_table[0][crc ^ *data];
+    return crc;
+}
+
+static uint8_t CRCSlice8(uint8_t crc, const uint8_t* data, size_t len)
+{
+    for (; len >= 8; len -= 8, data += 8)
+    {
+        crc = crc_table[7][crc ^ data[0]] ^
+              crc_table[6][data[1]] ^
+              crc_table[5][data[2]] ^
+              crc_table[4][data[3]] ^
+              crc_table[3][data[4]] ^
+              crc_table[2][data[5]] ^
+              crc_table[1][data[6]] ^
+              crc_table[0][data[7]];
+    }
+    return CRCTable(crc, data, len);
+}
+
+#ifdef CRC_HAVE_CLMUL
+// Fold the message 16 bytes at a time into a 128 bit remainder congruent to
+// it modulo P: X' = X.hi * (x^192 mod P) + X.lo * (x^128 mod P) + next block.
+// The bytes are reversed on load so that the first byte holds the highest
+// order coefficients. The 16 byte remainder and the tail then go through
+// the table.
+CRC_CLMUL_TARGET
+static uint8_t CRCClmul(uint8_t crc, const uint8_t* data, size_t len)
+{
+    if (len < 32)
+        return CRCSlice8(crc, data, len);
+
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                         8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k = _mm_set_epi32((int)(crc_fold_k192 >> 32), (int)crc_fold_k192,
+                                    (int)(crc_fold_k128 >> 32), (int)crc_fold_k128);
+    uint8_t first[16];
+    memcpy(first, data, 16);
+    first[0] ^= crc;    // the initial value enters as the first byte
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)first), reverse);
+    data += 16;
+    len -= 16;
+    for (; len >= 16; len -= 16, data += 16)
+    {
+        __m128i next = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), reverse);
+        x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+                                        _mm_clmulepi64_si128(x, k, 0x00)),
+                          next);
+    }
+    uint8_t rest[16];
+    _mm_storeu_si128((__m128i*)rest, _mm_shuffle_epi8(x, reverse));
+    crc = CRCSlice8(0, rest, sizeof(rest));
+    return CRCSlice8(crc, data, len);
+}
+#endif
+
+bool CRCImplSupported(ECRCImpl impl)
+{
+    CRCSetupTables();
+    if (impl == E_CRC_CLMUL)
+        return crc_have_clmul;
+    return impl <= E_CRC_AUTO;
+}
+
+const char* CRCImplName(ECRCImpl impl)
+{
+    switch (impl)
+    {
+    case E_CRC_BITWISE:
+        return "bitwise";
+    case E_CRC_TABLE:
+        return "table";
+    case E_CRC_SLICE8:
+        return "slice8";
+    case E_CRC_CLMUL:
+        return "clmul";
+    default:
+        return "auto";
+    }
+}
+
+void CRCUpdateWith(ECRCImpl impl, CRCContext* ctx, const uint8_t* data, size_t len)
+{
+    CRCSetupTables();
+    switch (impl)
+    {
+    case E_CRC_BITWISE:
+        ctx->crc = CRCBitwise(ctx->crc, data, len);
+        return;
+    case E_CRC_TABLE:
+        ctx->crc = CRCTable(ctx->crc, data, len);
+        return;
+    case E_CRC_SLICE8:
+        ctx->crc = CRCSlice8(ctx->crc, data, len);
+        return;
+    default:
+        break;
+    }
+#ifdef CRC_HAVE_CLMUL
+    if (crc_have_clmul)
+    {
+        ctx->crc = CRCClmul(ctx->crc, data, len);
+        return;
+    }
+#endif
+    ctx->crc = CRCSlice8(ctx->crc, data, len);
+}
+
+// a * b mod P
+static uint8_t CRCMulMod(uint8_t a, uint8_t b)
+{
+    unsigned r = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        r <<= 1;
+        if (r & 0x100)
+            r ^= 0x107;
+        if (b & (1 << i))
+            r ^= a;
+    }
+    return (uint8_t)r;
+}
+
+// Running the CRC over n zero bytes multiplies the state by x^(8n) mod P,
+// CRC(A || B) = CRC(A) * x^(8 len(B)) + CRC(B).
+uint8_t CRCCombine(uint8_t crc1, uint8_t crc2, size_t len2)
+{
+    uint8_t power = (uint8_t)CRCXPowMod(8);  // x^8 mod P
+    uint8_t result = crc1;
+    while (len2)
+    {
+        if (len2 & 1)
+            result = CRCMulMod(result, power);
+        power = CRCMulMod(power, power);
+        len2 >>= 1;
+    }
+    return result ^ crc2;
+}
+
+void CRCInit(CRCContext* ctx)
+{
+    CRCSetupTables();
+    ctx->crc = 0;
+}
+
+void CRCUpdate(CRCContext* ctx, const uint8_t* data, size_t len)
+{
+    CRCUpdateWith(E_CRC_AUTO, ctx, data, len);
+}
+
+uint8_t CRCFinal(const CRCContext* ctx)
+{
+    return ctx->crc;
+}
+
+void BindCRC(CRCContext* ctx)
+{
+    t_Crc = ctx;
+}
+
+void InitCRC()
+{
+    CRCInit(t_Crc ? t_Crc : &gCrc);
+}
+
+void ProcessCRC(const uint8_t *data, int len)
+{
+    CRCUpdate(t_Crc ? t_Crc : &gCrc, data, len);
 }
 
 uint8_t GetCRC()
 {
-    return (uint8_t)(gCrc >> 8);
+    return CRCFinal(t_Crc ? t_Crc : &gCrc);
 }
@@ -1,7 +1,41 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+// CRC-8 with polynomial x^8 + x^2 + x + 1 (0x07), initial value 0, as
+// computed by the RTD2662 CRC unit (register 0x75).
+struct CRCContext
+{
+    uint8_t crc;
+};
+
+enum ECRCImpl
+{
+    E_CRC_BITWISE = 0,  // reference bit loop
+    E_CRC_TABLE = 1,    // one 256 entry table lookup per byte
+    E_CRC_SLICE8 = 2,   // slicing-by-8, eight tables
+    E_CRC_CLMUL = 3,    // carry-less multiply folding (x86 PCLMULQDQ)
+    E_CRC_AUTO = 4      // fastest one supported by this CPU
+};
+
+void CRCInit(CRCContext* ctx);
+void CRCUpdate(CRCContext* ctx, const uint8_t* data, size_t len);
+uint8_t CRCFinal(const CRCContext* ctx);
+
+// Update with a given implementation, falling back to the fastest supported
+// one when 'impl' is not available on this CPU.
+void CRCUpdateWith(ECRCImpl impl, CRCContext* ctx, const uint8_t* data, size_t len);
+bool CRCImplSupported(ECRCImpl impl);
+const char* CRCImplName(ECRCImpl impl);
+
+// CRC of A followed by B, given the CRC of A, the CRC of B and B's length.
+uint8_t CRCCombine(uint8_t crc1, uint8_t crc2, size_t len2);
+
+// Running CRC of the calling thread, kept for the existing callers. It lives
+// in 'ctx' once bound, in a process-wide context otherwise. The first
+// CRCInit() sets up the tables and must happen before threads share them.
+void BindCRC(CRCContext* ctx);
 void InitCRC();
 void ProcessCRC(const uint8_t *data, int len);
-uint8_t GetCRC();
\ No newline at end of file
+uint8_t GetCRC();
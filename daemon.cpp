@@ -0,0 +1,554 @@
+// daemon.cpp : Long-running job server on a Unix domain socket.
+//
+// Every adapter is opened once and its device prepared (ISP mode, JEDEC ID,
+// flash commands, link tuning); jobs then run on the warm sessions without
+// that startup. Clients send one request per line and get one reply line,
+// "ok ..." or "error ...":
+//
+//   dump <file> [size=<KB>] [device=<n>] [sparse]
+//   program <image> [size=<KB>] [device=<n>] [diff] [verify]
+//   verify <image> [size=<KB>] [device=<n>]
+//   identify <index> [size=<KB>] [device=<n>]
+//       queue a job, replying "ok <id>"
+//   status
+//       "ok <n>" followed by one line per job still known:
+//       "<id> <state> <device> <seconds> <command> <file> <progress>"
+//   cancel <id>
+//       drop a job that has not started yet
+//   shutdown
+//       finish the running jobs, cancel the queued ones and exit
+//
+// File names are taken as they are, relative to the daemon's directory,
+// and can't contain spaces.
+#include "stdafx.h"
+#include "daemon.h"
+#include "session.h"
+#include "thread.h"
+
+#ifdef __linux__
+
+#include <stdarg.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Jobs remembered, finished ones being forgotten oldest first, how often
+// idle sessions look for new ones and how long the server waits for
+// requests before checking for a stop.
+#define DAEMON_MAX_JOBS 256
+#define DAEMON_POLL_US 20000
+#define DAEMON_WAIT_MS 200
+
+// Clients connected at once, longest request line, how long a client may
+// take to finish a line it started and how long a reply may wait for a
+// client not reading them.
+#define DAEMON_MAX_CLIENTS 16
+#define DAEMON_LINE_SIZE 1280
+#define DAEMON_CLIENT_TIMEOUT_S 10
+#define DAEMON_SEND_TIMEOUT_MS 1000
+
+enum EJobState
+{
+    E_JOB_FREE,
+    E_JOB_QUEUED,
+    E_JOB_RUNNING,
+    E_JOB_DONE,
+    E_JOB_FAILED,
+    E_JOB_CANCELLED
+};
+
+static const char* const JobStateNames[] =
+{
+    "free", "queued", "running", "done", "failed", "cancelled"
+};
+
+struct DaemonJob
+{
+    uint32_t      id;
+    EJobState     state;
+    DaemonRequest request;
+    int           device;       // session running it, -1 before
+    uint64_t      queued_us;
+    uint64_t      started_us;
+    uint64_t      finished_us;
+    char          progress[96];
+};
+
+// Jobs live in slot id % DAEMON_MAX_JOBS. Everything below 'lock' is
+// guarded by it.
+struct Daemon
+{
+    const DaemonHooks* hooks;
+    Session*           sessions;
+    int                count;
+    int                listen_fd;
+    Mutex              lock;
+    DaemonJob          jobs[DAEMON_MAX_JOBS];
+    DaemonJob**        running;     // per session
+    uint32_t           next_id;
+    bool               stopping;
+};
+
+static volatile sig_atomic_t g_StopSignal = 0;
+
+static void StopHandler(int)
+{
+    g_StopSignal = 1;
+}
+
+static bool IsStopping(Daemon* daemon)
+{
+    LockMutex(&daemon->lock);
+    bool stopping = daemon->stopping;
+    UnlockMutex(&daemon->lock);
+    return stopping;
+}
+
+static void Stop(Daemon* daemon)
+{
+    LockMutex(&daemon->lock);
+    daemon->stopping = true;
+    for (uint32_t i = 0; i < DAEMON_MAX_JOBS; i++)
+    {
+        if (daemon->jobs[i].state == E_JOB_QUEUED)
+            daemon->jobs[i].state = E_JOB_CANCELLED;
+    }
+    UnlockMutex(&daemon->lock);
+}
+
+// Oldest queued job 'device' may take. Call with the lock held.
+static DaemonJob* NextJob(Daemon* daemon, int device)
+{
+    uint32_t first = daemon->next_id > DAEMON_MAX_JOBS ? daemon->next_id - DAEMON_MAX_JOBS : 1;
+    for (uint32_t id = first; id < daemon->next_id; id++)
+    {
+        DaemonJob* job = &daemon->jobs[id % DAEMON_MAX_JOBS];
+        if (job->id == id && job->state == E_JOB_QUEUED &&
+            (job->request.device < 0 || job->request.device == device))
+            return job;
+    }
+    return NULL;
+}
+
+static void DaemonProgress(Session* session, const char* text)
+{
+    Daemon* daemon = (Daemon*)session->progress_arg;
+    LockMutex(&daemon->lock);
+    DaemonJob* job = daemon->running[session - daemon->sessions];
+    if (job)
+    {
+        strncpy(job->progress, text, sizeof(job->progress) - 1);
+        job->progress[sizeof(job->progress) - 1] = 0;
+    }
+    UnlockMutex(&daemon->lock);
+}
+
+// Session thread: prepare the device, then run jobs until the daemon stops.
+static bool DaemonWorker(Session* session, void* arg)
+{
+    Daemon* daemon = (Daemon*)arg;
+    const DaemonHooks* hooks = daemon->hooks;
+    int device = (int)(session - daemon->sessions);
+    session->progress = DaemonProgress;
+    session->progress_arg = daemon;
+    bool open = hooks->open_device(session, hooks->arg);
+    // Whether the device was fine at the end: opened and its last job done.
+    bool healthy = open;
+    if (!open)
+        fprintf(stderr, "%s: device not ready, trying again with the first job\n", session->name);
+
+    for (;;)
+    {
+        LockMutex(&daemon->lock);
+        if (daemon->stopping)
+        {
+            UnlockMutex(&daemon->lock);
+            break;
+        }
+        DaemonJob* job = NextJob(daemon, device);
+        DaemonRequest request;
+        if (job)
+        {
+            job->state = E_JOB_RUNNING;
+            job->device = device;
+            job->started_us = HostTimeUs();
+            request = job->request;
+            daemon->running[device] = job;
+        }
+        UnlockMutex(&daemon->lock);
+        if (job == NULL)
+        {
+            usleep(DAEMON_POLL_US);
+            continue;
+        }
+
+        fprintf(stderr, "%s: job %u, %s %s\n", session->name, job->id,
+                request.command, request.file);
+        if (!open)
+            open = hooks->open_device(session, hooks->arg);
+        bool ok = open && hooks->run_job(session, &request, hooks->arg);
+        healthy = ok;
+        // A failed job may have left the device anywhere and a programmed
+        // one restarts into its new firmware, both need ISP mode again.
+        if (!ok || strcmp(request.command, "program") == 0)
+            open = false;
+
+        LockMutex(&daemon->lock);
+        job->state = ok ? E_JOB_DONE : E_JOB_FAILED;
+        job->finished_us = HostTimeUs();
+        daemon->running[device] = NULL;
+        UnlockMutex(&daemon->lock);
+        fprintf(stderr, "%s: job %u %s\n", session->name, job->id, ok ? "done" : "failed");
+    }
+    session->progress = NULL;
+    return healthy;
+}
+
+static bool ParseRequest(char* line, DaemonRequest* request, const char** error)
+{
+    memset(request, 0, sizeof(*request));
+    request->device = -1;
+    char* save = NULL;
+    char* command = strtok_r(line, " \t", &save);
+    char* file = strtok_r(NULL, " \t", &save);
+    if (file == NULL || strlen(file) >= sizeof(request->file))
+    {
+        *error = "missing file";
+        return false;
+    }
+    strcpy(request->command, command);
+    strcpy(request->file, file);
+    for (char* arg; (arg = strtok_r(NULL, " \t", &save)) != NULL; )
+    {
+        if (strncmp(arg, "size=", 5) == 0)
+            request->size_kb = strtoul(arg + 5, NULL, 0);
+        else if (strncmp(arg, "device=", 7) == 0)
+            request->device = atoi(arg + 7);
+        else if (strcmp(arg, "sparse") == 0)
+            request->sparse = true;
+        else if (strcmp(arg, "diff") == 0)
+            request->differential = true;
+        else if (strcmp(arg, "verify") == 0)
+            request->verify = true;
+        else
+        {
+            *error = "unknown option";
+            return false;
+        }
+    }
+    return true;
+}
+
+static void Reply(int fd, const char* format, ...)
+{
+    char text[DAEMON_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text) - 1, format, args);
+    va_end(args);
+    if (len < 0 || len > (int)sizeof(text) - 2)
+        len = sizeof(text) - 2;
+    text[len++] = '\n';
+    send(fd, text, len, MSG_NOSIGNAL);
+}
+
+static void QueueJob(Daemon* daemon, int fd, char* line)
+{
+    DaemonRequest request;
+    const char* error = NULL;
+    if (!ParseRequest(line, &request, &error))
+    {
+        Reply(fd, "error %s", error);
+        return;
+    }
+    if (request.device >= daemon->count)
+    {
+        Reply(fd, "error no device %d", request.device);
+        return;
+    }
+    LockMutex(&daemon->lock);
+    DaemonJob* job = &daemon->jobs[daemon->next_id % DAEMON_MAX_JOBS];
+    uint32_t id = 0;
+    if (!daemon->stopping && job->state != E_JOB_QUEUED && job->state != E_JOB_RUNNING)
+    {
+        id = daemon->next_id++;
+        memset(job, 0, sizeof(*job));
+        job->id = id;
+        job->state = E_JOB_QUEUED;
+        job->request = request;
+        job->device = -1;
+        job->queued_us = HostTimeUs();
+    }
+    UnlockMutex(&daemon->lock);
+    if (id == 0)
+        Reply(fd, "error %s", daemon->stopping ? "shutting down" : "queue full");
+    else
+        Reply(fd, "ok %u", id);
+}
+
+static void ReportStatus(Daemon* daemon, int fd)
+{
+    // Formatted under the lock, sent without it.
+    static char report[DAEMON_MAX_JOBS * 160];
+    uint32_t used = 0;
+    uint32_t lines = 0;
+    uint64_t now = HostTimeUs();
+    LockMutex(&daemon->lock);
+    uint32_t first = daemon->next_id > DAEMON_MAX_JOBS ? daemon->next_id - DAEMON_MAX_JOBS : 1;
+    for (uint32_t id = first; id < daemon->next_id; id++)
+    {
+        const DaemonJob* job = &daemon->jobs[id % DAEMON_MAX_JOBS];
+        if (job->id != id || job->state == E_JOB_FREE)
+            continue;
+        uint64_t start = job->state == E_JOB_QUEUED ? job->queued_us : job->started_us;
+        uint64_t end = (job->state == E_JOB_QUEUED || job->state == E_JOB_RUNNING) ? now : job->finished_us;
+        if (job->state == E_JOB_CANCELLED)
+            end = start;
+        int len = snprintf(report + used, sizeof(report) - used, "%u %s %d %.1f %s %.60s %s\n",
+                           id, JobStateNames[job->state], job->device, (end - start) / 1e6,
+                           job->request.command, job->request.file,
+                           job->state == E_JOB_RUNNING ? job->progress : "-");
+        if (len < 0 || used + len >= sizeof(report))
+            break;
+        used += len;
+        lines++;
+    }
+    UnlockMutex(&daemon->lock);
+    Reply(fd, "ok %u", lines);
+    send(fd, report, used, MSG_NOSIGNAL);
+}
+
+static void CancelJob(Daemon* daemon, int fd, const char* arg)
+{
+    uint32_t id = arg ? strtoul(arg, NULL, 0) : 0;
+    LockMutex(&daemon->lock);
+    DaemonJob* job = &daemon->jobs[id % DAEMON_MAX_JOBS];
+    bool cancelled = id != 0 && job->id == id && job->state == E_JOB_QUEUED;
+    if (cancelled)
+        job->state = E_JOB_CANCELLED;
+    UnlockMutex(&daemon->lock);
+    if (cancelled)
+        Reply(fd, "ok %u", id);
+    else
+        Reply(fd, "error job %u is not queued", id);
+}
+
+static void HandleRequest(Daemon* daemon, int fd, char* line)
+{
+    char copy[DAEMON_LINE_SIZE];
+    strcpy(copy, line);
+    char* save = NULL;
+    char* command = strtok_r(copy, " \t", &save);
+    if (command == NULL)
+        return;
+    if (strcmp(command, "dump") == 0 || strcmp(command, "program") == 0 ||
+        strcmp(command, "verify") == 0 || strcmp(command, "identify") == 0)
+    {
+        QueueJob(daemon, fd, line);
+    }
+    else if (strcmp(command, "status") == 0)
+    {
+        ReportStatus(daemon, fd);
+    }
+    else if (strcmp(command, "cancel") == 0)
+    {
+        CancelJob(daemon, fd, strtok_r(NULL, " \t", &save));
+    }
+    else if (strcmp(command, "shutdown") == 0)
+    {
+        Stop(daemon);
+        Reply(fd, "ok");
+    }
+    else
+    {
+        Reply(fd, "error unknown command %.32s", command);
+    }
+}
+
+// A connected client and the part of its next request line received.
+struct DaemonClient
+{
+    int      fd;
+    uint32_t len;
+    uint64_t line_us;   // when the pending part of the line started
+    char     line[DAEMON_LINE_SIZE];
+};
+
+static void AcceptClient(DaemonClient* clients, int* num_clients, int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (*num_clients == DAEMON_MAX_CLIENTS)
+    {
+        Reply(fd, "error too many clients");
+        close(fd);
+        return;
+    }
+    struct timeval timeout = {DAEMON_SEND_TIMEOUT_MS / 1000, DAEMON_SEND_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    DaemonClient* client = &clients[(*num_clients)++];
+    client->fd = fd;
+    client->len = 0;
+}
+
+// Handle the complete lines a readable client sent. Returns false once the
+// client closed the connection or sent an over-long line.
+static bool ReadClient(Daemon* daemon, DaemonClient* client)
+{
+    char* line = client->line;
+    ssize_t got = recv(client->fd, line + client->len, sizeof(client->line) - 1 - client->len,
+                       MSG_DONTWAIT);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+        return false;
+    if (got < 0)
+        return true;
+    if (client->len == 0)
+        client->line_us = HostTimeUs();
+    client->len += got;
+    char* start = line;
+    char* end;
+    while ((end = (char*)memchr(start, '\n', line + client->len - start)) != NULL)
+    {
+        *end = 0;
+        if (end > start && end[-1] == '\r')
+            end[-1] = 0;
+        HandleRequest(daemon, client->fd, start);
+        start = end + 1;
+    }
+    client->len -= start - line;
+    memmove(line, start, client->len);
+    if (start != line)
+        client->line_us = HostTimeUs();
+    if (client->len == sizeof(client->line) - 1)
+    {
+        Reply(client->fd, "error line too long");
+        return false;
+    }
+    return true;
+}
+
+// Serve all clients at once from one poll() over the listening socket and
+// the connections, so a client keeping its connection open holds up
+// neither the others nor a stop.
+static void DaemonServer(void* arg)
+{
+    Daemon* daemon = (Daemon*)arg;
+    DaemonClient* clients = new DaemonClient[DAEMON_MAX_CLIENTS];
+    int num_clients = 0;
+    while (!IsStopping(daemon))
+    {
+        if (g_StopSignal)
+        {
+            Stop(daemon);
+            break;
+        }
+        struct pollfd pfd[DAEMON_MAX_CLIENTS + 1];
+        pfd[0].fd = daemon->listen_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        for (int i = 0; i < num_clients; i++)
+        {
+            pfd[i + 1].fd = clients[i].fd;
+            pfd[i + 1].events = POLLIN;
+            pfd[i + 1].revents = 0;
+        }
+        int polled = num_clients;
+        if (poll(pfd, polled + 1, DAEMON_WAIT_MS) < 0 && errno != EINTR)
+            break;
+
+        // Clients leave by moving the last one into their place, so walk
+        // the ones polled backwards.
+        uint64_t now = HostTimeUs();
+        for (int i = polled - 1; i >= 0; i--)
+        {
+            DaemonClient* client = &clients[i];
+            bool keep = true;
+            if (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+                keep = ReadClient(daemon, client);
+            if (keep && client->len > 0 &&
+                now > client->line_us + DAEMON_CLIENT_TIMEOUT_S * 1000000ull)
+                keep = false;
+            if (!keep)
+            {
+                close(client->fd);
+                *client = clients[--num_clients];
+            }
+        }
+        if (pfd[0].revents & POLLIN)
+            AcceptClient(clients, &num_clients, daemon->listen_fd);
+    }
+    for (int i = 0; i < num_clients; i++)
+        close(clients[i].fd);
+    delete [] clients;
+}
+
+static int Listen(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    // A socket left behind by a daemon that did not exit cleanly.
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0)
+    {
+        fprintf(stderr, "Can't listen on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int RunDaemon(const char* path, Session* sessions, int count, const DaemonHooks* hooks)
+{
+    Daemon* daemon = new Daemon;
+    memset(daemon, 0, sizeof(*daemon));
+    daemon->hooks = hooks;
+    daemon->sessions = sessions;
+    daemon->count = count;
+    daemon->next_id = 1;
+    daemon->running = new DaemonJob*[count];
+    memset(daemon->running, 0, count * sizeof(DaemonJob*));
+    daemon->listen_fd = Listen(path);
+    if (daemon->listen_fd < 0)
+    {
+        delete [] daemon->running;
+        delete daemon;
+        return count;
+    }
+    InitMutex(&daemon->lock);
+    signal(SIGINT, StopHandler);
+    signal(SIGTERM, StopHandler);
+
+    Thread server;
+    int failed = count;
+    fprintf(stderr, "Serving %d device%s on %s\n", count, count == 1 ? "" : "s", path);
+    if (StartThread(&server, DaemonServer, daemon))
+    {
+        // The workers keep retrying a device that can't be opened and only
+        // return once the server stops them, counting the unhealthy ones.
+        failed = RunSessions(sessions, count, count, DaemonWorker, daemon);
+        Stop(daemon);
+        JoinThread(&server);
+    }
+    close(daemon->listen_fd);
+    unlink(path);
+    FreeMutex(&daemon->lock);
+    delete [] daemon->running;
+    delete daemon;
+    return failed;
+}
+
+#endif
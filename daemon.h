@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Session;
+
+// One job as submitted to the daemon.
+struct DaemonRequest
+{
+    char     command[16];   // "dump", "program", "verify" or "identify"
+    char     file[1024];    // dump, image or index file
+    uint32_t size_kb;       // 0 for the size of the chip
+    int      device;        // session index, -1 for the first one free
+    bool     sparse;        // dump: skip blank windows
+    bool     differential;  // program: only the blocks that differ
+    bool     verify;        // program: read back the programmed pages
+};
+
+struct DaemonHooks
+{
+    // Prepare the session's device (ISP mode, chip, commands). Called once
+    // when the daemon starts and again before the job following a failed
+    // or a program job.
+    bool (*open_device)(Session* session, void* arg);
+    // Run 'request' on the prepared device.
+    bool (*run_job)(Session* session, const DaemonRequest* request, void* arg);
+    void* arg;
+};
+
+#ifdef __linux__
+// Keep 'sessions' open and run the jobs clients queue on the Unix domain
+// socket at 'path', each on the first free session allowed to take it,
+// until a client sends "shutdown" or the process gets SIGINT or SIGTERM.
+// Returns the number of sessions whose device could not be opened or
+// failed its last job.
+int RunDaemon(const char* path, Session* sessions, int count, const DaemonHooks* hooks);
+#endif
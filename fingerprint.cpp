@@ -0,0 +1,266 @@
+// fingerprint.cpp : Firmware index and identification by on-chip CRCs.
+//
+// The index is a text file:
+//
+//   RTD index 1 <block size>
+//   <name> <image size> <block CRCs, two hex digits each>
+//
+// Sizes are hexadecimal.
+#include "stdafx.h"
+#include <limits.h>
+#include "fingerprint.h"
+
+void InitIndex(FirmwareIndex* index, uint32_t block_size)
+{
+    memset(index, 0, sizeof(*index));
+    index->block_size = block_size;
+}
+
+void AddIndexEntry(FirmwareIndex* index, const char* name, uint32_t size, const uint8_t* block_crc)
+{
+    if (index->count == index->capacity)
+    {
+        uint32_t capacity = index->capacity ? index->capacity * 2 : 64;
+        FirmwareEntry* entries = new FirmwareEntry[capacity];
+        if (index->count)
+            memcpy(entries, index->entries, index->count * sizeof(FirmwareEntry));
+        delete [] index->entries;
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    FirmwareEntry* entry = &index->entries[index->count++];
+    memset(entry->name, 0, sizeof(entry->name));
+    for (uint32_t i = 0; name[i] && i + 1 < sizeof(entry->name); i++)
+        entry->name[i] = (name[i] == ' ' || name[i] == '\t') ? '_' : name[i];
+    entry->size = size;
+    entry->blocks = size / index->block_size;
+    entry->block_crc = new uint8_t[entry->blocks];
+    memcpy(entry->block_crc, block_crc, entry->blocks);
+}
+
+static int HexDigit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool LoadIndex(const char* file_name, FirmwareIndex* index)
+{
+    FILE* fp = NULL;
+    if (fopen_s(&fp, file_name, "r") != 0 || fp == NULL)
+    {
+        fprintf(stderr, "Can't open index %s\n", file_name);
+        return false;
+    }
+    unsigned block_size = 0;
+    if (fscanf(fp, "RTD index 1 %x", &block_size) != 1 || block_size == 0 || block_size % 256)
+    {
+        fprintf(stderr, "%s is no firmware index\n", file_name);
+        fclose(fp);
+        return false;
+    }
+    InitIndex(index, block_size);
+    char name[128];
+    unsigned size;
+    uint8_t* crc = NULL;
+    uint32_t crc_capacity = 0;
+    while (fscanf(fp, "%127s %x", name, &size) == 2)
+    {
+        uint32_t blocks = size / block_size;
+        if (blocks > crc_capacity || crc == NULL)
+        {
+            delete [] crc;
+            crc = new uint8_t[blocks + 1];
+            crc_capacity = blocks;
+        }
+        int c = fgetc(fp);
+        while (c == ' ' || c == '\t')
+            c = fgetc(fp);
+        uint32_t got = 0;
+        for (; got < blocks; got++)
+        {
+            int hi = HexDigit(c);
+            int lo = HexDigit(fgetc(fp));
+            if (hi < 0 || lo < 0)
+                break;
+            crc[got] = (uint8_t)(hi << 4 | lo);
+            c = fgetc(fp);
+        }
+        if (got != blocks)
+        {
+            fprintf(stderr, "%s: entry %s is damaged\n", file_name, name);
+            break;
+        }
+        AddIndexEntry(index, name, size, crc);
+    }
+    delete [] crc;
+    fclose(fp);
+    return true;
+}
+
+bool SaveIndex(const char* file_name, const FirmwareIndex* index)
+{
+    FILE* fp = NULL;
+    if (fopen_s(&fp, file_name, "w") != 0 || fp == NULL)
+    {
+        fprintf(stderr, "Can't create index %s\n", file_name);
+        return false;
+    }
+    fprintf(fp, "RTD index 1 %x\n", index->block_size);
+    for (uint32_t i = 0; i < index->count; i++)
+    {
+        const FirmwareEntry* entry = &index->entries[i];
+        fprintf(fp, "%s %x ", entry->name, entry->size);
+        for (uint32_t b = 0; b < entry->blocks; b++)
+            fprintf(fp, "%02x", entry->block_crc[b]);
+        fprintf(fp, "\n");
+    }
+    return fclose(fp) == 0;
+}
+
+void FreeIndex(FirmwareIndex* index)
+{
+    for (uint32_t i = 0; i < index->count; i++)
+        delete [] index->entries[i].block_crc;
+    delete [] index->entries;
+    memset(index, 0, sizeof(*index));
+}
+
+// Block telling the entries scoring 'lead' apart best: the one with the
+// most outcomes among them, and among those the one covered by the most of
+// them. Each CRC the covering entries expect is an outcome, and leaving the
+// block uncovered is one more, since a probe then scores the covering
+// entries only. Returns false when no unprobed block separates them and
+// they need no more confirmation.
+static bool ChooseProbe(const FirmwareIndex* index, const int* score, int lead,
+                        const bool* probed, uint32_t blocks, bool confirm, uint32_t* block)
+{
+    uint32_t best_outcomes = 0;
+    uint32_t best_cover = 0;
+    for (uint32_t b = 0; b < blocks; b++)
+    {
+        if (probed[b])
+            continue;
+        uint8_t seen[256];
+        memset(seen, 0, sizeof(seen));
+        uint32_t outcomes = 0;
+        uint32_t cover = 0;
+        uint32_t uncovered = 0;
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+            const FirmwareEntry* entry = &index->entries[i];
+            if (score[i] != lead)
+                continue;
+            if (b >= entry->blocks)
+            {
+                uncovered++;
+                continue;
+            }
+            cover++;
+            if (!seen[entry->block_crc[b]])
+            {
+                seen[entry->block_crc[b]] = 1;
+                outcomes++;
+            }
+        }
+        if (cover > 0 && uncovered > 0)
+            outcomes++;
+        if (outcomes > best_outcomes || (outcomes == best_outcomes && cover > best_cover))
+        {
+            best_outcomes = outcomes;
+            best_cover = cover;
+            *block = b;
+        }
+    }
+    // A block all leaders agree on only confirms them.
+    return best_outcomes > 1 || (confirm && best_outcomes == 1);
+}
+
+void IdentifyFirmware(const FirmwareIndex* index, uint32_t chip_size, BlockCRCProbe probe,
+                      uint32_t min_probes, uint32_t max_probes, IdentifyResult* result)
+{
+    memset(result, 0, sizeof(*result));
+    if (index->count == 0)
+        return;
+    uint32_t blocks = chip_size / index->block_size;
+    int* score = new int[index->count];
+    int* matches = new int[index->count];
+    uint32_t* covered = new uint32_t[index->count];
+    bool* probed = new bool[blocks + 1];
+    memset(score, 0, index->count * sizeof(int));
+    memset(matches, 0, index->count * sizeof(int));
+    memset(covered, 0, index->count * sizeof(uint32_t));
+    memset(probed, 0, blocks + 1);
+
+    int lead = 0;
+    uint32_t leaders = index->count;
+    uint32_t leader = 0;
+    while (result->probes < max_probes)
+    {
+        uint32_t block = 0;
+        bool confirm = result->probes < min_probes ||
+                       (leaders == 1 && matches[leader] < (int)min_probes);
+        if (!ChooseProbe(index, score, lead, probed, blocks, confirm, &block))
+            break;
+        probed[block] = true;
+        uint8_t crc;
+        bool got = probe(block * index->block_size, index->block_size, &crc);
+        result->probes++;
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+            if (block < index->entries[i].blocks)
+                covered[i]++;
+        }
+        if (!got)
+            continue;
+
+        lead = INT_MIN;
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+            const FirmwareEntry* entry = &index->entries[i];
+            if (block < entry->blocks)
+            {
+                bool match = entry->block_crc[block] == crc;
+                score[i] += match ? 1 : -1;
+                matches[i] += match ? 1 : 0;
+            }
+            if (score[i] > lead)
+            {
+                lead = score[i];
+                leaders = 0;
+            }
+            if (score[i] == lead)
+            {
+                leaders++;
+                leader = i;
+            }
+        }
+        if (leaders == 1 && matches[leader] >= (int)min_probes)
+            break;
+    }
+
+    // Among equal scores the entry with more agreeing probes is closer.
+    for (uint32_t i = 0; i < index->count; i++)
+    {
+        if (score[i] == lead && (result->best == NULL || matches[i] > (int)result->matches))
+        {
+            result->best = &index->entries[i];
+            result->covered = covered[i];
+            result->matches = matches[i];
+        }
+    }
+    for (uint32_t i = 0; i < index->count; i++)
+    {
+        if (score[i] == lead && matches[i] == (int)result->matches && &index->entries[i] != result->best)
+            result->ties++;
+    }
+    delete [] probed;
+    delete [] covered;
+    delete [] matches;
+    delete [] score;
+}
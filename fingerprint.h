@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+// Known firmware, as the CRC-8 of each whole block of its image (the CRC
+// the chip computes over a range, see SPIComputeCRC). A partial last block
+// is left out, the chip holds something unknown behind the image.
+struct FirmwareEntry
+{
+    char     name[128];
+    uint32_t size;
+    uint32_t blocks;
+    uint8_t* block_crc;
+};
+
+// Index of firmware images, all summarized with the same block size.
+struct FirmwareIndex
+{
+    uint32_t       block_size;
+    uint32_t       count;
+    uint32_t       capacity;
+    FirmwareEntry* entries;
+};
+
+#define FINGERPRINT_BLOCK_SIZE (4 * 1024)
+
+void InitIndex(FirmwareIndex* index, uint32_t block_size);
+// Add an image by its block CRCs; 'name' is stored without spaces.
+void AddIndexEntry(FirmwareIndex* index, const char* name, uint32_t size, const uint8_t* block_crc);
+bool LoadIndex(const char* file_name, FirmwareIndex* index);
+bool SaveIndex(const char* file_name, const FirmwareIndex* index);
+void FreeIndex(FirmwareIndex* index);
+
+// CRC the chip computes over [addr, addr + len), false when it could not.
+typedef bool (*BlockCRCProbe)(uint32_t addr, uint32_t len, uint8_t* crc);
+
+struct IdentifyResult
+{
+    const FirmwareEntry* best;      // NULL when the index is empty
+    uint32_t             probes;
+    uint32_t             covered;   // probes inside 'best', failed ones included
+    uint32_t             matches;   // probes agreeing with 'best'
+    uint32_t             ties;      // other entries as good as 'best'
+};
+
+// Find the entry closest to the firmware on the chip. Each probe asks the
+// chip for the CRC of the block telling the leading entries apart best,
+// until one entry leads alone and agrees with at least 'min_probes' probes,
+// or 'max_probes' were spent. At least 'min_probes' blocks are probed while
+// any is left, even when the leaders agree on all of them. Entries score one per agreeing probe and lose
+// one per disagreeing probe, so the closest image still wins when the
+// installed one is not in the index. A failed probe scores nothing.
+void IdentifyFirmware(const FirmwareIndex* index, uint32_t chip_size, BlockCRCProbe probe,
+                      uint32_t min_probes, uint32_t max_probes, IdentifyResult* result);
@@ -167,3 +167,310 @@ bool DecodeGff(uint8_t* data_ptr, uint32_t data_len, uint8_t* dest)
     }
     return true;
 }
+
+// Table driven decoder. The prefix codes of gff_decode_nibble() are at most
+// 8 bits long, so the next 8 bits of the stream select one entry giving the
+// nibble and the code length.
+#define GFF_SIX_ZEROS 0xf0  // end of stream or error, see gff_decode_nibble
+#define GFF_INVALID   0xff
+
+struct GffCode
+{
+    uint8_t code;
+    uint8_t bits;
+    uint8_t nibble;
+};
+
+static const GffCode gff_codes[] =
+{
+    {0x01, 1, 0x0},  // 1
+    {0x02, 3, 0x1},  // 010
+    {0x03, 3, 0xf},  // 011
+    {0x02, 4, 0x2},  // 0010
+    {0x03, 4, 0x8},  // 0011
+    {0x02, 5, 0xc},  // 00010
+    {0x03, 5, 0x7},  // 00011
+    {0x06, 7, 0x4},  // 0000110
+    {0x07, 7, 0x9},  // 0000111
+    {0x0a, 8, 0xa},  // 00001010
+    {0x0b, 8, 0x5},  // 00001011
+    {0x08, 8, 0x3},  // 00001000
+    {0x09, 8, 0xb},  // 00001001
+    {0x06, 8, 0xe},  // 00000110
+    {0x07, 8, 0xd},  // 00000111
+    {0x05, 8, 0x6},  // 00000101
+    {0x04, 8, GFF_INVALID},    // 00000100
+    {0x00, 6, GFF_SIX_ZEROS},  // 000000
+};
+
+static uint8_t gff_lookup_nibble[256];
+static uint8_t gff_lookup_bits[256];
+// Code of both nibbles of a byte, right aligned, and its length.
+static uint16_t gff_byte_code[256];
+static uint8_t gff_byte_bits[256];
+static bool gff_lookup_ready = false;
+
+static void gff_setup_lookup()
+{
+    if (gff_lookup_ready)
+        return;
+    for (size_t i = 0; i < sizeof(gff_codes) / sizeof(gff_codes[0]); i++)
+    {
+        const GffCode& c = gff_codes[i];
+        uint32_t first = c.code << (8 - c.bits);
+        for (uint32_t idx = first; idx < first + (1u << (8 - c.bits)); idx++)
+        {
+            gff_lookup_nibble[idx] = c.nibble;
+            gff_lookup_bits[idx] = c.bits;
+        }
+    }
+    uint8_t nibble_code[16];
+    uint8_t nibble_bits[16];
+    for (size_t i = 0; i < sizeof(gff_codes) / sizeof(gff_codes[0]); i++)
+    {
+        const GffCode& c = gff_codes[i];
+        if (c.nibble <= 0xf)
+        {
+            nibble_code[c.nibble] = c.code;
+            nibble_bits[c.nibble] = c.bits;
+        }
+    }
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint8_t hi = b >> 4;
+        uint8_t lo = b & 0xf;
+        gff_byte_code[b] = (uint16_t)((nibble_code[hi] << nibble_bits[lo]) | nibble_code[lo]);
+        gff_byte_bits[b] = nibble_bits[hi] + nibble_bits[lo];
+    }
+    gff_lookup_ready = true;
+}
+
+void InitGff()
+{
+    gff_setup_lookup();
+}
+
+// MSB first bit reader over a 64 bit window, refilled 32 bits at a time.
+// Like CBitStream it behaves as if one more byte followed the data; that
+// byte and everything after it reads as zero.
+class CBitWindow
+{
+public:
+    CBitWindow(const uint8_t* data_ptr, uint32_t data_len)
+        : data_ptr_(data_ptr),
+          data_len_(data_len),
+          next_(0),
+          window_(0),
+          bits_(0),
+          pos_(0) {}
+
+    uint32_t Peek8()
+    {
+        if (bits_ < 8)
+            Refill();
+        return (uint32_t)(window_ >> 56);
+    }
+    void Skip(uint32_t n)
+    {
+        window_ <<= n;
+        bits_ -= n;
+        pos_ += n;
+    }
+    // Number of bits consumed so far.
+    uint64_t Position() const
+    {
+        return pos_;
+    }
+
+private:
+    void Refill()
+    {
+        if (next_ + 4 <= data_len_)
+        {
+            uint32_t w = ((uint32_t)data_ptr_[next_] << 24) |
+                         ((uint32_t)data_ptr_[next_ + 1] << 16) |
+                         ((uint32_t)data_ptr_[next_ + 2] << 8) |
+                         data_ptr_[next_ + 3];
+            window_ |= (uint64_t)w << (32 - bits_);
+            bits_ += 32;
+            next_ += 4;
+            return;
+        }
+        while (bits_ <= 56)
+        {
+            uint8_t b = (next_ < data_len_) ? data_ptr_[next_] : 0;
+            window_ |= (uint64_t)b << (56 - bits_);
+            bits_ += 8;
+            next_++;
+        }
+    }
+
+    const uint8_t* data_ptr_;
+    uint32_t data_len_;
+    uint32_t next_;     // next byte to load into the window
+    uint64_t window_;   // unread bits, MSB aligned
+    uint32_t bits_;     // valid bits in window_
+    uint64_t pos_;
+};
+
+// Same results as gff_decode_nibble(). 'end' is the bit position where
+// CBitStream::HasData() turns false.
+static inline uint8_t gff_next_nibble(CBitWindow* bw, uint64_t end, uint32_t data_len)
+{
+    uint32_t idx = bw->Peek8();
+    uint8_t nibble = gff_lookup_nibble[idx];
+    if (nibble <= 0xf)
+    {
+        bw->Skip(gff_lookup_bits[idx]);
+        return nibble;
+    }
+    if (nibble == GFF_INVALID)
+        return 0xff;
+
+    // Six zeros: running out of data on the way is the end of the stream,
+    // otherwise it marks the end only within the last byte.
+    if (bw->Position() + 6 > end)
+        return 0xf0;
+    bw->Skip(6);
+    uint64_t byte = (bw->Position() - 1) >> 3;
+    return (byte + 1 == data_len) ? 0xf0 : 0xff;
+}
+
+uint8_t* DecodeGffStream(const uint8_t* data_ptr, uint32_t data_len, uint32_t* size)
+{
+    gff_setup_lookup();
+    CBitWindow bw(data_ptr, data_len);
+    uint64_t end = ((uint64_t)data_len + 1) * 8;
+
+    // Firmware images compress to about half; grow by doubling.
+    uint32_t capacity = data_len * 2 + 256;
+    uint8_t* dest = new uint8_t[capacity];
+    uint32_t cnt = 0;
+    while (bw.Position() < end)
+    {
+        uint8_t n1 = gff_next_nibble(&bw, end, data_len);
+        if (n1 == 0xf0)
+            break;  // End of file
+        uint8_t n2 = (n1 == 0xff) ? 0xff : gff_next_nibble(&bw, end, data_len);
+        if (n2 > 0xf)
+        {
+            delete [] dest;
+            return NULL;
+        }
+        if (cnt == capacity)
+        {
+            uint8_t* grown = new uint8_t[capacity * 2];
+            memcpy(grown, dest, cnt);
+            delete [] dest;
+            dest = grown;
+            capacity *= 2;
+        }
+        dest[cnt++] = (n1 << 4) | n2;
+    }
+    if (cnt == 0)
+    {
+        delete [] dest;
+        return NULL;
+    }
+    *size = cnt;
+    return dest;
+}
+
+struct GffDecoder
+{
+    GffDecoder(const uint8_t* data_ptr, uint32_t data_len)
+        : bw(data_ptr, data_len),
+          end(((uint64_t)data_len + 1) * 8),
+          data_len(data_len),
+          done(false),
+          failed(false) {}
+
+    CBitWindow bw;
+    uint64_t   end;
+    uint32_t   data_len;
+    bool       done;
+    bool       failed;
+};
+
+GffDecoder* GffDecoderOpen(const uint8_t* data_ptr, uint32_t data_len)
+{
+    gff_setup_lookup();
+    return new GffDecoder(data_ptr, data_len);
+}
+
+uint32_t GffDecoderRead(GffDecoder* dec, uint8_t* dest, uint32_t len)
+{
+    uint32_t cnt = 0;
+    while (cnt < len && !dec->done)
+    {
+        if (dec->bw.Position() >= dec->end)
+        {
+            dec->done = true;
+            break;
+        }
+        uint8_t n1 = gff_next_nibble(&dec->bw, dec->end, dec->data_len);
+        if (n1 == 0xf0)
+        {
+            dec->done = true;  // End of file
+            break;
+        }
+        uint8_t n2 = (n1 == 0xff) ? 0xff : gff_next_nibble(&dec->bw, dec->end, dec->data_len);
+        if (n2 > 0xf)
+        {
+            dec->done = true;
+            dec->failed = true;
+            break;
+        }
+        dest[cnt++] = (n1 << 4) | n2;
+    }
+    return cnt;
+}
+
+bool GffDecoderFailed(const GffDecoder* dec)
+{
+    return dec->failed;
+}
+
+void GffDecoderClose(GffDecoder* dec)
+{
+    delete dec;
+}
+
+uint32_t GffEncodedMaxSize(uint32_t len)
+{
+    // At most 8 bits per nibble, plus the end marker.
+    return GFF_HEADER_SIZE + 2 * len + 1;
+}
+
+uint32_t EncodeGff(const uint8_t* data, uint32_t len, uint8_t* dest)
+{
+    gff_setup_lookup();
+    // Only the signature of the header is known; the rest is left zero.
+    memset(dest, 0, GFF_HEADER_SIZE);
+    memcpy(dest, "GMI GFF V1.0", 12);
+    uint8_t* out = dest + GFF_HEADER_SIZE;
+
+    uint64_t acc = 0;   // pending bits, right aligned
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        acc = (acc << gff_byte_bits[data[i]]) | gff_byte_code[data[i]];
+        bits += gff_byte_bits[data[i]];
+        while (bits >= 8)
+        {
+            bits -= 8;
+            *out++ = (uint8_t)(acc >> bits);
+        }
+    }
+    // Six zero bits ending in the last byte mark the end of the stream.
+    acc <<= 6;
+    bits += 6;
+    while (bits >= 8)
+    {
+        bits -= 8;
+        *out++ = (uint8_t)(acc >> bits);
+    }
+    if (bits > 0)
+        *out++ = (uint8_t)(acc << (8 - bits));
+    return (uint32_t)(out - dest);
+}
@@ -2,5 +2,36 @@
 
 #include <stdint.h>
 
+// Build the code tables of the decoders and the encoder. They are also built
+// on first use, but not safely from several threads: call once before the
+// sessions start.
+void InitGff();
+
 uint32_t ComputeGffDecodedSize(uint8_t* data_ptr, uint32_t data_len);
 bool DecodeGff(uint8_t* data_ptr, uint32_t data_len, uint8_t* dest);
+
+// Decode a GFF stream in a single pass, 8 bit code lookups at a time, into
+// a buffer that grows as needed. Returns the decoded data, allocated with
+// new[], and its size in 'size', or NULL if the stream is corrupt or empty.
+// Produces the same result as ComputeGffDecodedSize() + DecodeGff().
+uint8_t* DecodeGffStream(const uint8_t* data_ptr, uint32_t data_len, uint32_t* size);
+
+// Size of the "GMI GFF V1.0" file header preceding the coded stream.
+#define GFF_HEADER_SIZE 256
+
+// Upper bound of the size EncodeGff() produces for 'len' bytes.
+uint32_t GffEncodedMaxSize(uint32_t len);
+// Encode 'len' bytes as a GFF file: the header, the nibbles in the prefix
+// code the decoders read, and the end marker. 'dest' must hold
+// GffEncodedMaxSize(len) bytes. Returns the number of bytes written.
+uint32_t EncodeGff(const uint8_t* data, uint32_t len, uint8_t* dest);
+
+// Incremental decoder for the GFF stream data_ptr[0, data_len), e.g. a
+// memory mapped file, decoding only as much as is asked for.
+struct GffDecoder;
+GffDecoder* GffDecoderOpen(const uint8_t* data_ptr, uint32_t data_len);
+// Decode up to 'len' bytes into 'dest'. Returns the number of bytes decoded,
+// less than 'len' only at the end of the stream or on an error.
+uint32_t GffDecoderRead(GffDecoder* dec, uint8_t* dest, uint32_t len);
+bool GffDecoderFailed(const GffDecoder* dec);
+void GffDecoderClose(GffDecoder* dec);
@@ -1,102 +1,599 @@
 #include "stdafx.h"
 #include "i2c.h"
 #include "CH341DLL_EN.H"
+#include "thread.h"
+#include "trace.h"
 
-ULONG g_iIndex = 0;
-ULONG g_iDevice = 0x4a;	// RTD2662 I2C Address
+const uint32_t I2CSpeeds[I2C_NUM_SPEEDS] = {750, 400, 100, 20};
+
+uint64_t I2CTransport::NowUs()
+{
+    return HostTimeUs();
+}
+
+// Queued I2C command stream (see BeginI2CBatch). The CH341 parses its bulk
+// input in mCH341_PACKET_LENGTH byte packets, each one starting with
+// mCH341A_CMD_I2C_STREAM and terminated by mCH341A_CMD_I2C_STM_END.
+class CCH341Transport : public I2CTransport
+{
+public:
+    explicit CCH341Transport(ULONG index)
+        : m_iIndex(index), m_iDevice(0x4a), m_Speed(400), m_StreamLen(0), m_Ok(true)
+    {
+        ResetStats();
+    }
+
+    bool Open();
+    void Close();
+    void SetAddress(uint8_t address)
+    {
+        m_iDevice = address;
+    }
+    bool Write(uint8_t reg, const uint8_t* values, uint32_t len);
+    bool Read(uint8_t reg, uint8_t* dest, uint32_t len);
+    void Delay(uint32_t usec);
+    void Sleep(uint32_t usec)
+    {
+        ::Sleep((usec + 999) / 1000);
+    }
+    bool Flush();
+    uint32_t MaxReadSize() const
+    {
+        return mMAX_BUFFER_LENGTH;
+    }
+    uint32_t Speed() const
+    {
+        return m_Speed;
+    }
+    bool SetSpeed(uint32_t khz);
+
+private:
+    bool StreamReserve(ULONG need);
+    void StreamCmd(UCHAR cmd);
+    void StreamOut(const uint8_t* data, ULONG len);
+    void StreamClose();
+    bool FlushStream(uint8_t read_reg, uint8_t* dest, ULONG read_len);
+    void StreamEnsure(ULONG bytes);
+
+    ULONG m_iIndex;
+    ULONG m_iDevice;	// RTD2662 I2C Address
+    uint32_t m_Speed;   // SCL clock in kHz
+    UCHAR m_Stream[mMAX_BUFFER_LENGTH];
+    ULONG m_StreamLen;
+    bool  m_Ok;     // no queued transfer failed since the last Flush()
+};
 
 // open the Linux device
-bool InitI2C()
+bool CCH341Transport::Open()
 {
     // Open Device
-    HANDLE h = CH341OpenDevice(g_iIndex);
+    HANDLE h = CH341OpenDevice(m_iIndex);
 	if (h == INVALID_HANDLE_VALUE) {
 		return false;
 	}
 
     // DLL verison
     ULONG dllVersion = CH341GetVersion();
-    std::cout << "DLL verison " << dllVersion << "\n";
+    std::cerr << "DLL verison " << dllVersion << "\n";
 
     // Driver version
     ULONG driverVersion = CH341GetDrvVersion();
-    std::cout << "Driver verison " << driverVersion << std::endl;
+    std::cerr << "Driver verison " << driverVersion << std::endl;
 
     // Device Name
-    PVOID p = CH341GetDeviceName(g_iIndex);
-    std::cout << "Device Name " << (PCHAR)p << std::endl;
+    PVOID p = CH341GetDeviceName(m_iIndex);
+    std::cerr << "Device Name " << (PCHAR)p << std::endl;
 
     // IC verison 0x10=CH341,0x20=CH341A,0x30=CH341A3
-    ULONG icVersion = CH341GetVerIC(g_iIndex);
-    std::cout << "IC version " << std::hex << icVersion << std::endl;
+    ULONG icVersion = CH341GetVerIC(m_iIndex);
+    std::cerr << "IC version " << std::hex << icVersion << std::endl;
 
     // Reset Device
-    BOOL b = CH341ResetDevice(g_iIndex);
-    std::cout << "Reset Device " << b << std::endl;
+    BOOL b = CH341ResetDevice(m_iIndex);
+    std::cerr << "Reset Device " << b << std::endl;
 	if (!b) {
 		return false;
 	}
 
+    // 400KHz until SetSpeed() is told otherwise
+    b = SetSpeed(m_Speed);
+    std::cerr << "Set Stream " << b << std::endl;
+	return b;
+}
+
+bool CCH341Transport::SetSpeed(uint32_t khz)
+{
     // Set serial stream mode
     // B1-B0: I2C SCL freq. 00=20KHz,01=100KHz,10=400KHz,11=750KHz
     // B2:    SPI I/O mode, 0=D3 CLK/D5 OUT/D7 IMP, 1=D3 CLK/D5&D4 OUT/D7&D6 INP)
     // B7:    SPI MSB/LSB, 0=LSB, 1=MSB
-    // ULONG iMode = 0; // SCL = 10KHz
-    // ULONG iMode = 1; // SCL = 100KHz
-    ULONG iMode = 2; // SCL = 400KHz
-    // ULONG iMode = 3; // SCL = 750KHz
-    b = CH341SetStream(g_iIndex, iMode);
-    std::cout << "Set Stream " << b << std::endl;
-	return b;
+    ULONG iMode;
+    switch (khz)
+    {
+    case 20:  iMode = 0; break;
+    case 100: iMode = 1; break;
+    case 400: iMode = 2; break;
+    case 750: iMode = 3; break;
+    default:  return false;
+    }
+    // The queued commands still go out at the old clock.
+    if (!FlushStream(0, NULL, 0))
+        m_Ok = false;
+    if (!CH341SetStream(m_iIndex, iMode))
+        return false;
+    m_Speed = khz;
+    return true;
 }
 
 // close the Linux device
-void CloseI2C()
+void CCH341Transport::Close()
 {
-    CH341CloseDevice(g_iIndex);
+    CH341CloseDevice(m_iIndex);
 }
 
-void SetI2CAddr(uint8_t address)
+// Make room for 'need' bytes in the current packet, closing it and opening
+// the next one when they don't fit.
+bool CCH341Transport::StreamReserve(ULONG need)
 {
-	g_iDevice = address;
+    ULONG used = m_StreamLen % mCH341_PACKET_LENGTH;
+    if (used != 0 && used + need <= mCH341_PACKET_LENGTH)
+        return true;
+    if (used != 0)
+    {
+        memset(&m_Stream[m_StreamLen], mCH341A_CMD_I2C_STM_END, mCH341_PACKET_LENGTH - used);
+        m_StreamLen += mCH341_PACKET_LENGTH - used;
+    }
+    if (m_StreamLen + mCH341_PACKET_LENGTH > sizeof(m_Stream))
+        return false;
+    m_Stream[m_StreamLen++] = mCH341A_CMD_I2C_STREAM;
+    return true;
 }
 
-bool WriteBytesToAddr(uint8_t reg, uint8_t* values, uint8_t len)
+void CCH341Transport::StreamCmd(UCHAR cmd)
 {
-    // I2C Transfer
-    ULONG iTmpWriteLength = len + 2;
-    PUCHAR iTmpWriteBuffer = new UCHAR[iTmpWriteLength];
+    StreamReserve(1);
+    m_Stream[m_StreamLen++] = cmd;
+}
+
+void CCH341Transport::StreamOut(const uint8_t* data, ULONG len)
+{
+    while (len > 0)
+    {
+        StreamReserve(2);
+        ULONG chunk = mCH341_PACKET_LENGTH - m_StreamLen % mCH341_PACKET_LENGTH - 1;
+        if (chunk > len)
+            chunk = len;
+        m_Stream[m_StreamLen++] = (UCHAR)(mCH341A_CMD_I2C_STM_OUT | chunk);
+        memcpy(&m_Stream[m_StreamLen], data, chunk);
+        m_StreamLen += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void CCH341Transport::StreamClose()
+{
+    ULONG used = m_StreamLen % mCH341_PACKET_LENGTH;
+    if (used != 0)
+    {
+        memset(&m_Stream[m_StreamLen], mCH341A_CMD_I2C_STM_END, mCH341_PACKET_LENGTH - used);
+        m_StreamLen += mCH341_PACKET_LENGTH - used;
+    }
+}
+
+// Send the queued writes, optionally followed by a combined register read.
+bool CCH341Transport::FlushStream(uint8_t read_reg, uint8_t* dest, ULONG read_len)
+{
+    if (read_len > 0)
+    {
+        uint8_t wr[2] = {(uint8_t)(m_iDevice << 1), read_reg};
+        uint8_t rd = (uint8_t)((m_iDevice << 1) | 1);
+        StreamCmd(mCH341A_CMD_I2C_STM_STA);
+        StreamOut(wr, 2);
+        StreamCmd(mCH341A_CMD_I2C_STM_STA);
+        StreamOut(&rd, 1);
+        if (read_len > 1)
+            StreamCmd((UCHAR)(mCH341A_CMD_I2C_STM_IN | (read_len - 1)));
+        StreamCmd(mCH341A_CMD_I2C_STM_IN);   // last byte is not acknowledged
+        StreamCmd(mCH341A_CMD_I2C_STM_STO);
+        stats_.bytes_written += 3;
+    }
+    if (m_StreamLen == 0)
+        return true;
+    StreamClose();
+
+    BOOL b;
+    uint64_t start = g_TraceEnabled ? NowUs() : 0;
+    if (read_len > 0)
+    {
+        ULONG got = 0;
+        b = CH341WriteRead(m_iIndex, m_StreamLen, m_Stream, read_len, 1, &got, dest);
+        b = b && got == read_len;
+        stats_.bytes_read += read_len;
+    }
+    else
+    {
+        ULONG len = m_StreamLen;
+        b = CH341WriteData(m_iIndex, m_Stream, &len);
+    }
+    stats_.transfers++;
+    if (g_TraceEnabled)
+        TraceTransfer(start, NowUs(), m_StreamLen, read_len);
+    m_StreamLen = 0;
+    return b != FALSE;
+}
+
+// Flush the queue unless 'bytes' more command bytes fit, keeping two packets
+// spare for a read appended by Read(). A packet carries at least 28 of them
+// next to its header, the OUT commands and split padding.
+void CCH341Transport::StreamEnsure(ULONG bytes)
+{
+    ULONG cost = (bytes / 28 + 2) * mCH341_PACKET_LENGTH;
+    if (m_StreamLen + cost + 2 * mCH341_PACKET_LENGTH > sizeof(m_Stream))
+    {
+        if (!FlushStream(0, NULL, 0))
+            m_Ok = false;
+    }
+}
 
-    memcpy(&iTmpWriteBuffer[2], values, len);
-    iTmpWriteBuffer[0] = g_iDevice << 1; // SSD1306 I2C Address (But Need Shifted)
-    iTmpWriteBuffer[1] = reg; // SSD1306 OLED Write Data
-    BOOL b = CH341StreamI2C(g_iIndex, iTmpWriteLength, iTmpWriteBuffer, 0UL, NULL);
+bool CCH341Transport::Flush()
+{
+    bool ok = FlushStream(0, NULL, 0) && m_Ok;
+    m_Ok = true;
+    return ok;
+}
+
+void CCH341Transport::Delay(uint32_t usec)
+{
+    uint32_t msec = usec / 1000;
+    usec %= 1000;
+    StreamEnsure((msec + usec) / mCH341A_CMD_I2C_STM_DLY + 2);
+    while (msec > 0)
+    {
+        uint32_t d = msec > mCH341A_CMD_I2C_STM_DLY ? mCH341A_CMD_I2C_STM_DLY : msec;
+        StreamCmd((UCHAR)(mCH341A_CMD_I2C_STM_MS | d));
+        msec -= d;
+    }
+    while (usec > 0)
+    {
+        uint32_t d = usec > mCH341A_CMD_I2C_STM_DLY ? mCH341A_CMD_I2C_STM_DLY : usec;
+        StreamCmd((UCHAR)(mCH341A_CMD_I2C_STM_US | d));
+        usec -= d;
+    }
+}
+
+bool CCH341Transport::Write(uint8_t reg, const uint8_t* values, uint32_t len)
+{
+    StreamEnsure(len + 4);
+    uint8_t hdr[2] = {(uint8_t)(m_iDevice << 1), reg};
+    StreamCmd(mCH341A_CMD_I2C_STM_STA);
+    StreamOut(hdr, 2);
+    StreamOut(values, len);
+    StreamCmd(mCH341A_CMD_I2C_STM_STO);
+    stats_.bytes_written += len + 2;
 #ifdef _DEBUG
-	for (int i=1; i<iTmpWriteLength; i++) {
-		printf("0x%02X,0x%02X,Write\n", g_iDevice, iTmpWriteBuffer[i]);
+	printf("0x%02X,0x%02X,Write\n", m_iDevice, reg);
+	for (uint32_t i=0; i<len; i++) {
+		printf("0x%02X,0x%02X,Write\n", m_iDevice, values[i]);
 	}
 #endif
-
-    delete[] iTmpWriteBuffer;
-	return b;
-
+    return true;
 }
 
-bool ReadBytesFromAddr(uint8_t reg, uint8_t* dest, uint8_t len)
+bool CCH341Transport::Read(uint8_t reg, uint8_t* dest, uint32_t len)
 {
+    if (m_StreamLen > 0)
+    {
+        // Short reads ride along with the queued writes, longer ones
+        // would not fit a single upload packet.
+        if (len <= mCH341_PACKET_LENGTH)
+        {
+            bool ok = FlushStream(reg, dest, len) && m_Ok;
+            m_Ok = true;
+            return ok;
+        }
+        if (!FlushStream(0, NULL, 0))
+            m_Ok = false;
+    }
+
     // I2C Transfer
-	uint8_t wr[2] = {g_iDevice<<1, reg};
-    BOOL b = CH341StreamI2C(g_iIndex, 2, &wr[0], len, dest);
+	uint8_t wr[2] = {(uint8_t)(m_iDevice<<1), reg};
+    uint64_t start = g_TraceEnabled ? NowUs() : 0;
+    BOOL b = CH341StreamI2C(m_iIndex, 2, &wr[0], len, dest);
+    stats_.transfers++;
+    if (g_TraceEnabled)
+        TraceTransfer(start, NowUs(), 2, len);
+    stats_.bytes_written += 2;
+    stats_.bytes_read += len;
 #ifdef _DEBUG
 	for (int i=1; i<2; i++) {
-		printf("0x%02X,0x%02X,Write\n", g_iDevice, wr[i]);
+		printf("0x%02X,0x%02X,Write\n", m_iDevice, wr[i]);
 	}
-	for (int i=0; i<len; i++) {
-		printf("0x%02X,0x%02X,Read\n", g_iDevice, dest[i]);
+	for (uint32_t i=0; i<len; i++) {
+		printf("0x%02X,0x%02X,Read\n", m_iDevice, dest[i]);
 	}
 #endif
 
-	return b;
+	bool ok = b && m_Ok;
+	m_Ok = true;
+	return ok;
+}
+
+I2CTransport* CreateCH341Transport(uint32_t index)
+{
+    return new CCH341Transport(index);
+}
+
+static I2CLink g_DefaultLink = {NULL, 0, true, {}};
+static THREAD_LOCAL I2CLink* t_Link = NULL;
+
+static I2CLink* Link()
+{
+    return t_Link ? t_Link : &g_DefaultLink;
+}
+
+void BindI2CLink(I2CLink* link)
+{
+    t_Link = link;
+}
+
+void SetI2CTransport(I2CTransport* transport)
+{
+    I2CLink* link = Link();
+    delete link->transport;
+    link->transport = transport;
+    link->batch_depth = 0;
+    link->batch_ok = true;
+}
+
+bool InitI2C()
+{
+    I2CLink* link = Link();
+    if (link->transport == NULL)
+        link->transport = CreateCH341Transport(0);
+    memset(&link->quality, 0, sizeof(link->quality));
+    if (!link->transport->Open())
+        return false;
+    link->quality.khz = link->transport->Speed();
+    return true;
+}
+
+void CloseI2C()
+{
+    I2CLink* link = Link();
+    if (link->transport == NULL)
+        return;
+    link->transport->Close();
+    delete link->transport;
+    link->transport = NULL;
+}
+
+void SetI2CAddr(uint8_t address)
+{
+	Link()->transport->SetAddress(address);
+}
+
+void ResetI2CStats()
+{
+    Link()->transport->ResetStats();
+}
+
+I2CStats GetI2CStats()
+{
+    return Link()->transport->GetStats();
+}
+
+uint64_t GetI2CTimeUs()
+{
+    return Link()->transport->NowUs();
+}
+
+// Reads never shrink below this, and the clean bytes needed to step up
+// double with every step down, up to the maximum.
+#define I2C_MIN_READ_SIZE 256
+#define I2C_STEP_UP_BYTES (256 * 1024)
+#define I2C_MAX_STEP_UP_BYTES (16 * 1024 * 1024)
+
+static int SpeedIndex(uint32_t khz)
+{
+    for (int i = 0; i < I2C_NUM_SPEEDS; i++)
+    {
+        if (I2CSpeeds[i] == khz)
+            return i;
+    }
+    return -1;
+}
+
+static void LinkError(I2CLink* link, bool crc)
+{
+    I2CQuality* q = &link->quality;
+    if (crc)
+        q->crc_errors++;
+    else
+        q->nacks++;
+    q->clean_bytes = 0;
+    if (!q->adaptive)
+        return;
+
+    bool stepped = false;
+    uint32_t read_size = q->read_size ? q->read_size : link->transport->MaxReadSize();
+    if (read_size / 2 >= I2C_MIN_READ_SIZE)
+    {
+        q->read_size = read_size / 2;
+        stepped = true;
+    }
+    int i = SpeedIndex(q->khz);
+    if (i >= 0 && i + 1 < I2C_NUM_SPEEDS && link->transport->SetSpeed(I2CSpeeds[i + 1]))
+    {
+        q->khz = I2CSpeeds[i + 1];
+        stepped = true;
+    }
+    if (stepped)
+    {
+        q->steps_down++;
+        if (q->step_up_bytes < I2C_MAX_STEP_UP_BYTES)
+            q->step_up_bytes *= 2;
+        if (g_TraceEnabled)
+        {
+            uint64_t now = link->transport->NowUs();
+            TraceSpan("i2c", "step down", now, now);
+        }
+    }
+}
+
+bool SetI2CSpeed(uint32_t khz)
+{
+    I2CLink* link = Link();
+    if (!link->transport->SetSpeed(khz))
+        return false;
+    link->quality.khz = khz;
+    return true;
+}
+
+void SetI2CReadSize(uint32_t len)
+{
+    Link()->quality.read_size = len;
+}
+
+void StartI2CFeedback(uint32_t max_khz)
+{
+    I2CQuality* q = &Link()->quality;
+    q->adaptive = true;
+    q->max_khz = max_khz;
+    q->clean_bytes = 0;
+    q->step_up_bytes = I2C_STEP_UP_BYTES;
+}
+
+void ReportI2CCRCError()
+{
+    LinkError(Link(), true);
+}
+
+void ReportI2CGood(uint32_t bytes)
+{
+    I2CLink* link = Link();
+    I2CQuality* q = &link->quality;
+    q->clean_bytes += bytes;
+    if (!q->adaptive || q->clean_bytes < q->step_up_bytes)
+        return;
+    q->clean_bytes = 0;
+
+    // The reads grow back first, the clock follows once they are whole.
+    uint32_t max_read = link->transport->MaxReadSize();
+    int i = SpeedIndex(q->khz);
+    if (q->read_size != 0 && q->read_size < max_read)
+    {
+        q->read_size = (q->read_size * 2 >= max_read) ? 0 : q->read_size * 2;
+    }
+    else if (i > 0 && I2CSpeeds[i - 1] <= q->max_khz &&
+             link->transport->SetSpeed(I2CSpeeds[i - 1]))
+    {
+        q->khz = I2CSpeeds[i - 1];
+    }
+    else
+    {
+        return;
+    }
+    q->steps_up++;
+}
+
+I2CQuality GetI2CQuality()
+{
+    return Link()->quality;
+}
+
+void PrintI2CQuality()
+{
+    I2CLink* link = Link();
+    const I2CQuality* q = &link->quality;
+    uint32_t read_size = q->read_size ? q->read_size : link->transport->MaxReadSize();
+    if (q->khz != 0)
+        fprintf(stderr, "I2C link: %ukHz, ", q->khz);
+    else
+        fprintf(stderr, "I2C link: ");
+    fprintf(stderr, "%u byte reads, %u NACKs, %u CRC failures, %u steps down, %u up\n",
+            read_size, q->nacks, q->crc_errors, q->steps_down, q->steps_up);
+}
+
+void BeginI2CBatch()
+{
+    I2CLink* link = Link();
+    if (link->batch_depth++ == 0)
+        link->batch_ok = true;
+}
+
+bool EndI2CBatch()
+{
+    I2CLink* link = Link();
+    if (link->batch_depth == 0 || --link->batch_depth > 0)
+        return link->batch_ok;
+    if (!link->transport->Flush())
+    {
+        link->batch_ok = false;
+        LinkError(link, false);
+    }
+    return link->batch_ok;
+}
+
+void QueueI2CDelay(uint32_t usec)
+{
+    I2CLink* link = Link();
+    if (link->batch_depth == 0)
+    {
+        link->transport->Sleep(usec);
+        return;
+    }
+    if (usec > I2C_MAX_QUEUED_DELAY_US)
+    {
+        // The queued commands have to reach the chip before the wait starts.
+        if (!link->transport->Flush())
+        {
+            link->batch_ok = false;
+            LinkError(link, false);
+        }
+        link->transport->Sleep(usec - usec % 1000);
+        usec %= 1000;
+    }
+    if (usec > 0)
+        link->transport->Delay(usec);
+}
+
+bool WriteBytesToAddr(uint8_t reg, const uint8_t* values, uint8_t len)
+{
+    I2CLink* link = Link();
+    bool ok = link->transport->Write(reg, values, len);
+    if (link->batch_depth == 0)
+        ok = link->transport->Flush() && ok;
+    if (!ok)
+    {
+        if (link->batch_depth > 0)
+            link->batch_ok = false;
+        LinkError(link, false);
+    }
+    return ok;
+}
+
+bool ReadBytesFromAddr(uint8_t reg, uint8_t* dest, uint32_t len)
+{
+    I2CLink* link = Link();
+    uint32_t max_len = link->quality.read_size;
+    if (max_len == 0)
+        max_len = link->transport->MaxReadSize();
+    bool ok = true;
+    while (len > 0)
+    {
+        uint32_t chunk = len > max_len ? max_len : len;
+        if (!link->transport->Read(reg, dest, chunk))
+        {
+            ok = false;
+            LinkError(link, false);
+        }
+        dest += chunk;
+        len -= chunk;
+    }
+    if (!ok && link->batch_depth > 0)
+        link->batch_ok = false;
+    return ok;
 }
 
 uint8_t ReadReg(uint8_t reg)
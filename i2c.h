@@ -1,6 +1,111 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
+
+struct I2CStats
+{
+    uint32_t transfers;      // USB round-trips to the adapter
+    uint32_t bytes_written;  // I2C payload bytes, including address and register
+    uint32_t bytes_read;
+};
+
+// Link to the I2C bus of the scaler. Writes and delays may be queued by the
+// transport; Read() sends the queued operations followed by the read and
+// Flush() sends them on their own, ideally as one round-trip either way.
+class I2CTransport
+{
+public:
+    virtual ~I2CTransport() {}
+
+    virtual bool Open() = 0;
+    virtual void Close() = 0;
+    virtual void SetAddress(uint8_t address) = 0;
+
+    virtual bool Write(uint8_t reg, const uint8_t* values, uint32_t len) = 0;
+    virtual bool Read(uint8_t reg, uint8_t* dest, uint32_t len) = 0;
+    virtual void Delay(uint32_t usec) = 0;  // between the queued operations
+    virtual void Sleep(uint32_t usec) = 0;  // on the host, nothing queued
+    virtual bool Flush() = 0;
+
+    // Longest Read() the link performs in one transfer.
+    virtual uint32_t MaxReadSize() const = 0;
+
+    // SCL clock in kHz, one of I2CSpeeds. Links whose clock is set outside
+    // of the program report 0 and refuse to change it.
+    virtual uint32_t Speed() const
+    {
+        return 0;
+    }
+    virtual bool SetSpeed(uint32_t /*khz*/)
+    {
+        return false;
+    }
+
+    // Microseconds on the clock of the link, the host's unless simulated.
+    virtual uint64_t NowUs();
+
+    I2CStats GetStats() const
+    {
+        return stats_;
+    }
+    void ResetStats()
+    {
+        memset(&stats_, 0, sizeof(stats_));
+    }
+
+protected:
+    I2CStats stats_;
+};
+
+// CH341 USB adapter 'index', using its packed I2C command stream.
+I2CTransport* CreateCH341Transport(uint32_t index);
+
+#ifdef __linux__
+// Linux i2c-dev node such as "/dev/i2c-3".
+I2CTransport* CreateI2CDevTransport(const char* path);
+#endif
+
+// SCL clocks of the CH341, fastest first.
+#define I2C_NUM_SPEEDS 4
+extern const uint32_t I2CSpeeds[I2C_NUM_SPEEDS];
+
+// Error feedback of a link. Failed transfers (NACKs) and blocks failing
+// their CRC step the clock down one rate and halve the reads; after enough
+// bytes verified without an error the reads grow back to the transport's
+// longest and then the clock rises again, up to 'max_khz'.
+struct I2CQuality
+{
+    bool     adaptive;      // feedback enabled by StartI2CFeedback()
+    uint32_t khz;           // current SCL clock, 0 when fixed
+    uint32_t max_khz;
+    uint32_t read_size;     // longest read per transfer, 0 for the transport's
+    uint32_t clean_bytes;   // verified since the last error or step
+    uint32_t step_up_bytes; // needed for the next step up
+    uint32_t nacks;
+    uint32_t crc_errors;
+    uint32_t steps_down;
+    uint32_t steps_up;
+};
+
+// State of one link: its transport, the batch being queued on it and its
+// error feedback.
+struct I2CLink
+{
+    I2CTransport* transport;
+    int           batch_depth;
+    bool          batch_ok;
+    I2CQuality    quality;
+};
+
+// Direct the functions below to 'link' on the calling thread, or back to
+// the process-wide default link when NULL. Threads driving different
+// adapters each bind their own link.
+void BindI2CLink(I2CLink* link);
+
+// Use 'transport' for the following InitI2C(), which otherwise opens the
+// first CH341. The transport is deleted by CloseI2C().
+void SetI2CTransport(I2CTransport* transport);
 
 bool InitI2C();
 void CloseI2C();
@@ -9,5 +114,44 @@ void SetI2CAddr(uint8_t value);
 
 bool WriteReg(uint8_t reg, uint8_t value);
 uint8_t ReadReg(uint8_t reg);
-bool ReadBytesFromAddr(uint8_t reg, uint8_t* dest, uint8_t len);
-bool WriteBytesToAddr(uint8_t reg, uint8_t* values, uint8_t len);
+// Reads longer than the transport's MaxReadSize() are split into several
+// register reads, which continue where the previous one stopped only for
+// the 0x70 flash data port.
+bool ReadBytesFromAddr(uint8_t reg, uint8_t* dest, uint32_t len);
+bool WriteBytesToAddr(uint8_t reg, const uint8_t* values, uint8_t len);
+
+// Register writes issued between BeginI2CBatch() and EndI2CBatch() are queued
+// and sent to the adapter as one packed command stream (one START/STOP pair
+// per register write). A read inside the batch is appended to the queued
+// writes so that both share a single USB transfer. Batches may nest; the
+// queue is flushed when the outermost batch ends or the queue is full.
+void BeginI2CBatch();
+bool EndI2CBatch();
+
+// Queue a delay executed by the adapter between the surrounding commands of
+// the batch (sleeps on the host when called outside a batch). Delays longer
+// than I2C_MAX_QUEUED_DELAY_US send the queued commands, sleep on the host
+// for the whole milliseconds and queue only the rest.
+#define I2C_MAX_QUEUED_DELAY_US 2000
+void QueueI2CDelay(uint32_t usec);
+
+void ResetI2CStats();
+I2CStats GetI2CStats();
+
+// Current time of the transport in microseconds, for timing controller
+// operations (simulated time when running on the simulator).
+uint64_t GetI2CTimeUs();
+
+// Switch the SCL clock, false when the link can't.
+bool SetI2CSpeed(uint32_t khz);
+// Limit the reads to 'len' bytes per transfer, 0 for the transport's longest.
+void SetI2CReadSize(uint32_t len);
+
+// Adapt the clock and the read size to the errors of the link from now on,
+// never above 'max_khz'. NACKs are counted by the functions above; callers
+// checking data against the chip report the outcome of each check.
+void StartI2CFeedback(uint32_t max_khz);
+void ReportI2CCRCError();
+void ReportI2CGood(uint32_t bytes);
+I2CQuality GetI2CQuality();
+void PrintI2CQuality();
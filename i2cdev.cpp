@@ -0,0 +1,454 @@
+// i2cdev.cpp : Linux i2c-dev transport.
+//
+// Talks to the scaler through /dev/i2c-N, e.g. the DDC channel of a GPU or
+// the kernel i2c-ch341 driver. Queued register writes and the read that ends
+// them go to the kernel as one I2C_RDWR call with a message per register
+// access, so an SPI command costs a single syscall. Adapters that only speak
+// SMBus (i2c-stub, some GPU drivers) fall back to SMBus block transfers.
+//
+// The kernel calls go through a few virtual methods. CI2CDevSimTransport
+// answers them from the simulator, so -bench runs both transfer paths
+// without an adapter.
+#include "stdafx.h"
+#include "i2c.h"
+#include "rtdsim.h"
+#include "trace.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+// Payload bytes queued between two I2C_RDWR calls.
+#define I2CDEV_QUEUE_BYTES 8192
+
+// Longest message the kernel accepts in I2C_RDWR.
+#define I2CDEV_MAX_READ 8192
+
+class CI2CDevTransport : public I2CTransport
+{
+public:
+    explicit CI2CDevTransport(const char* path)
+        : path_(path), fd_(-1), device_(0x4a), smbus_(false),
+          num_msgs_(0), queued_(0), ok_(true)
+    {
+        ResetStats();
+    }
+    ~CI2CDevTransport()
+    {
+        Close();
+    }
+
+    bool Open();
+    void Close();
+    void SetAddress(uint8_t address)
+    {
+        Flush();
+        device_ = address;
+        if (fd_ >= 0 && smbus_)
+            Ioctl(I2C_SLAVE, (void*)(unsigned long)device_);
+    }
+    bool Write(uint8_t reg, const uint8_t* values, uint32_t len);
+    bool Read(uint8_t reg, uint8_t* dest, uint32_t len);
+    void Delay(uint32_t usec);
+    void Sleep(uint32_t usec)
+    {
+        Pause(usec);
+    }
+    bool Flush();
+    uint32_t MaxReadSize() const
+    {
+        return I2CDEV_MAX_READ;
+    }
+
+protected:
+    // The kernel side: the i2c-dev node and the host clock.
+    virtual int OpenNode()
+    {
+        return open(path_, O_RDWR);
+    }
+    virtual void CloseNode()
+    {
+        close(fd_);
+    }
+    virtual int Ioctl(unsigned long request, void* arg)
+    {
+        return ioctl(fd_, request, arg);
+    }
+    virtual void Pause(uint32_t usec)
+    {
+        usleep(usec);
+    }
+
+private:
+    bool Transfer();
+    bool SMBusAccess(uint8_t read_write, uint8_t reg, uint32_t size,
+                     i2c_smbus_data* data);
+    bool SMBusWrite(uint8_t reg, const uint8_t* values, uint32_t len);
+    bool SMBusRead(uint8_t reg, uint8_t* dest, uint32_t len);
+
+    const char* path_;
+    int         fd_;
+    uint8_t     device_;
+    bool        smbus_;     // adapter lacks plain I2C transfers
+    i2c_msg     msgs_[I2C_RDWR_IOCTL_MAX_MSGS];
+    uint32_t    num_msgs_;
+    uint8_t     queue_[I2CDEV_QUEUE_BYTES];
+    uint32_t    queued_;
+    bool        ok_;        // no queued transfer failed since the last Flush()
+};
+
+bool CI2CDevTransport::Open()
+{
+    fd_ = OpenNode();
+    if (fd_ < 0)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", path_, strerror(errno));
+        return false;
+    }
+    unsigned long funcs = 0;
+    if (Ioctl(I2C_FUNCS, &funcs) < 0)
+    {
+        fprintf(stderr, "%s is not an i2c-dev node\n", path_);
+        return false;
+    }
+    smbus_ = !(funcs & I2C_FUNC_I2C);
+    if (smbus_ && (funcs & I2C_FUNC_SMBUS_I2C_BLOCK) != I2C_FUNC_SMBUS_I2C_BLOCK)
+    {
+        fprintf(stderr, "%s supports neither I2C nor SMBus block transfers\n", path_);
+        return false;
+    }
+    if (smbus_ && Ioctl(I2C_SLAVE, (void*)(unsigned long)device_) < 0)
+    {
+        fprintf(stderr, "Can't address 0x%02x on %s: %s\n", device_, path_, strerror(errno));
+        return false;
+    }
+    fprintf(stderr, "Device Name %s (%s)\n", path_, smbus_ ? "SMBus" : "I2C_RDWR");
+    return true;
+}
+
+void CI2CDevTransport::Close()
+{
+    if (fd_ < 0)
+        return;
+    Flush();
+    CloseNode();
+    fd_ = -1;
+}
+
+// Hand the queued messages to the kernel.
+bool CI2CDevTransport::Transfer()
+{
+    if (num_msgs_ == 0)
+        return true;
+    i2c_rdwr_ioctl_data rdwr;
+    rdwr.msgs = msgs_;
+    rdwr.nmsgs = num_msgs_;
+    uint64_t start = g_TraceEnabled ? NowUs() : 0;
+    int r = Ioctl(I2C_RDWR, &rdwr);
+    stats_.transfers++;
+    if (g_TraceEnabled)
+    {
+        uint32_t bytes_out = 0, bytes_in = 0;
+        for (uint32_t i = 0; i < num_msgs_; i++)
+        {
+            if (msgs_[i].flags & I2C_M_RD)
+                bytes_in += msgs_[i].len;
+            else
+                bytes_out += msgs_[i].len;
+        }
+        TraceTransfer(start, NowUs(), bytes_out, bytes_in);
+    }
+    num_msgs_ = 0;
+    queued_ = 0;
+    return r == (int)rdwr.nmsgs;
+}
+
+bool CI2CDevTransport::Flush()
+{
+    bool ok = Transfer() && ok_;
+    ok_ = true;
+    return ok;
+}
+
+void CI2CDevTransport::Delay(uint32_t usec)
+{
+    // The kernel has no delay message, so send what precedes it first.
+    if (!Transfer())
+        ok_ = false;
+    Pause(usec);
+}
+
+bool CI2CDevTransport::Write(uint8_t reg, const uint8_t* values, uint32_t len)
+{
+    stats_.bytes_written += len + 2;
+    if (smbus_)
+        return SMBusWrite(reg, values, len);
+
+    if (num_msgs_ + 2 > I2C_RDWR_IOCTL_MAX_MSGS || queued_ + len + 1 > sizeof(queue_))
+    {
+        if (!Transfer())
+            ok_ = false;
+    }
+    if (len + 1 > sizeof(queue_))
+        return false;
+    uint8_t* buf = &queue_[queued_];
+    buf[0] = reg;
+    memcpy(buf + 1, values, len);
+    queued_ += len + 1;
+
+    i2c_msg* msg = &msgs_[num_msgs_++];
+    msg->addr = device_;
+    msg->flags = 0;
+    msg->len = (uint16_t)(len + 1);
+    msg->buf = buf;
+    return true;
+}
+
+bool CI2CDevTransport::Read(uint8_t reg, uint8_t* dest, uint32_t len)
+{
+    stats_.bytes_written += 3;
+    stats_.bytes_read += len;
+    if (smbus_)
+    {
+        bool ok = SMBusRead(reg, dest, len) && ok_;
+        ok_ = true;
+        return ok;
+    }
+
+    // Register select and read are chained with a repeated START.
+    if (num_msgs_ + 2 > I2C_RDWR_IOCTL_MAX_MSGS || queued_ + 1 > sizeof(queue_))
+    {
+        if (!Transfer())
+            ok_ = false;
+    }
+    uint8_t* buf = &queue_[queued_++];
+    *buf = reg;
+    i2c_msg* msg = &msgs_[num_msgs_++];
+    msg->addr = device_;
+    msg->flags = 0;
+    msg->len = 1;
+    msg->buf = buf;
+    msg = &msgs_[num_msgs_++];
+    msg->addr = device_;
+    msg->flags = I2C_M_RD;
+    msg->len = (uint16_t)len;
+    msg->buf = dest;
+    return Flush();
+}
+
+bool CI2CDevTransport::SMBusAccess(uint8_t read_write, uint8_t reg, uint32_t size,
+                                   i2c_smbus_data* data)
+{
+    i2c_smbus_ioctl_data args;
+    args.read_write = read_write;
+    args.command = reg;
+    args.size = size;
+    args.data = data;
+    stats_.transfers++;
+    uint64_t start = g_TraceEnabled ? NowUs() : 0;
+    bool ok = Ioctl(I2C_SMBUS, &args) >= 0;
+    if (g_TraceEnabled)
+    {
+        // Block transfers carry the length in their first data byte.
+        uint32_t bytes = size == I2C_SMBUS_BYTE_DATA ? 1 :
+                         size == I2C_SMBUS_WORD_DATA ? 2 : data ? data->block[0] : 0;
+        if (read_write == I2C_SMBUS_READ)
+            TraceTransfer(start, NowUs(), 1, bytes);
+        else
+            TraceTransfer(start, NowUs(), 1 + bytes, 0);
+    }
+    return ok;
+}
+
+// SMBus transfers carry at most I2C_SMBUS_BLOCK_MAX bytes; longer writes are
+// split, which is fine for the only long one, the auto-appending 0x70 FIFO.
+bool CI2CDevTransport::SMBusWrite(uint8_t reg, const uint8_t* values, uint32_t len)
+{
+    bool ok = true;
+    i2c_smbus_data data;
+    while (len > 0)
+    {
+        uint32_t chunk = len > I2C_SMBUS_BLOCK_MAX ? I2C_SMBUS_BLOCK_MAX : len;
+        if (chunk == 1)
+        {
+            data.byte = values[0];
+            ok = SMBusAccess(I2C_SMBUS_WRITE, reg, I2C_SMBUS_BYTE_DATA, &data) && ok;
+        }
+        else
+        {
+            data.block[0] = (uint8_t)chunk;
+            memcpy(&data.block[1], values, chunk);
+            ok = SMBusAccess(I2C_SMBUS_WRITE, reg, I2C_SMBUS_I2C_BLOCK_DATA, &data) && ok;
+        }
+        values += chunk;
+        len -= chunk;
+    }
+    return ok;
+}
+
+// Register reads don't advance the register, so chunks of the 0x70 FIFO
+// continue where the previous one stopped.
+bool CI2CDevTransport::SMBusRead(uint8_t reg, uint8_t* dest, uint32_t len)
+{
+    i2c_smbus_data data;
+    while (len > 0)
+    {
+        uint32_t chunk = len > I2C_SMBUS_BLOCK_MAX ? I2C_SMBUS_BLOCK_MAX : len;
+        if (chunk == 1)
+        {
+            if (!SMBusAccess(I2C_SMBUS_READ, reg, I2C_SMBUS_BYTE_DATA, &data))
+                return false;
+            dest[0] = data.byte;
+        }
+        else
+        {
+            data.block[0] = (uint8_t)chunk;
+            if (!SMBusAccess(I2C_SMBUS_READ, reg, I2C_SMBUS_I2C_BLOCK_DATA, &data))
+                return false;
+            memcpy(dest, &data.block[1], chunk);
+        }
+        dest += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+I2CTransport* CreateI2CDevTransport(const char* path)
+{
+    return new CI2CDevTransport(path);
+}
+
+// Stand-in for the kernel: I2C_RDWR messages and SMBus transfers are played
+// to the simulator at the byte level, one USB round-trip per call, the way
+// i2c-ch341 would send them. Waits pass on the simulated clock.
+class CI2CDevSimTransport : public CI2CDevTransport
+{
+public:
+    CI2CDevSimTransport(const SimConfig& config, bool smbus)
+        : CI2CDevTransport("sim i2c-dev"),
+          config_(config), sim_(NULL), smbus_only_(smbus), slave_(0)
+    {
+    }
+    ~CI2CDevSimTransport()
+    {
+        Close();
+    }
+
+    uint64_t NowUs()
+    {
+        return sim_ ? sim_->Stats().elapsed_ns / 1000 : 0;
+    }
+
+protected:
+    int OpenNode()
+    {
+        sim_ = new CRtdSimulator(config_);
+        return 0;
+    }
+    void CloseNode()
+    {
+        sim_->PrintStats("Simulator");
+        delete sim_;
+        sim_ = NULL;
+    }
+    int Ioctl(unsigned long request, void* arg);
+    void Pause(uint32_t usec)
+    {
+        sim_->Wait(usec);
+    }
+
+private:
+    bool Message(const i2c_msg* msg);
+    bool SMBus(const i2c_smbus_ioctl_data* args);
+
+    SimConfig      config_;
+    CRtdSimulator* sim_;
+    bool           smbus_only_;
+    uint8_t        slave_;      // I2C_SLAVE address for SMBus transfers
+};
+
+int CI2CDevSimTransport::Ioctl(unsigned long request, void* arg)
+{
+    if (request == I2C_FUNCS)
+    {
+        *(unsigned long*)arg = I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_I2C_BLOCK |
+                               (smbus_only_ ? 0 : I2C_FUNC_I2C);
+        return 0;
+    }
+    if (request == I2C_SLAVE)
+    {
+        slave_ = (uint8_t)(unsigned long)arg;
+        return 0;
+    }
+    if (request == I2C_RDWR && !smbus_only_)
+    {
+        const i2c_rdwr_ioctl_data* rdwr = (const i2c_rdwr_ioctl_data*)arg;
+        sim_->BeginTransfer();
+        // The kernel stops at the first message not acknowledged.
+        bool ok = true;
+        for (uint32_t i = 0; i < rdwr->nmsgs && ok; i++)
+            ok = Message(&rdwr->msgs[i]);
+        sim_->Stop();
+        errno = ENXIO;
+        return ok ? (int)rdwr->nmsgs : -1;
+    }
+    if (request == I2C_SMBUS)
+    {
+        sim_->BeginTransfer();
+        errno = ENXIO;
+        return SMBus((const i2c_smbus_ioctl_data*)arg) ? 0 : -1;
+    }
+    errno = request == I2C_RDWR ? EOPNOTSUPP : ENOTTY;
+    return -1;
+}
+
+// One I2C_RDWR message, opened with a (repeated) START.
+bool CI2CDevSimTransport::Message(const i2c_msg* msg)
+{
+    bool read = (msg->flags & I2C_M_RD) != 0;
+    sim_->Start();
+    if (!sim_->Out((uint8_t)(msg->addr << 1 | (read ? 1 : 0))))
+        return false;
+    for (uint32_t i = 0; i < msg->len; i++)
+    {
+        if (read)
+            msg->buf[i] = sim_->In();
+        else
+            sim_->Out(msg->buf[i]);
+    }
+    return true;
+}
+
+// SMBus byte and I2C block transfers, the only ones the transport uses.
+bool CI2CDevSimTransport::SMBus(const i2c_smbus_ioctl_data* args)
+{
+    uint32_t len = args->size == I2C_SMBUS_BYTE_DATA ? 1 : args->data->block[0];
+    uint8_t* data = args->size == I2C_SMBUS_BYTE_DATA ? &args->data->byte : &args->data->block[1];
+    sim_->Start();
+    bool ok = sim_->Out((uint8_t)(slave_ << 1));
+    if (ok)
+        sim_->Out(args->command);
+    if (ok && args->read_write == I2C_SMBUS_READ)
+    {
+        sim_->Start();
+        ok = sim_->Out((uint8_t)(slave_ << 1 | 1));
+        for (uint32_t i = 0; ok && i < len; i++)
+            data[i] = sim_->In();
+    }
+    else if (ok)
+    {
+        for (uint32_t i = 0; i < len; i++)
+            sim_->Out(data[i]);
+    }
+    sim_->Stop();
+    return ok;
+}
+
+I2CTransport* CreateI2CDevSimTransport(const SimConfig& config, bool smbus)
+{
+    return new CI2CDevSimTransport(config, smbus);
+}
+
+#endif // __linux__
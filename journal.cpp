@@ -0,0 +1,121 @@
+// journal.cpp : Progress journal of resumable programming runs.
+//
+// The journal is a text file. The first line holds the key, the others one
+// verified block each:
+//
+//   RTD journal 1 <adapter> <jedec id> <image hash> <image size> <block size>
+//   <block address> <host CRC> <chip CRC>
+//
+// Numbers are hexadecimal, spaces in the adapter name are replaced by '_'.
+// A line cut short by a crash fails to parse and is ignored.
+#include "stdafx.h"
+#include "journal.h"
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+// Push what was written down to the disk, so that an entry outlives a
+// power loss or a crash of the host, not only one of the program.
+static bool SyncJournal(FILE* fp)
+{
+    if (fflush(fp) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+// 'header' holds at least 128 bytes.
+static void FormatHeader(const JournalKey* key, char* header)
+{
+    char adapter[64];
+    size_t n = 0;
+    for (const char* p = key->adapter; *p && n + 1 < sizeof(adapter); p++)
+        adapter[n++] = (*p == ' ' || *p == '\t' || *p == '\n') ? '_' : *p;
+    adapter[n] = 0;
+    sprintf(header, "RTD journal 1 %s %06x %08x%08x %x %x\n", adapter, key->jedec_id,
+            (uint32_t)(key->image_hash >> 32), (uint32_t)key->image_hash,
+            key->image_size, key->block_size);
+}
+
+bool OpenJournal(Journal* journal, const char* path, const JournalKey* key)
+{
+    memset(journal, 0, sizeof(*journal));
+    strncpy(journal->path, path, sizeof(journal->path) - 1);
+    journal->block_size = key->block_size;
+    journal->num_blocks = (key->image_size + key->block_size - 1) / key->block_size;
+    journal->block_crc = new int16_t[journal->num_blocks];
+    for (uint32_t i = 0; i < journal->num_blocks; i++)
+        journal->block_crc[i] = -1;
+
+    char header[256];
+    FormatHeader(key, header);
+    FILE* fp = NULL;
+    bool resume = false;
+    if (fopen_s(&fp, path, "r") == 0 && fp)
+    {
+        char line[256];
+        resume = fgets(line, sizeof(line), fp) && strcmp(line, header) == 0;
+        while (resume && fgets(line, sizeof(line), fp))
+        {
+            unsigned addr, host_crc, chip_crc;
+            size_t len = strlen(line);
+            if (len == 0 || line[len - 1] != '\n' ||
+                sscanf(line, "%x %x %x", &addr, &host_crc, &chip_crc) != 3)
+                continue;
+            uint32_t block = addr / key->block_size;
+            if (addr % key->block_size == 0 && block < journal->num_blocks &&
+                host_crc == chip_crc && host_crc < 256)
+            {
+                journal->block_crc[block] = (int16_t)host_crc;
+                journal->entries++;
+            }
+        }
+        fclose(fp);
+        fp = NULL;
+    }
+    if (!resume)
+    {
+        if (fopen_s(&fp, path, "w") != 0 || fp == NULL || fputs(header, fp) < 0)
+        {
+            fprintf(stderr, "Can't create journal %s\n", path);
+            if (fp)
+                fclose(fp);
+            delete [] journal->block_crc;
+            journal->block_crc = NULL;
+            return false;
+        }
+    }
+    else if (fopen_s(&fp, path, "a") != 0 || fp == NULL)
+    {
+        fprintf(stderr, "Can't append to journal %s\n", path);
+        delete [] journal->block_crc;
+        journal->block_crc = NULL;
+        return false;
+    }
+    SyncJournal(fp);
+    journal->fp = fp;
+    return true;
+}
+
+void JournalBlock(Journal* journal, uint32_t block, uint8_t host_crc, uint8_t chip_crc)
+{
+    if (journal->fp == NULL || block >= journal->num_blocks)
+        return;
+    fprintf(journal->fp, "%x %02x %02x\n", block * journal->block_size, host_crc, chip_crc);
+    SyncJournal(journal->fp);
+}
+
+void CloseJournal(Journal* journal, bool complete)
+{
+    if (journal->fp)
+        fclose(journal->fp);
+    journal->fp = NULL;
+    if (complete)
+        remove(journal->path);
+    delete [] journal->block_crc;
+    journal->block_crc = NULL;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+// What a journal belongs to. An existing journal with another key is
+// discarded.
+struct JournalKey
+{
+    const char* adapter;
+    uint32_t    jedec_id;
+    uint64_t    image_hash;
+    uint32_t    image_size;
+    uint32_t    block_size;
+};
+
+// Progress of a programming run, one line per block whose on-chip CRC
+// matched the image after it was programmed. Lines are flushed as they
+// are written, so the journal survives the run being cut short.
+struct Journal
+{
+    FILE*    fp;
+    char     path[1024];
+    uint32_t block_size;
+    uint32_t num_blocks;
+    int16_t* block_crc;     // journaled CRC per block, -1 for none
+    uint32_t entries;
+};
+
+// Open the journal at 'path', loading its entries when its key matches
+// 'key' and starting it afresh otherwise.
+bool OpenJournal(Journal* journal, const char* path, const JournalKey* key);
+
+// Record that 'block' was programmed and verified: the host CRC of its
+// image data and the CRC the chip computed over it.
+void JournalBlock(Journal* journal, uint32_t block, uint8_t host_crc, uint8_t chip_crc);
+
+// Close the journal; a completed run has no use for it and removes it.
+void CloseJournal(Journal* journal, bool complete);
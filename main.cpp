@@ -5,60 +5,19 @@
 #include "crc.h"
 #include "i2c.h"
 #include "gff.h"
-
-struct FlashDesc
-{
-    const char* device_name;
-    uint32_t    jedec_id;
-    uint32_t    size_kb;
-    uint32_t    page_size;
-    uint32_t    block_size_kb;
-};
-
-static const FlashDesc FlashDevices[] =
-{
-    // name,        Jedec ID,    sizeK, page size, block sizeK
-    {"AT25DF041A", 0x1F4401,      512,       256, 64},
-    {"AT25DF161", 0x1F4602, 2 * 1024,       256, 64},
-    {"AT26DF081A", 0x1F4501, 1 * 1024,       256, 64},
-    {"AT26DF0161", 0x1F4600, 2 * 1024,       256, 64},
-    {"AT26DF161A", 0x1F4601, 2 * 1024,       256, 64},
-    {"AT25DF321",  0x1F4701, 4 * 1024,       256, 64},
-    {"AT25DF512B", 0x1F6501,       64,       256, 32},
-    {"AT25DF512B", 0x1F6500,       64,       256, 32},
-    {"AT25DF021", 0x1F3200,      256,       256, 64},
-    {"AT26DF641",  0x1F4800, 8 * 1024,       256, 64},
-    // Manufacturer: ST
-    {"M25P05", 0x202010,       64,       256, 32},
-    {"M25P10", 0x202011,      128,       256, 32},
-    {"M25P20", 0x202012,      256,       256, 64},
-    {"M25P40", 0x202013,      512,       256, 64},
-    {"M25P80", 0x202014, 1 * 1024,       256, 64},
-    {"M25P16", 0x202015, 2 * 1024,       256, 64},
-    {"M25P32", 0x202016, 4 * 1024,       256, 64},
-    {"M25P64", 0x202017, 8 * 1024,       256, 64},
-    // Manufacturer: Windbond
-    {"W25X10", 0xEF3011,      128,       256, 64},
-    {"W25X20", 0xEF3012,      256,       256, 64},
-    {"W25X40", 0xEF3013,      512,       256, 64},
-    {"W25X80", 0xEF3014, 1 * 1024,       256, 64},
-    {"W25Q80", 0xEF4014, 1 * 1024,       256, 64},
-    {"GD25Q80", 0xC84014, 1 * 1024,      256, 64}, 
-    // Manufacturer: Macronix
-    {"MX25L512", 0xC22010,       64,       256, 64},
-    {"25D40",    0xC22013,      512,       256, 64},
-    {"MX25L3205", 0xC22016, 4 * 1024,       256, 64},
-    {"MX25L6405", 0xC22017, 8 * 1024,       256, 64},
-    {"MX25L8005", 0xC22014,     1024,       256, 64},
-    // Microchip
-    {"SST25VF512", 0xBF4800,       64,       256, 32},
-    {"SST25VF032", 0xBF4A00, 4 * 1024,       256, 32},
-    // PMC
-	{"PM25LQ010B", 0x7F9D21,       128,       256, 64},
-	// FM
-    {"FM25F04", 0xA14013,    512,       256, 64},
-    {NULL, 0, 0, 0, 0}
-};
+#include "bench.h"
+#include "mapfile.h"
+#include "rtdsim.h"
+#include "statuspoll.h"
+#include "session.h"
+#include "pipeline.h"
+#include "thread.h"
+#include "trace.h"
+#include "verify.h"
+#include "journal.h"
+#include "fingerprint.h"
+#include "daemon.h"
+#include "chipdb.h"
 
 enum ECommondCommandType
 {
@@ -70,20 +29,26 @@ enum ECommondCommandType
     E_CC_ERASE = 5
 };
 
-//SPICommonCommand(E_CC_READ, 0x9f, 3, 0, 0);
-uint32_t SPICommonCommand(ECommondCommandType cmd_type,
-                          uint8_t cmd_code,
-                          uint8_t num_reads,
-                          uint8_t num_writes,
-                          uint32_t write_value)
+// Run a command of the common command engine, returning the bytes it read
+// in 'result' (when not NULL). False when the command did not finish.
+//SPICommonCommand(E_CC_READ, 0x9f, 3, 0, 0, &jedec_id);
+bool SPICommonCommand(ECommondCommandType cmd_type,
+                      uint8_t cmd_code,
+                      uint8_t num_reads,
+                      uint8_t num_writes,
+                      uint32_t write_value,
+                      uint32_t* result = NULL)
 {
     num_reads &= 3;
     num_writes &= 3;
     write_value &= 0xFFFFFF;
+    TraceScope trace("spi", "SPICommonCommand");
     uint8_t reg_value = (cmd_type << 5) |
                         (num_writes << 3) |
                         (num_reads << 1);
 
+    // The setup writes go out together with the first status poll.
+    BeginI2CBatch();
     WriteReg(0x60, reg_value);
     WriteReg(0x61, cmd_code);
     switch (num_writes)
@@ -103,50 +68,57 @@ uint32_t SPICommonCommand(ECommondCommandType cmd_type,
     }
     WriteReg(0x60, reg_value | 1); // Execute the command
 
-    uint8_t b;
-    do
-    {
-        b = ReadReg(0x60);
-    }
-    while (b & 1);    // TODO: add timeout and reset the controller
+    EPollOp op = (cmd_type == E_CC_ERASE) ? ErasePollOp(cmd_code) : E_POLL_COMMAND;
+    bool done = PollRegister(op, 1, 0x60, 0x01, 0);
+    EndI2CBatch();
+    if (!done)
+        return false;
+    if (result == NULL)
+        return true;
 
     switch (num_reads)
     {
     case 0:
-        return 0;
+        *result = 0;
+        break;
     case 1:
-        return ReadReg(0x67);
+        *result = ReadReg(0x67);
+        break;
     case 2:
-        return (ReadReg(0x67) << 8) | ReadReg(0x68);
+        *result = (ReadReg(0x67) << 8) | ReadReg(0x68);
+        break;
     case 3:
-        return (ReadReg(0x67) << 16) | (ReadReg(0x68) << 8) | ReadReg(0x69);
+        *result = (ReadReg(0x67) << 16) | (ReadReg(0x68) << 8) | ReadReg(0x69);
+        break;
     }
-    return 0;
+    return true;
 }
 
-void SPIRead(uint32_t address, uint8_t *data, int32_t len)
+// Issue the read command for 'address'. The controller then streams the
+// flash from there through the 0x70 data port. False when the command did
+// not finish.
+static bool SPIReadStart(uint32_t address)
 {
+    TraceScope trace("spi", "SPIReadStart");
+    BeginI2CBatch();
     WriteReg(0x60, 0x46);
     WriteReg(0x61, 0x3);
     WriteReg(0x64, address>>16);
     WriteReg(0x65, address>>8);
     WriteReg(0x66, address);
     WriteReg(0x60, 0x47); // Execute the command
-    uint8_t b;
-    do
-    {
-        b = ReadReg(0x60);
-    }
-    while (b & 1);    // TODO: add timeout and reset the controller
-    while (len > 0)
-    {
-        int32_t read_len = len;
-        if (read_len > 128)
-            read_len = 128;
-        ReadBytesFromAddr(0x70, data, read_len);
-        data += read_len;
-        len -= read_len;
-    }
+    bool done = PollRegister(E_POLL_READ_SETUP, 1, 0x60, 0x01, 0);
+    EndI2CBatch();
+    return done;
+}
+
+// Read 'len' bytes starting at 'address'. The read command is issued once,
+// then the 0x70 data port is drained with the longest reads the transport
+// supports while the controller keeps streaming from the flash. False when
+// the read command did not finish or the read failed.
+bool SPIRead(uint32_t address, uint8_t *data, int32_t len)
+{
+    return SPIReadStart(address) && ReadBytesFromAddr(0x70, data, len);
 }
 
 void PrintManufacturer(uint32_t id)
@@ -174,20 +146,13 @@ void PrintManufacturer(uint32_t id)
     }
 }
 
-static const FlashDesc* FindChip(uint32_t jedec_id)
-{
-    const FlashDesc* chip = FlashDevices;
-    while (chip->jedec_id != 0)
-    {
-        if (chip->jedec_id == jedec_id)
-            return chip;
-        chip++;
-    }
-    return NULL;
-}
-
-uint8_t SPIComputeCRC(uint32_t start, uint32_t end)
+// Let the chip compute the CRC of [start, end] into 'crc'. False when the
+// computation did not finish, leaving 'crc' untouched; the CRC register
+// then still holds an earlier result that must not be compared.
+bool SPIComputeCRC(uint32_t start, uint32_t end, uint8_t* crc)
 {
+    TraceScope trace("spi", "SPIComputeCRC");
+    BeginI2CBatch();
     WriteReg(0x64, start >> 16);
     WriteReg(0x65, start >> 8);
     WriteReg(0x66, start);
@@ -197,13 +162,19 @@ uint8_t SPIComputeCRC(uint32_t start, uint32_t end)
     WriteReg(0x74, end);
 
     WriteReg(0x6f, 0x84);
-    uint8_t b;
-    do
-    {
-        b = ReadReg(0x6f);
-    }
-    while (!(b & 0x2));    // TODO: add timeout and reset the controller
-    return ReadReg(0x75);
+    bool done = PollRegister(E_POLL_CRC, (end - start) / 1024 + 1, 0x6f, 0x02, 0x02);
+    EndI2CBatch();
+    if (!done)
+        return false;
+    *crc = ReadReg(0x75);
+    return true;
+}
+
+// Whether the chip's CRC of [start, end] is 'crc'.
+static bool ChipCRCMatches(uint32_t start, uint32_t end, uint8_t crc)
+{
+    uint8_t chip_crc;
+    return SPIComputeCRC(start, end, &chip_crc) && chip_crc == crc;
 }
 
 uint8_t GetManufacturerId(uint32_t jedec_id)
@@ -211,43 +182,320 @@ uint8_t GetManufacturerId(uint32_t jedec_id)
     return jedec_id >> 16;
 }
 
-void SetupChipCommands(uint32_t jedec_id)
+// Read SFDP data through the common command engine. It writes at most
+// three bytes after the opcode, so the dummy byte 0x5A expects after the
+// address is read back as the first of the three bytes instead, leaving
+// two bytes of data per command.
+static bool ReadSFDP(uint32_t addr, uint8_t* dest, uint32_t len)
 {
-    uint8_t manufacturer_id = GetManufacturerId(jedec_id);
-    switch (manufacturer_id)
+    for (uint32_t i = 0; i < len; i += 2)
     {
-    case 0xEF:
-    case 0xC2:	// Add Taka
-    case 0xC8:	// Add Taka
-        // These are the codes for Winbond
-        WriteReg(0x62, 0x06); // Flash Write enable op code
-        WriteReg(0x63, 0x50); // Flash Write register op code
-        WriteReg(0x6a, 0x03); // Flash Read op code.
-        WriteReg(0x6b, 0x0b); // Flash Fast read op code.
-        WriteReg(0x6d, 0x02); // Flash program op code.
-        WriteReg(0x6e, 0x05); // Flash read status op code.
-        break;
-    default:
-        fprintf(stderr, "Can not handle manufacturer code %02x\n", manufacturer_id);
-        exit(-6);
-        break;
+        uint32_t value;
+        if (!SPICommonCommand(E_CC_READ, 0x5a, 3, 3, addr + i, &value))
+            return false;
+        dest[i] = (uint8_t)(value >> 8);
+        if (i + 1 < len)
+            dest[i + 1] = (uint8_t)value;
     }
+    return true;
 }
 
-bool SaveFlash(const char *output_file_name, uint32_t chip_size)
+void SetupChipCommands(const FlashDesc* chip)
 {
-    FILE *dump;
-    uint32_t addr = 0;
-	fopen_s(&dump, output_file_name, "wb");
+    // The opcodes are the JEDEC ones, only the status register write
+    // enable differs between the parts.
+    uint8_t wrsr_enable = chip->wrsr_enable;
+    if (wrsr_enable == 0)
+    {
+        switch (GetManufacturerId(chip->jedec_id))
+        {
+        case 0xEF:
+        case 0xC2:	// Add Taka
+        case 0xC8:	// Add Taka
+        case 0xBF:
+            wrsr_enable = 0x50;
+            break;
+        default:
+            wrsr_enable = 0x06;
+            break;
+        }
+    }
+    WriteReg(0x62, 0x06); // Flash Write enable op code
+    WriteReg(0x63, wrsr_enable); // Flash Write register op code
+    WriteReg(0x6a, 0x03); // Flash Read op code.
+    WriteReg(0x6b, 0x0b); // Flash Fast read op code.
+    WriteReg(0x6d, 0x02); // Flash program op code.
+    WriteReg(0x6e, 0x05); // Flash read status op code.
+}
+
+// Size of the blocks a failed dump verification is narrowed down to.
+#define VERIFY_BLOCK_SIZE 4096
+
+// Blocks whose on-chip CRC does not match the host data.
+struct BadBlocks
+{
+    uint32_t* addr;
+    uint32_t  count;
+    uint32_t  block;        // block size in bytes
+    uint32_t  requests;     // CRC requests spent on the search
+};
+
+// CRC of the 256 byte pages [first, last), combined from their own CRCs.
+static uint8_t PagesCRC(const uint8_t* page_crc, uint32_t first, uint32_t last)
+{
+    uint8_t crc = 0;
+    for (uint32_t page = first; page < last; page++)
+        crc = CRCCombine(crc, page_crc[page], 256);
+    return crc;
+}
+
+// CRC of each 256 byte page of data[0, len), freed with delete [].
+static uint8_t* ComputePageCRCs(const uint8_t* data, uint32_t len)
+{
+    uint8_t* page_crc = new uint8_t[len / 256];
+    for (uint32_t page = 0; page < len / 256; page++)
+    {
+        CRCContext ctx;
+        CRCInit(&ctx);
+        CRCUpdate(&ctx, data + page * 256, 256);
+        page_crc[page] = CRCFinal(&ctx);
+    }
+    return page_crc;
+}
+
+// Compare the host CRC of [start, end), combined from the page CRCs, with
+// the chip's range CRC and, on a mismatch, bisect the range down to single
+// blocks, so that k bad blocks cost about 2k*log2(n) CRC requests instead
+// of re-reading n blocks.
+static void BisectCRC(const uint8_t* page_crc, uint32_t start, uint32_t end, BadBlocks* bad)
+{
+    bad->requests++;
+    if (ChipCRCMatches(start, end - 1, PagesCRC(page_crc, start / 256, end / 256)))
+        return;
+    uint32_t blocks = (end - start + bad->block - 1) / bad->block;
+    if (blocks <= 1)
+    {
+        bad->addr[bad->count++] = start;
+        return;
+    }
+    uint32_t mid = start + (blocks / 2) * bad->block;
+    BisectCRC(page_crc, start, mid, bad);
+    BisectCRC(page_crc, mid, end, bad);
+}
+
+// Locate the blocks of [0, len) that differ on the chip, 'len' being a
+// multiple of 256. The caller has already seen the CRC of the whole range
+// mismatch, so the search starts with its halves. Free bad->addr with
+// delete [].
+static void FindBadBlocks(const uint8_t* page_crc, uint32_t len, uint32_t block, BadBlocks* bad)
+{
+    bad->addr = new uint32_t[(len + block - 1) / block];
+    bad->count = 0;
+    bad->block = block;
+    bad->requests = 0;
+    uint32_t blocks = (len + block - 1) / block;
+    if (blocks <= 1)
+    {
+        bad->addr[bad->count++] = 0;
+        return;
+    }
+    uint32_t mid = (blocks / 2) * block;
+    BisectCRC(page_crc, 0, mid, bad);
+    BisectCRC(page_crc, mid, len, bad);
+    fprintf(stderr, "%u bad %uKB blocks found with %u CRC requests\n",
+            bad->count, block / 1024, bad->requests);
+}
+
+// Re-read the blocks of a dump that failed verification, patching the
+// (mapped) data in place. 'dump_crc' holds the page CRCs of the data as
+// read, or is NULL. Returns true once the whole dump matches the chip.
+static bool RepairDump(uint8_t* data, uint32_t len, const uint8_t* dump_crc)
+{
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        BadBlocks bad;
+        uint8_t* page_crc = NULL;
+        if (attempt > 0 || dump_crc == NULL)
+            page_crc = ComputePageCRCs(data, len);
+        FindBadBlocks(page_crc ? page_crc : dump_crc, len, VERIFY_BLOCK_SIZE, &bad);
+        delete [] page_crc;
+        for (uint32_t i = 0; i < bad.count; i++)
+        {
+            uint32_t addr = bad.addr[i];
+            uint32_t n = (len - addr < bad.block) ? len - addr : bad.block;
+            fprintf(stderr, "Re-reading addr %x\n", addr);
+            if (!SPIRead(addr, data + addr, n))
+                break;
+        }
+        delete [] bad.addr;
+
+        CRCContext ctx;
+        CRCInit(&ctx);
+        CRCUpdate(&ctx, data, len);
+        if (ChipCRCMatches(0, len - 1, CRCFinal(&ctx)))
+            return true;
+    }
+    return false;
+}
+
+// Bytes dumped per read command.
+#define SPI_READ_WINDOW (64 * 1024)
+// Bytes handed from the adapter to the CRC stage at a time, and the number
+// of them that may be in flight.
+#define DUMP_CHUNK_SIZE 4096
+#define DUMP_RING_SLOTS 32
+
+// Stages of a dump: the adapter stage, on the thread owning the session,
+// reads into the output and passes each chunk through the ring to the CRC
+// stage, which computes the running and the per page CRCs on its own
+// thread while the adapter already reads on.
+struct DumpPipeline
+{
+    SpscRing   ring;
+    StageStats read;
+    StageStats crc;
+    CRCContext ctx;
+    uint8_t*   page_crc;
+};
+
+static void DumpCRCStage(void* arg)
+{
+    DumpPipeline* pipe = (DumpPipeline*)arg;
+    StartStage(&pipe->crc, "crc");
+    for (;;)
+    {
+        PipeChunk chunk;
+        RingPopWait(&pipe->ring, &chunk, &pipe->crc);
+        if (chunk.len == 0)
+            break;
+        CRCUpdate(&pipe->ctx, chunk.data, chunk.len);
+        for (uint32_t offset = 0; offset < chunk.len; offset += 256)
+        {
+            CRCContext page;
+            CRCInit(&page);
+            CRCUpdate(&page, chunk.data + offset, 256);
+            pipe->page_crc[(chunk.addr + offset) / 256] = CRCFinal(&page);
+        }
+    }
+    FinishStage(&pipe->crc);
+}
+
+// Check whether 'len' bytes of the chip at 'start' are erased, comparing the
+// on-chip CRC with the CRC of as many 0xff bytes.
+static bool IsChipBlank(uint32_t start, uint32_t len)
+{
+    uint8_t blank[256];
+    memset(blank, 0xff, sizeof(blank));
+    InitCRC();
+    for (uint32_t done = 0; done < len; done += sizeof(blank))
+    {
+        uint32_t n = len - done;
+        if (n > sizeof(blank))
+            n = sizeof(blank);
+        ProcessCRC(blank, n);
+    }
+    return ChipCRCMatches(start, start + len - 1, GetCRC());
+}
+
+// Whether the read window at 'addr' is erased, as told by the chip's CRCs of
+// its two halves. Together they cover every byte of the window, and data
+// spread over both halves has to collide with the blank CRC in each.
+static bool IsWindowBlank(uint32_t addr, uint32_t len)
+{
+    uint32_t half = len / 2;
+    return IsChipBlank(addr, half) && IsChipBlank(addr + half, len - half);
+}
+
+// With the link feedback on, check a window just read against the chip's
+// CRC of it. A failure steps the link down for the following windows and
+// the window itself is left to RepairDump().
+static void CheckWindow(const uint8_t* data, uint32_t addr, uint32_t len)
+{
+    uint8_t chip_crc;
+    if (!SPIComputeCRC(addr, addr + len - 1, &chip_crc))
+        return;
     InitCRC();
+    ProcessCRC(data, len);
+    if (GetCRC() == chip_crc)
+        ReportI2CGood(len);
+    else
+        ReportI2CCRCError();
+}
+
+// With 'sparse' set, windows the chip reports as erased are filled with
+// 0xff locally instead of being read, which takes two CRC requests rather
+// than 64KB of I2C traffic. A blank window misjudged in spite of both CRCs
+// still fails the final CRC of the dump and is re-read by RepairDump().
+bool SaveFlash(const char *output_file_name, uint32_t chip_size, bool sparse)
+{
+    // The flash is read straight into the output file, mapped at its final
+    // size, where bad reads are also repaired. "-" streams to stdout.
+    MappedFile dump;
+    uint32_t addr = 0;
+    chip_size = (chip_size + 1023) & ~1023;
+    if (!MapOutputFile(output_file_name, chip_size, &dump))
+    {
+        fprintf(stderr, "Can't create output file %s\n", output_file_name);
+        return false;
+    }
+    DumpPipeline pipe;
+    Thread crc_thread;
+    InitRing(&pipe.ring, DUMP_RING_SLOTS);
+    CRCInit(&pipe.ctx);
+    pipe.page_crc = new uint8_t[chip_size / 256];
+    if (!StartThread(&crc_thread, DumpCRCStage, &pipe))
+    {
+        fprintf(stderr, "Can't start the CRC stage\n");
+        delete [] pipe.page_crc;
+        FreeRing(&pipe.ring);
+        UnmapFile(&dump);
+        return false;
+    }
+    StartStage(&pipe.read, "read");
+    uint32_t windows = 0;
+    uint32_t skipped = 0;
+    bool read_ok = true;
     do
     {
-        uint8_t buffer[1024];
-        fprintf(stderr, "Reading addr %x\r", addr);
-        SPIRead(addr, buffer, sizeof(buffer));
-        fwrite(buffer, 1, sizeof(buffer), dump);
-        ProcessCRC(buffer, sizeof(buffer));
-        addr += sizeof(buffer);
+        uint32_t len = chip_size - addr;
+        if (len > SPI_READ_WINDOW)
+            len = SPI_READ_WINDOW;
+        bool blank = sparse && IsWindowBlank(addr, len);
+        windows++;
+        if (blank)
+        {
+            PrintProgress("Skipping blank addr %x", addr);
+            memset(dump.data + addr, 0xff, len);
+            skipped++;
+        }
+        else
+        {
+            PrintProgress("Reading addr %x", addr);
+        }
+        TraceScope trace("spi", blank ? "blank window" : "read window");
+        uint32_t start = addr;
+        if (!blank && !SPIReadStart(addr))
+        {
+            read_ok = false;
+            break;
+        }
+        for (uint32_t end = addr + len; addr < end; addr += DUMP_CHUNK_SIZE)
+        {
+            PipeChunk chunk;
+            chunk.addr = addr;
+            chunk.data = dump.data + addr;
+            chunk.len = end - addr < DUMP_CHUNK_SIZE ? end - addr : DUMP_CHUNK_SIZE;
+            if (!blank && !ReadBytesFromAddr(0x70, chunk.data, chunk.len))
+            {
+                read_ok = false;
+                break;
+            }
+            RingPushWait(&pipe.ring, &chunk, &pipe.read);
+        }
+        if (!read_ok)
+            break;
+        if (!blank && GetI2CQuality().adaptive)
+            CheckWindow(dump.data + start, start, len);
     }
     /**
      * don't read entire flash chip but only
@@ -259,119 +507,807 @@ bool SaveFlash(const char *output_file_name, uint32_t chip_size)
      */
     //while (addr < 0x3ffff && addr < chip_size);
     while (addr < chip_size); 
+    FinishStage(&pipe.read);
+    PipeChunk end = {addr, NULL, 0};
+    uint32_t round = 0;
+    while (!RingPush(&pipe.ring, &end))
+        RingBackoff(&round);
+    JoinThread(&crc_thread);
     fprintf(stderr, "\ndone.\n");
-    fclose(dump);
-    uint8_t data_crc = GetCRC();
+    if (sparse)
+        fprintf(stderr, "%u of %u %uKB windows blank, not read\n",
+                skipped, windows, SPI_READ_WINDOW / 1024);
+    PrintStageStats(&pipe.read, &pipe.ring);
+    PrintStageStats(&pipe.crc, &pipe.ring);
+    uint8_t data_crc = CRCFinal(&pipe.ctx);
     //uint8_t chip_crc = SPIComputeCRC(0, chip_size - 1);
-    uint8_t chip_crc = SPIComputeCRC(0, addr - 1);
-    fprintf(stderr, "Received data CRC %02x\n", data_crc);
-    fprintf(stderr, "Chip CRC %02x\n", chip_crc);
-    return data_crc == chip_crc;
+    uint8_t chip_crc = 0;
+    bool ok = read_ok && SPIComputeCRC(0, addr - 1, &chip_crc);
+    if (!read_ok)
+        fprintf(stderr, "Read failed at addr %x\n", addr);
+    else
+    {
+        fprintf(stderr, "Received data CRC %02x\n", data_crc);
+        fprintf(stderr, "Chip CRC %02x\n", chip_crc);
+    }
+    ok = ok && data_crc == chip_crc;
+    if (!ok && read_ok)
+    {
+        ok = RepairDump(dump.data, addr, pipe.page_crc);
+        fprintf(stderr, "Repair %s\n", ok ? "succeeded" : "failed");
+    }
+    delete [] pipe.page_crc;
+    FreeRing(&pipe.ring);
+    if (!UnmapFile(&dump))
+    {
+        fprintf(stderr, "Can't write output file %s\n", output_file_name);
+        ok = false;
+    }
+    return ok;
 }
 
-uint64_t GetFileSize(FILE* file)
+// Image to program, accessed through a memory mapping of its file (or a
+// buffer holding a piped image). Raw images are used in place, GFF images
+// are decoded a page at a time as they are programmed.
+struct ImageSource
 {
-    uint64_t current_pos;
-    uint64_t result;
-    // TODO
-    /*
-    current_pos = _ftelli64(file);
-    fseek(file, 0, SEEK_END);
-    result = _ftelli64(file);
-    _fseeki64(file, current_pos, SEEK_SET);
-
-    */
-    current_pos = ftell(file);
-    fseek(file, 0, SEEK_END);
-    result = ftell(file);
-    fseek(file, current_pos, SEEK_SET);
+    MappedFile  file;
+    uint32_t    data_offset;    // start of the raw image or the GFF stream
+    uint32_t    data_len;
+    uint32_t    pos;            // raw read position
+    GffDecoder* gff;            // NULL for raw images
+    bool        view;           // 'file' belongs to another source
+};
 
-    return result;
+static bool RewindImage(ImageSource* src)
+{
+    if (NULL != src->gff)
+    {
+        GffDecoderClose(src->gff);
+        src->gff = NULL;
+    }
+    src->pos = 0;
+    if (src->data_offset != 0)
+        src->gff = GffDecoderOpen(src->file.data + src->data_offset, src->data_len);
+    return true;
 }
 
-static uint8_t* ReadFile(const char *file_name, uint32_t* size)
+static bool OpenImage(const char *file_name, ImageSource* src)
 {
-    FILE *file;
-    uint8_t* result = NULL;
-	fopen_s(&file, file_name, "rb");
-    if (NULL == file)
+    memset(src, 0, sizeof(*src));
+    if (!MapInputFile(file_name, &src->file))
     {
         fprintf(stderr, "Can't open input file %s\n", file_name);
-        return result;
-    }
-    uint64_t file_size64 = GetFileSize(file);
-    if (file_size64 > 8*1024*1024)
-    {
-        fprintf(stderr, "This file looks to big %lld\n", file_size64);
-        fclose(file);
-        return result;
-    }
-    uint32_t file_size = (uint32_t)file_size64;
-    result = new uint8_t[file_size];
-    if (NULL == result)
-    {
-        fprintf(stderr, "Not enough RAM.\n");
-        fclose(file);
-        return result;
+        return false;
     }
-    fread(result, 1, file_size, file);
-    fclose(file);
-    if (memcmp("GMI GFF V1.0", result, 12) == 0)
+    uint32_t file_size = src->file.size;
+    src->data_len = file_size;
+    if (file_size >= 12 && memcmp("GMI GFF V1.0", src->file.data, 12) == 0)
     {
         fprintf(stderr, "Detected GFF image.\n");
         // Handle GFF file
         if (file_size < 256)
         {
             fprintf(stderr, "This file looks to small %d\n", file_size);
-            delete [] result;
-            return NULL;
+            UnmapFile(&src->file);
+            return false;
+        }
+        src->data_offset = 256;
+        src->data_len = file_size - 256;
+    }
+    else if (file_size > 8*1024*1024)
+    {
+        fprintf(stderr, "This file looks to big %d\n", file_size);
+        UnmapFile(&src->file);
+        return false;
+    }
+    return RewindImage(src);
+}
+
+// Read the next 'len' bytes of the (decoded) image. Returns the number of
+// bytes read, less than 'len' at the end of the image.
+static uint32_t ReadImage(ImageSource* src, uint8_t* dest, uint32_t len)
+{
+    if (NULL != src->gff)
+        return GffDecoderRead(src->gff, dest, len);
+    if (len > src->data_len - src->pos)
+        len = src->data_len - src->pos;
+    memcpy(dest, src->file.data + src->pos, len);
+    src->pos += len;
+    return len;
+}
+
+// Return the next 256 byte page of the image. Full pages of raw images are
+// returned in place, anything else is read into 'buffer' and padded with
+// 0xff. Returns NULL at the end of the image.
+static const uint8_t* NextImagePage(ImageSource* src, uint8_t* buffer)
+{
+    if (NULL == src->gff && src->data_len - src->pos >= 256)
+    {
+        const uint8_t* page = src->file.data + src->pos;
+        src->pos += 256;
+        return page;
+    }
+    memset(buffer, 0xff, 256);
+    return (ReadImage(src, buffer, 256) != 0) ? buffer : NULL;
+}
+
+static bool ImageFailed(const ImageSource* src)
+{
+    return NULL != src->gff && GffDecoderFailed(src->gff);
+}
+
+static void CloseImage(ImageSource* src)
+{
+    if (NULL != src->gff)
+        GffDecoderClose(src->gff);
+    if (!src->view)
+        UnmapFile(&src->file);
+}
+
+// Open a second cursor on the data of 'image', which must stay open and
+// is only read.
+static bool OpenImageView(const ImageSource* image, ImageSource* view)
+{
+    *view = *image;
+    view->gff = NULL;
+    view->view = true;
+    return RewindImage(view);
+}
+
+// Replace a GFF image by its first 'len' decoded bytes, so that views on
+// it share the decoded data instead of decoding it again.
+static bool DecodeImage(ImageSource* src, uint32_t len)
+{
+    if (NULL == src->gff)
+        return true;
+    MappedFile decoded;
+    memset(&decoded, 0, sizeof(decoded));
+    decoded.fd = -1;
+    decoded.data = new uint8_t[len];
+    decoded.size = len;
+    memset(decoded.data, 0xff, len);
+    ReadImage(src, decoded.data, len);
+    bool ok = !ImageFailed(src);
+    GffDecoderClose(src->gff);
+    src->gff = NULL;
+    UnmapFile(&src->file);
+    src->file = decoded;
+    src->data_offset = 0;
+    src->data_len = len;
+    src->pos = 0;
+    return ok;
+}
+
+// Compress an image (raw or GFF) into a GFF file.
+static bool EncodeFile(const char* input_file_name, const char* output_file_name)
+{
+    ImageSource src;
+    if (!OpenImage(input_file_name, &src))
+        return false;
+    const uint32_t max_size = 8 * 1024 * 1024;
+    uint8_t* data = new uint8_t[max_size];
+    uint32_t size = ReadImage(&src, data, max_size);
+    bool ok = !ImageFailed(&src) && size != 0;
+    CloseImage(&src);
+    if (!ok)
+    {
+        fprintf(stderr, "Can't read %s\n", input_file_name);
+        delete [] data;
+        return false;
+    }
+
+    uint8_t* gff = new uint8_t[GffEncodedMaxSize(size)];
+    uint32_t gff_size = EncodeGff(data, size, gff);
+    MappedFile out;
+    ok = MapOutputFile(output_file_name, gff_size, &out);
+    if (ok)
+    {
+        memcpy(out.data, gff, gff_size);
+        ok = UnmapFile(&out);
+    }
+    fprintf(stderr, "%s: %u -> %u bytes\n", output_file_name, size, gff_size);
+    delete [] gff;
+    delete [] data;
+    return ok;
+}
+
+static bool ShouldProgramPage(const uint8_t* buffer, uint32_t size)
+{
+    for (uint32_t idx = 0; idx < size; ++idx)
+    {
+        if (buffer[idx] != 0xff)
+            return true;
+    }
+    return false;
+}
+
+// Program one 256 byte page and wait for the cycle to finish. The address and
+// FIFO setup, the start command, a delay of the learned program time and the
+// first status read go out as a single USB transfer, so in the steady state a
+// page costs one round-trip and one status read. False when the cycle did
+// not finish.
+static bool ProgramPage(uint32_t addr, const uint8_t* buffer)
+{
+    TraceScope trace("spi", "ProgramPage");
+    BeginI2CBatch();
+
+    // Set program size-1
+    WriteReg(0x71, 255);
+
+    // Set the programming address
+    WriteReg(0x64, addr >> 16);
+    WriteReg(0x65, addr >> 8);
+    WriteReg(0x66, addr);
+
+    // Write the content to register 0x70
+    // Out USB gizmo supports max 63 bytes at a time.
+#if 0
+    WriteBytesToAddr(0x70, buffer, 63);
+    WriteBytesToAddr(0x70, buffer + 63, 63);
+    WriteBytesToAddr(0x70, buffer + 126, 63);
+    WriteBytesToAddr(0x70, buffer + 189, 63);
+    WriteBytesToAddr(0x70, buffer + 252, 4);
+#else
+    WriteBytesToAddr(0x70, buffer, 128);
+    WriteBytesToAddr(0x70, buffer+128, 128);
+#endif
+
+    WriteReg(0x6f, 0xa0); // Start Programing
+
+    // Wait for programming cycle to finish
+    bool done = PollRegister(E_POLL_PAGE_PROGRAM, 1, 0x6f, 0x40, 0);
+    EndI2CBatch();
+    return done;
+}
+
+// Erase commands in the order of FlashDesc::erase_kb.
+static const uint8_t EraseOpcodes[3] = {0x20, 0x52, 0xd8};
+
+// Typical erase times in ms (Winbond/Macronix datasheets), used to pick the
+// cheapest mix of erase commands for chips that don't tell theirs.
+static uint32_t EraseCostMs(uint32_t size_kb)
+{
+    switch (size_kb)
+    {
+    case 4:
+        return 45;
+    case 32:
+        return 120;
+    case 64:
+        return 150;
+    }
+    return size_kb * 3;
+}
+
+// What the erase planner has to do with each smallest erasable unit.
+enum EEraseUnit
+{
+    E_EU_KEEP = 0,  // outside the area being written, must survive
+    E_EU_ANY = 1,   // left blank by the image and already blank on the chip
+    E_EU_NEED = 2   // has to be erased
+};
+
+struct ErasePlan
+{
+    int      levels;        // distinct erase sizes, largest first
+    uint8_t  opcode[3];
+    uint32_t size[3];       // in bytes
+    uint32_t cost_ms[3];    // typical time of one erase
+    uint32_t count[3];      // erase commands issued per level
+    bool     failed;        // an erase did not finish, none issued after it
+    uint32_t unit;          // smallest erase size
+    uint32_t num_units;
+    uint8_t* units;         // EEraseUnit for each unit of the chip
+};
+
+// Sort the erase commands supported by the chip by size, largest first.
+// Returns false when the chip table has no erase granularities.
+static bool InitErasePlan(ErasePlan* plan, const FlashDesc* chip, uint32_t chip_size)
+{
+    memset(plan, 0, sizeof(*plan));
+    for (int i = 2; i >= 0; i--)
+    {
+        uint32_t size = chip->erase_kb[i] * 1024;
+        if (size == 0)
+            continue;
+        bool dup = false;
+        for (int l = 0; l < plan->levels; l++)
+            dup |= plan->size[l] == size;
+        if (dup)
+            continue;
+        int l = plan->levels++;
+        while (l > 0 && plan->size[l - 1] < size)
+        {
+            plan->size[l] = plan->size[l - 1];
+            plan->opcode[l] = plan->opcode[l - 1];
+            plan->cost_ms[l] = plan->cost_ms[l - 1];
+            l--;
+        }
+        plan->size[l] = size;
+        plan->opcode[l] = EraseOpcodes[i];
+        plan->cost_ms[l] = chip->erase_ms[i] ? chip->erase_ms[i] : EraseCostMs(chip->erase_kb[i]);
+    }
+    if (plan->levels == 0)
+        return false;
+    plan->unit = plan->size[plan->levels - 1];
+    plan->num_units = (chip_size + plan->unit - 1) / plan->unit;
+    plan->units = new uint8_t[plan->num_units];
+    memset(plan->units, E_EU_KEEP, plan->num_units);
+    return true;
+}
+
+// Per page summary of the image gathered by ScanImage(), standing in for
+// the image itself until it is streamed to the chip.
+struct ImageInfo
+{
+    uint32_t pages;         // 256 byte pages, the last one padded with 0xff
+    uint8_t* page_crc;
+    bool*    page_used;     // page holds something else than 0xff
+    uint64_t hash;          // FNV-1a of the pages, identifying the image
+};
+
+// Decode the whole image once to size it and summarize its pages.
+static bool ScanImage(ImageSource* src, uint32_t chip_size, ImageInfo* info)
+{
+    info->pages = 0;
+    info->hash = 14695981039346656037ULL;
+    info->page_crc = new uint8_t[chip_size / 256];
+    info->page_used = new bool[chip_size / 256];
+    uint8_t buffer[256];
+    const uint8_t* page;
+    while (info->pages < chip_size / 256 && (page = NextImagePage(src, buffer)) != NULL)
+    {
+        CRCContext ctx;
+        CRCInit(&ctx);
+        CRCUpdate(&ctx, page, 256);
+        info->page_crc[info->pages] = CRCFinal(&ctx);
+        info->page_used[info->pages] = ShouldProgramPage(page, 256);
+        for (uint32_t i = 0; i < 256; i++)
+            info->hash = (info->hash ^ page[i]) * 1099511628211ULL;
+        info->pages++;
+    }
+    if (ImageFailed(src) || info->pages == 0)
+    {
+        fprintf(stderr, "GFF Decoding failed for this file\n");
+        return false;
+    }
+    return RewindImage(src);
+}
+
+// Classify the units covered by the image. Units whose image content is all
+// 0xff only need an erase when the chip is not blank there, which is checked
+// once per run of such units. In differential mode ('changed' != NULL) the
+// units of unchanged blocks are kept. When resuming an interrupted run the
+// units still blank from its erase are not erased again either, which is
+// checked unit by unit.
+static void MarkEraseUnits(ErasePlan* plan, const ImageInfo* info,
+                           bool* changed, uint32_t block_size, bool resume)
+{
+    uint32_t prog_size = info->pages * 256;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for (uint32_t u = 0; u <= plan->num_units; u++)
+    {
+        uint32_t start = u * plan->unit;
+        uint8_t state = E_EU_KEEP;
+        if (u < plan->num_units && start < prog_size &&
+            (changed == NULL || changed[start / block_size]))
+        {
+            uint32_t len = plan->unit;
+            if (start + len > prog_size)
+                len = prog_size - start;
+            state = E_EU_ANY;
+            for (uint32_t page = start / 256; page < (start + len) / 256; page++)
+            {
+                if (info->page_used[page])
+                    state = E_EU_NEED;
+            }
+            if (state == E_EU_NEED && resume)
+            {
+                PrintProgress("Checking addr %x", start);
+                if (IsChipBlank(start, len))
+                    state = E_EU_KEEP;
+            }
+            if (state == E_EU_ANY)
+            {
+                if (run_len == 0)
+                    run_start = u;
+                run_len += len;
+            }
         }
-        uint32_t gff_size = ComputeGffDecodedSize(result + 256,
-                            file_size - 256);
-        if (gff_size == 0)
+        if (u < plan->num_units)
+            plan->units[u] = state;
+        if (state != E_EU_ANY && run_len != 0)
         {
-            fprintf(stderr, "GFF Decoding failed for this file\n");
-            delete [] result;
-            return NULL;
+            PrintProgress("Checking addr %x", run_start * plan->unit);
+            if (!IsChipBlank(run_start * plan->unit, run_len))
+            {
+                for (uint32_t r = run_start; r < u; r++)
+                    plan->units[r] = E_EU_NEED;
+            }
+            run_len = 0;
         }
-        uint8_t* gff_data = new uint8_t[gff_size];
-        if (NULL == gff_data)
+    }
+}
+
+// Return the cost of erasing what is needed in the 'level' sized block at
+// 'addr', either with one erase or by splitting it into smaller blocks,
+// whichever is cheaper. Blocks holding units to keep are split when
+// possible. The chosen erases are issued when 'issue' is set.
+static uint32_t PlanErase(ErasePlan* plan, uint32_t addr, int level, bool issue)
+{
+    bool need = false;
+    bool keep = false;
+    uint32_t first = addr / plan->unit;
+    for (uint32_t u = first; u < first + plan->size[level] / plan->unit; u++)
+    {
+        uint8_t state = (u < plan->num_units) ? plan->units[u] : (uint8_t)E_EU_KEEP;
+        need |= state == E_EU_NEED;
+        keep |= state == E_EU_KEEP;
+    }
+    if (!need)
+        return 0;
+
+    uint32_t whole = plan->cost_ms[level];
+    // The second bound only tells the compiler the recursion stays within
+    // the arrays, 'levels' never exceeds their size.
+    if (level + 1 < plan->levels && level + 1 < 3)
+    {
+        uint32_t split = 0;
+        uint32_t sub = plan->size[level + 1];
+        for (uint32_t a = addr; a < addr + plan->size[level]; a += sub)
+            split += PlanErase(plan, a, level + 1, false);
+        if (keep || split < whole)
         {
-            fprintf(stderr, "Not enough RAM.\n");
-            delete [] result;
-            return NULL;
+            if (issue)
+            {
+                for (uint32_t a = addr; a < addr + plan->size[level]; a += sub)
+                    PlanErase(plan, a, level + 1, true);
+            }
+            return split;
         }
-        DecodeGff(result + 256, file_size - 256, gff_data);
-        // Replace the encoded buffer with the decoded data.
-        delete [] result;
-        result = gff_data;
-        file_size = gff_size;
     }
-    if (NULL != size)
+    if (issue && !plan->failed)
     {
-        *size = file_size;
+        PrintProgress("Erasing addr %x", addr);
+        if (SPICommonCommand(E_CC_ERASE, plan->opcode[level], 0, 3, addr))
+            plan->count[level]++;
+        else
+            plan->failed = true;
     }
-    return result;
+    return whole;
 }
 
-static bool ShouldProgramPage(uint8_t* buffer, uint32_t size)
+// Erase the units marked E_EU_NEED with the cheapest mix of erase commands.
+// Stops at the first erase that does not finish and returns false.
+static bool ExecuteErasePlan(ErasePlan* plan)
 {
-    for (uint32_t idx = 0; idx < size; ++idx)
+    uint32_t cost = 0;
+    for (uint32_t addr = 0; addr < plan->num_units * plan->unit && !plan->failed; addr += plan->size[0])
+        cost += PlanErase(plan, addr, 0, true);
+    for (int l = 0; l < plan->levels; l++)
     {
-        if (buffer[idx] != 0xff)
+        fprintf(stderr, "%s%u x %uKB", l ? ", " : "\n", plan->count[l], plan->size[l] / 1024);
+    }
+    fprintf(stderr, " erases, about %ums\n", cost);
+    if (plan->failed)
+        fprintf(stderr, "Erase failed\n");
+    return !plan->failed;
+}
+
+// Compare the image against the chip block by block, using the on-chip CRC
+// unit, and return a per-block array flagging the blocks that differ (or
+// whose CRC the chip did not deliver). Only the part of the last block
+// covered by the image is compared. Returns the number of changed blocks in
+// 'num_changed'.
+static bool* FindChangedBlocks(const ImageInfo* info,
+                               uint32_t block_size, uint32_t num_blocks,
+                               uint32_t* num_changed)
+{
+    uint32_t prog_size = info->pages * 256;
+    bool* changed = new bool[num_blocks];
+    *num_changed = 0;
+    for (uint32_t block = 0; block < num_blocks; block++)
+    {
+        uint32_t start = block * block_size;
+        uint32_t len = block_size;
+        if (start + len > prog_size)
+            len = prog_size - start;
+        PrintProgress("Comparing addr %x", start);
+        uint8_t data_crc = PagesCRC(info->page_crc, start / 256, (start + len) / 256);
+        changed[block] = !ChipCRCMatches(start, start + len - 1, data_crc);
+        if (changed[block])
+            (*num_changed)++;
+    }
+    fprintf(stderr, "\n%u of %u blocks changed\n", *num_changed, num_blocks);
+    return changed;
+}
+
+// Erase the units of 'plan' flagged in 'bad_unit' and program the used
+// pages of the image falling into them again. Returns false when an erase
+// or a page program did not finish.
+static bool ReprogramUnits(ImageSource* src, const ImageInfo* info,
+                           ErasePlan* plan, const bool* bad_unit)
+{
+    if (!SPICommonCommand(E_CC_WRITE_AFTER_EWSR, 1, 0, 1, 0) || // Unprotect the Status Register
+        !SPICommonCommand(E_CC_WRITE_AFTER_WREN, 1, 0, 1, 0))   // Unprotect the flash
+        return false;
+    for (uint32_t u = 0; u < plan->num_units; u++)
+    {
+        if (bad_unit[u])
+            plan->units[u] = E_EU_NEED;
+    }
+    if (!ExecuteErasePlan(plan))
+        return false;
+
+    // Stream the image again, reprogramming the pages of the bad units.
+    RewindImage(src);
+    for (uint32_t page = 0; page < info->pages; page++)
+    {
+        uint8_t buffer[256];
+        const uint8_t* data = NextImagePage(src, buffer);
+        uint32_t addr = page * 256;
+        if (bad_unit[addr / plan->unit] && info->page_used[page])
+        {
+            PrintProgress("Writing addr %x", addr);
+            if (!ProgramPage(addr, data))
+                return false;
+        }
+    }
+    return SPICommonCommand(E_CC_WRITE_AFTER_EWSR, 1, 0, 1, 0x1c) && // Unprotect the Status Register
+           SPICommonCommand(E_CC_WRITE_AFTER_WREN, 1, 0, 1, 0x1c);   // Protect the flash
+}
+
+// Erase and reprogram the blocks of the image that failed verification.
+// Returns true once the whole image matches the chip.
+static bool RepairFlash(ImageSource* src, const ImageInfo* info,
+                        const FlashDesc* chip, uint32_t chip_size)
+{
+    uint32_t len = info->pages * 256;
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        // Repair in units the chip can erase on their own.
+        ErasePlan plan;
+        if (!InitErasePlan(&plan, chip, chip_size))
+            return false;
+        BadBlocks bad;
+        FindBadBlocks(info->page_crc, len, plan.unit, &bad);
+        bool* bad_unit = new bool[plan.num_units];
+        memset(bad_unit, 0, plan.num_units);
+        for (uint32_t i = 0; i < bad.count; i++)
+        {
+            bad_unit[bad.addr[i] / plan.unit] = true;
+            ReportI2CCRCError();
+        }
+        bool done = ReprogramUnits(src, info, &plan, bad_unit);
+        delete [] bad_unit;
+        delete [] plan.units;
+        delete [] bad.addr;
+        if (!done)
+            return false;
+
+        if (ChipCRCMatches(0, len - 1, PagesCRC(info->page_crc, 0, info->pages)))
             return true;
     }
     return false;
 }
 
-bool ProgramFlash(const char *input_file_name, uint32_t chip_size)
+// Read back the pages flagged in 'check' and compare them with the image,
+// flagging the ones that differ in 'bad'. Each run of checked pages is
+// read with one read command per window; the pages of a window that can't
+// be read count as bad. Returns the number of bad pages.
+static uint32_t VerifyPages(ImageSource* src, const ImageInfo* info,
+                            const bool* check, bool* bad)
 {
-    uint32_t prog_size;
-    uint8_t* prog = ReadFile(input_file_name, &prog_size);
-    if (NULL == prog)
+    uint8_t* window = new uint8_t[SPI_READ_WINDOW];
+    uint32_t window_start = 0;
+    uint32_t window_len = 0;
+    uint32_t checked = 0;
+    uint32_t num_bad = 0;
+    RewindImage(src);
+    for (uint32_t page = 0; page < info->pages; page++)
     {
+        uint8_t buffer[256];
+        const uint8_t* data = NextImagePage(src, buffer);
+        uint32_t addr = page * 256;
+        bad[page] = false;
+        if (!check[page])
+            continue;
+        if (addr < window_start || addr >= window_start + window_len)
+        {
+            uint32_t end = page + 1;
+            while (end < info->pages && check[end] && (end + 1 - page) * 256 <= SPI_READ_WINDOW)
+                end++;
+            window_start = addr;
+            window_len = (end - page) * 256;
+            PrintProgress("Verifying addr %x", addr);
+            if (!SPIRead(addr, window, window_len))
+                window_len = 0;
+        }
+        if (window_len == 0 || FindMismatch(window + (addr - window_start), data, 256) < 256)
+        {
+            bad[page] = true;
+            num_bad++;
+        }
+        checked++;
+    }
+    fprintf(stderr, "\nVerified %u pages, %u differ\n", checked, num_bad);
+    delete [] window;
+    return num_bad;
+}
+
+// Compare the 'programmed' pages with the image byte for byte, which the
+// CRC-8 checks only do with a 1 in 256 chance of missing a difference, and
+// erase and reprogram the units around the pages that differ. Returns true
+// once all of them match.
+static bool VerifyFlash(ImageSource* src, const ImageInfo* info, const bool* programmed,
+                        const FlashDesc* chip, uint32_t chip_size)
+{
+    bool* check = new bool[info->pages];
+    bool* bad = new bool[info->pages];
+    PageRange* ranges = new PageRange[(info->pages + 1) / 2];
+    memcpy(check, programmed, info->pages * sizeof(bool));
+    bool ok = false;
+    for (int attempt = 0; ; attempt++)
+    {
+        if (VerifyPages(src, info, check, bad) == 0)
+        {
+            ok = true;
+            break;
+        }
+        uint32_t count = CoalescePages(bad, info->pages, 1, ranges);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            fprintf(stderr, "Mismatch at %x-%x\n", ranges[i].first * 256,
+                    ranges[i].end * 256 - 1);
+        }
+        ErasePlan plan;
+        if (attempt == 3 || !InitErasePlan(&plan, chip, chip_size))
+            break;
+        bool* bad_unit = new bool[plan.num_units];
+        memset(bad_unit, 0, plan.num_units);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t last = (ranges[i].end * 256 - 1) / plan.unit;
+            for (uint32_t u = ranges[i].first * 256 / plan.unit; u <= last; u++)
+                bad_unit[u] = true;
+        }
+        bool done = ReprogramUnits(src, info, &plan, bad_unit);
+
+        // Only the reprogrammed units need another look.
+        for (uint32_t page = 0; page < info->pages; page++)
+            check[page] = info->page_used[page] && bad_unit[page * 256 / plan.unit];
+        delete [] bad_unit;
+        delete [] plan.units;
+        if (!done)
+            break;
+    }
+    delete [] ranges;
+    delete [] bad;
+    delete [] check;
+    return ok;
+}
+
+static void FreeImage(ImageSource* src, ImageInfo* info)
+{
+    CloseImage(src);
+    delete [] info->page_crc;
+    delete [] info->page_used;
+}
+
+// Open and summarize up to 'max_size' bytes of an image. With 'decode' set,
+// GFF images are decoded once into memory for several sessions to share.
+static bool LoadImage(const char *input_file_name, uint32_t max_size, bool decode,
+                      ImageSource* src, ImageInfo* info)
+{
+    if (!OpenImage(input_file_name, src))
+    {
+        return false;
+    }
+    if (!ScanImage(src, max_size, info) ||
+        (decode && !DecodeImage(src, info->pages * 256)))
+    {
+        FreeImage(src, info);
         return false;
     }
+    return true;
+}
+
+// How ProgramImage() writes an image.
+struct ProgramOptions
+{
+    bool        differential;   // only the blocks that differ from the image
+    bool        verify;         // read back and compare the programmed pages
+    const char* journal;        // progress journal to resume from, or NULL
+};
+
+// Skip the blocks an interrupted run journaled as programmed, once the chip
+// confirms their CRC. Returns the number of blocks skipped.
+static uint32_t ResumeFromJournal(const Journal* journal, const ImageInfo* info,
+                                  uint32_t block_size, bool** changed, uint32_t* num_changed)
+{
+    uint32_t prog_size = info->pages * 256;
+    uint32_t skipped = 0;
+    for (uint32_t block = 0; block < journal->num_blocks; block++)
+    {
+        if (journal->block_crc[block] < 0 || (*changed && !(*changed)[block]))
+            continue;
+        uint32_t start = block * block_size;
+        uint32_t end = start + block_size < prog_size ? start + block_size : prog_size;
+        uint8_t host_crc = PagesCRC(info->page_crc, start / 256, end / 256);
+        if (journal->block_crc[block] != host_crc || !ChipCRCMatches(start, end - 1, host_crc))
+            continue;
+        if (*changed == NULL)
+        {
+            *changed = new bool[journal->num_blocks];
+            for (uint32_t b = 0; b < journal->num_blocks; b++)
+                (*changed)[b] = true;
+        }
+        (*changed)[block] = false;
+        (*num_changed)--;
+        skipped++;
+    }
+    return skipped;
+}
+
+// Program a loaded image, which is only read, through a cursor of its own.
+static bool ProgramImage(const ImageSource* image, const ImageInfo* image_info,
+                         uint32_t chip_size, const FlashDesc* chip,
+                         const ProgramOptions* options)
+{
+    // The image is streamed twice: once to summarize its pages, then again
+    // into the page loop, decoding GFF images as the pages are programmed.
+    ImageSource src;
+    ImageInfo info = *image_info;
+    if (info.pages > chip_size / 256)
+        info.pages = chip_size / 256;
+    if (!OpenImageView(image, &src))
+    {
+        return false;
+    }
+    uint32_t prog_size = info.pages * 256;
+
+    // In differential mode only the blocks whose on-chip CRC differs from
+    // the image are erased and reprogrammed, the rest is left untouched.
+    uint32_t block_size = chip->block_size_kb * 1024;
+    uint32_t num_blocks = (prog_size + block_size - 1) / block_size;
+    uint32_t num_changed = num_blocks;
+    bool* changed = NULL;
+    if (options->differential)
+    {
+        changed = FindChangedBlocks(&info, block_size, num_blocks, &num_changed);
+    }
+
+    // A journal of the same image on the same chip and adapter tells which
+    // blocks an interrupted run completed; those are neither erased nor
+    // programmed again.
+    Journal journal;
+    bool journaling = false;
+    bool resume = false;
+    if (options->journal)
+    {
+        Session* session = CurrentSession();
+        JournalKey key = {session ? session->name : "", chip->jedec_id,
+                          info.hash, prog_size, block_size};
+        journaling = OpenJournal(&journal, options->journal, &key);
+        if (journaling && journal.entries > 0)
+        {
+            uint32_t skipped = ResumeFromJournal(&journal, &info, block_size,
+                                                 &changed, &num_changed);
+            fprintf(stderr, "Journal: %u of %u blocks already programmed\n", skipped, num_blocks);
+            resume = skipped > 0;
+        }
+    }
+    if (num_changed == 0)
+    {
+        fprintf(stderr, "Flash is up to date\n");
+        if (journaling)
+            CloseJournal(&journal, true);
+        CloseImage(&src);
+        delete [] changed;
+        return true;
+    }
 
 	/*
 	WriteReg(0xF4, 0x9F);
@@ -411,91 +1347,176 @@ bool ProgramFlash(const char *input_file_name, uint32_t chip_size)
 		
 	fprintf(stderr, "Erasing...");
     fflush(stdout);
-    SPICommonCommand(E_CC_WRITE_AFTER_EWSR, 1, 0, 1, 0); // Unprotect the Status Register
-    SPICommonCommand(E_CC_WRITE_AFTER_WREN, 1, 0, 1, 0); // Unprotect the flash
-    SPICommonCommand(E_CC_ERASE, 0xc7, 0, 0, 0);         // Chip Erase
-    fprintf(stderr, "done\n");
+    bool ok = SPICommonCommand(E_CC_WRITE_AFTER_EWSR, 1, 0, 1, 0) && // Unprotect the Status Register
+              SPICommonCommand(E_CC_WRITE_AFTER_WREN, 1, 0, 1, 0);   // Unprotect the flash
+    // Only erase the part of the chip the image actually uses.
+    ErasePlan plan;
+    if (ok && InitErasePlan(&plan, chip, chip_size))
+    {
+        MarkEraseUnits(&plan, &info, changed, block_size, resume);
+        ok = ExecuteErasePlan(&plan);
+        delete [] plan.units;
+    }
+    else if (ok)
+    {
+        ok = SPICommonCommand(E_CC_ERASE, 0xc7, 0, 0, 0);    // Chip Erase
+    }
+    fprintf(stderr, ok ? "done\n" : "failed\n");
+    if (!ok)
+    {
+        // Nothing is programmed on top of blocks that may not be erased.
+        if (journaling)
+            CloseJournal(&journal, false);
+        CloseImage(&src);
+        delete [] changed;
+        return false;
+    }
 
     //RTD266x can program only 256 bytes at a time.
     uint8_t buffer[256];
-    uint8_t b;
     uint32_t addr = 0;
-    uint8_t* data_ptr = prog;
-    uint32_t data_len = prog_size;
+    uint32_t pages = 0;
+    uint32_t status_reads = GetPollStats(E_POLL_PAGE_PROGRAM).polls;
+    bool* programmed = new bool[info.pages];
     InitCRC();
     do
     {
-        // Wait for programming cycle to finish
-        do
+        PrintProgress("Writing addr %x", addr);
+        // Raw images are programmed straight from the mapped file, the
+        // buffer only holds decoded or partial pages padded with 0xff.
+        const uint8_t* page = NextImagePage(&src, buffer);
+
+        // Blank pages are left as erased and cost no I2C traffic at all,
+        // neither do the pages of unchanged blocks in differential mode.
+        bool in_changed_block = changed == NULL || changed[addr / block_size];
+        programmed[addr / 256] = in_changed_block && info.page_used[addr / 256];
+        if (programmed[addr / 256])
         {
-            b = ReadReg(0x6f);
+            if (!ProgramPage(addr, page))
+            {
+                ok = false;
+                break;
+            }
+            pages++;
         }
-        while (b & 0x40);
+        ProcessCRC(page, 256);
+        addr += 256;
 
-        fprintf(stderr, "Writing addr %x\r", addr);
-        // Fill with 0xff in case we read a partial buffer.
-        memset(buffer, 0xff, sizeof(buffer));
-        uint32_t len = sizeof(buffer);
-        if (len > data_len)
+        // Journal each block once the chip's CRC confirms it.
+        if (journaling && in_changed_block && (addr % block_size == 0 || addr == prog_size))
         {
-            len = data_len;
+            uint32_t start = (addr - 1) / block_size * block_size;
+            uint8_t host_crc = PagesCRC(info.page_crc, start / 256, addr / 256);
+            if (ChipCRCMatches(start, addr - 1, host_crc))
+                JournalBlock(&journal, start / block_size, host_crc, host_crc);
         }
-        memcpy(buffer, data_ptr, len);
-        data_ptr += len;
-        data_len -= len;
-
-        if (ShouldProgramPage(buffer, sizeof(buffer)))
+    }
+    while (addr < prog_size);
+    delete [] changed;
+    status_reads = GetPollStats(E_POLL_PAGE_PROGRAM).polls - status_reads;
+    bool written = ok;
+    if (written)
+        fprintf(stderr, "\nProgrammed %u pages, %u status reads\n", pages, status_reads);
+    else
+        fprintf(stderr, "\nProgramming failed at addr %x\n", addr);
+
+    // Protect the flash again even after a failure.
+    bool protect = SPICommonCommand(E_CC_WRITE_AFTER_EWSR, 1, 0, 1, 0x1c) && // Unprotect the Status Register
+                   SPICommonCommand(E_CC_WRITE_AFTER_WREN, 1, 0, 1, 0x1c);   // Protect the flash
+    ok = ok && protect;
+
+    if (ok)
+    {
+        uint8_t data_crc = GetCRC();
+        uint8_t chip_crc = 0;
+        ok = SPIComputeCRC(0, addr - 1, &chip_crc);
+        fprintf(stderr, "Received data CRC %02x\n", data_crc);
+        if (ok)
+            fprintf(stderr, "Chip CRC %02x\n", chip_crc);
+        ok = ok && data_crc == chip_crc;
+        if (!ok)
         {
-            // Set program size-1
-            WriteReg(0x71, 255);
-
-            // Set the programming address
-            WriteReg(0x64, addr >> 16);
-            WriteReg(0x65, addr >> 8);
-            WriteReg(0x66, addr);
-
-            // Write the content to register 0x70
-            // Out USB gizmo supports max 63 bytes at a time.
-#if 0
-            WriteBytesToAddr(0x70, buffer, 63);
-            WriteBytesToAddr(0x70, buffer + 63, 63);
-            WriteBytesToAddr(0x70, buffer + 126, 63);
-            WriteBytesToAddr(0x70, buffer + 189, 63);
-            WriteBytesToAddr(0x70, buffer + 252, 4);
-#else
-            WriteBytesToAddr(0x70, buffer, 128);
-            WriteBytesToAddr(0x70, buffer+128, 128);
-#endif
-
-            WriteReg(0x6f, 0xa0); // Start Programing
+            ok = RepairFlash(&src, &info, chip, chip_size);
+            fprintf(stderr, "Repair %s\n", ok ? "succeeded" : "failed");
         }
-        ProcessCRC(buffer, sizeof(buffer));
-        addr += 256;
     }
-    while (addr < chip_size && data_len != 0 && addr < prog_size);
-    delete [] prog;
-
-    // Wait for programming cycle to finish
-    do
+    if (options->verify && written && protect)
     {
-        b = ReadReg(0x6f);
+        bool verified = VerifyFlash(&src, &info, programmed, chip, chip_size);
+        fprintf(stderr, "Verify %s\n", verified ? "succeeded" : "failed");
+        if (verified && !ok)
+            ok = ChipCRCMatches(0, prog_size - 1, PagesCRC(info.page_crc, 0, info.pages));
+        ok = ok && verified;
     }
-    while (b & 0x40);
-
-    SPICommonCommand(E_CC_WRITE_AFTER_EWSR, 1, 0, 1, 0x1c); // Unprotect the Status Register
-    SPICommonCommand(E_CC_WRITE_AFTER_WREN, 1, 0, 1, 0x1c); // Protect the flash
-
-    uint8_t data_crc = GetCRC();
-    uint8_t chip_crc = SPIComputeCRC(0, addr - 1);
-    fprintf(stderr, "Received data CRC %02x\n", data_crc);
-    fprintf(stderr, "Chip CRC %02x\n", chip_crc);
-	if (data_crc == chip_crc) {
+    delete [] programmed;
+    if (journaling)
+        CloseJournal(&journal, ok);
+    CloseImage(&src);
+	if (ok) {
 		fprintf(stderr, "Reset\n");
 		WriteReg(0xEE, 0x04);
 		WriteReg(0xEE, 0x06);
 	}
 
-    return data_crc == chip_crc;
+    return ok;
+}
+
+bool ProgramFlash(const char *input_file_name, uint32_t chip_size,
+                  const FlashDesc* chip, const ProgramOptions* options)
+{
+    ImageSource image;
+    ImageInfo info;
+    if (!LoadImage(input_file_name, chip_size, false, &image, &info))
+    {
+        return false;
+    }
+    bool ok = ProgramImage(&image, &info, chip_size, chip, options);
+    FreeImage(&image, &info);
+    return ok;
+}
+
+// Compare the chip with an image byte for byte, without programming it.
+static bool CompareImage(const ImageSource* image, const ImageInfo* image_info,
+                         uint32_t chip_size)
+{
+    ImageSource src;
+    ImageInfo info = *image_info;
+    if (info.pages > chip_size / 256)
+        info.pages = chip_size / 256;
+    if (!OpenImageView(image, &src))
+    {
+        return false;
+    }
+    bool* check = new bool[info.pages];
+    bool* bad = new bool[info.pages];
+    PageRange* ranges = new PageRange[(info.pages + 1) / 2];
+    for (uint32_t page = 0; page < info.pages; page++)
+        check[page] = true;
+    uint32_t num_bad = VerifyPages(&src, &info, check, bad);
+    uint32_t count = CoalescePages(bad, info.pages, 1, ranges);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        fprintf(stderr, "Mismatch at %x-%x\n", ranges[i].first * 256,
+                ranges[i].end * 256 - 1);
+    }
+    delete [] ranges;
+    delete [] bad;
+    delete [] check;
+    CloseImage(&src);
+    return num_bad == 0;
+}
+
+static bool CompareFlash(const char *input_file_name, uint32_t chip_size)
+{
+    ImageSource image;
+    ImageInfo info;
+    if (!LoadImage(input_file_name, chip_size, false, &image, &info))
+    {
+        return false;
+    }
+    bool ok = CompareImage(&image, &info, chip_size);
+    FreeImage(&image, &info);
+    return ok;
 }
 
 
@@ -674,31 +1695,144 @@ int ssd1306()
 	return 0;
 }
 
-int _tmain(int argc, _TCHAR* argv[])
+// Summarize each image file into 'index_file' for identifying firmware.
+static bool BuildIndex(const char* index_file, const char* const* files, int num_files)
 {
-#if 1
-    bool bRet = true;
-    uint8_t b, port = 0x4a;
+    FirmwareIndex index;
+    InitIndex(&index, FINGERPRINT_BLOCK_SIZE);
+    bool ok = true;
+    for (int i = 0; i < num_files; i++)
+    {
+        ImageSource src;
+        ImageInfo info;
+        if (!LoadImage(files[i], 16 * 1024 * 1024, false, &src, &info))
+        {
+            ok = false;
+            continue;
+        }
+        uint32_t pages_per_block = FINGERPRINT_BLOCK_SIZE / 256;
+        uint32_t blocks = info.pages / pages_per_block;
+        uint8_t* block_crc = new uint8_t[blocks + 1];
+        for (uint32_t b = 0; b < blocks; b++)
+            block_crc[b] = PagesCRC(info.page_crc, b * pages_per_block, (b + 1) * pages_per_block);
+        const char* name = strrchr(files[i], '/');
+        if (NULL == name)
+            name = strrchr(files[i], '\\');
+        AddIndexEntry(&index, name ? name + 1 : files[i], info.pages * 256, block_crc);
+        delete [] block_crc;
+        FreeImage(&src, &info);
+    }
+    fprintf(stderr, "%u images indexed in %uKB blocks\n", index.count, index.block_size / 1024);
+    ok = SaveIndex(index_file, &index) && ok;
+    FreeIndex(&index);
+    return ok;
+}
+
+static bool ProbeBlockCRC(uint32_t addr, uint32_t len, uint8_t* crc)
+{
+    return SPIComputeCRC(addr, addr + len - 1, crc);
+}
+
+// Identification stops after this many probes, or earlier once one image
+// leads alone and agrees with at least IDENTIFY_MIN_PROBES of them.
+#define IDENTIFY_MIN_PROBES 8
+#define IDENTIFY_MAX_PROBES 48
+
+// Read-back test of the link at its current clock: patterns written to the
+// flash address registers and read back, then the start of the flash read
+// and checked against the chip's CRC of it.
+#define LINK_TEST_ROUNDS 16
+#define LINK_TEST_READ 4096
+
+static bool TestLink()
+{
+    uint32_t nacks = GetI2CQuality().nacks;
+    for (uint32_t r = 0; r < LINK_TEST_ROUNDS; r++)
+    {
+        uint8_t v = (uint8_t)(r * 0x3b + 0x55);
+        uint8_t pattern[3] = {v, (uint8_t)~v, (uint8_t)(v ^ 0xa5)};
+        BeginI2CBatch();
+        for (int i = 0; i < 3; i++)
+            WriteReg(0x64 + i, pattern[i]);
+        EndI2CBatch();
+        for (int i = 0; i < 3; i++)
+        {
+            if (ReadReg(0x64 + i) != pattern[i])
+                return false;
+        }
+    }
+    uint8_t data[LINK_TEST_READ];
+    if (!SPIRead(0, data, sizeof(data)))
+        return false;
+    InitCRC();
+    ProcessCRC(data, sizeof(data));
+    return ChipCRCMatches(0, sizeof(data) - 1, GetCRC()) &&
+           GetI2CQuality().nacks == nacks;
+}
+
+// Unless 'probe' is false, select the fastest SCL clock passing TestLink()
+// twice in a row. The link then adapts to its errors from there on.
+static void TuneLink(bool probe)
+{
+    uint32_t khz = GetI2CQuality().khz;
+    if (khz == 0)
+    {
+        fprintf(stderr, "I2C clock is fixed, not tuned\n");
+        return;
+    }
+    for (int i = 0; probe && i < I2C_NUM_SPEEDS; i++)
+    {
+        if (!SetI2CSpeed(I2CSpeeds[i]))
+            continue;
+        khz = I2CSpeeds[i];
+        if (TestLink() && TestLink())
+            break;
+        fprintf(stderr, "I2C clock %ukHz failed the read-back test\n", khz);
+    }
+    fprintf(stderr, "I2C clock %ukHz\n", khz);
+    StartI2CFeedback(khz);
+}
+
+// What every session does with its device. Shared read-only by them.
+struct DeviceJob
+{
+    const char*        command;     // "-r", "-w", "-d", "-c" or "-i"
+    const char*        file;
+    int                size;        // bytes, 0 for the size of the chip
+    uint8_t            port;
+    uint32_t           clock;       // SCL clock in kHz, 0 to keep the adapter's
+    bool               tune;        // probe the clock and adapt it to errors
+    bool               per_device;  // dump each device to file.N
+    bool               sparse;      // skip reading blank windows
+    bool               verify;      // read back the programmed pages
+    const char*        journal;     // progress journal, journal.N per device
+    const FirmwareIndex* index;     // for "-i"
+    const ImageSource* image;       // image loaded for all sessions, or NULL
+    const ImageInfo*   info;
+};
+
+// Enter ISP mode, identify the flash behind the session's adapter and set
+// up its commands and the link. The device stays prepared for any number
+// of RunDeviceCommand() calls.
+static bool OpenDevice(Session* session, const DeviceJob* job)
+{
+    uint8_t b;
     uint32_t jedec_id;
 
-    InitI2C();
     fprintf(stderr, "Ready\n");
-    if (5 <= argc) {
-        port = strtol(argv[4], NULL, 0);
-    }
-    SetI2CAddr(port);
+    SetI2CAddr(job->port);
 
     const FlashDesc* chip;
     if (!WriteReg(0x6f, 0x80))    // Enter ISP mode
     {
         fprintf(stderr, "Write to 6F failed.\n");
-        goto L_RET;
+        return false;
     }
     b = ReadReg(0x6f);
     if (!(b & 0x80))
     {
         fprintf(stderr, "Can't enable ISP mode\n");
-        goto L_RET;
+        return false;
     }
 	/*
     uint8_t chip_crc = SPIComputeCRC(0, 0xFFFF);
@@ -706,14 +1840,24 @@ int _tmain(int argc, _TCHAR* argv[])
     goto L_RET;
 	*/
 
-    jedec_id = SPICommonCommand(E_CC_READ, 0x9f, 3, 0, 0);
+    if (!SPICommonCommand(E_CC_READ, 0x9f, 3, 0, 0, &jedec_id))
+    {
+        fprintf(stderr, "Can't read the JEDEC ID\n");
+        return false;
+    }
     fprintf(stderr, "JEDEC ID: 0x%02x\n", jedec_id);
     chip = FindChip(jedec_id);
     if (NULL == chip)
+    {
+        fprintf(stderr, "Unknown chip ID, reading its SFDP\n");
+        chip = DiscoverChip(jedec_id, ReadSFDP);
+    }
+    if (NULL == chip)
     {
         fprintf(stderr, "Unknown chip ID\n");
-        goto L_RET;
+        return false;
     }
+    session->chip = chip;
     fprintf(stderr, "Manufacturer ");
     PrintManufacturer(GetManufacturerId(chip->jedec_id));
     fprintf(stderr, "\n");
@@ -721,31 +1865,89 @@ int _tmain(int argc, _TCHAR* argv[])
     fprintf(stderr, "Size: %dKB\n", chip->size_kb);
 
     // Setup flash command codes
-    SetupChipCommands(chip->jedec_id);
+    SetupChipCommands(chip);
+
+    // Start the status polls from the chip's own timings.
+    if (chip->program_us)
+        SetPollTiming(E_POLL_PAGE_PROGRAM, chip->program_us);
+    for (int i = 0; i < 3; i++)
+    {
+        if (chip->erase_ms[i] && chip->erase_kb[i])
+            SetPollTiming(ErasePollOp(EraseOpcodes[i]), chip->erase_ms[i] * 1000);
+    }
+
+    if (job->clock != 0 && !SetI2CSpeed(job->clock))
+        fprintf(stderr, "Can't set the I2C clock to %ukHz\n", job->clock);
+    if (job->tune)
+        TuneLink(job->clock == 0);
 
     //SPICommonCommand(E_CC_WRITE, 1, 0, 1, 0); // Unprotect the Status Register
 
 //  SPICommonCommand(E_CC_ERASE, 0x60, 0, 0, 0);         // Chip Erase
-    b = SPICommonCommand(E_CC_READ, 0x5, 1, 0, 0);
-    fprintf(stderr, "Flash status register(S7-S0): 0x%02x\n", b);
-    b = SPICommonCommand(E_CC_READ, 0x35, 1, 0, 0);
-    fprintf(stderr, "Flash status register(S15-S8): 0x%02x\n", b);
+    uint32_t status;
+    if (SPICommonCommand(E_CC_READ, 0x5, 1, 0, 0, &status))
+        fprintf(stderr, "Flash status register(S7-S0): 0x%02x\n", status);
+    if (SPICommonCommand(E_CC_READ, 0x35, 1, 0, 0, &status))
+        fprintf(stderr, "Flash status register(S15-S8): 0x%02x\n", status);
+    return true;
+}
+
+// Run the job's command on the device prepared by OpenDevice().
+static bool RunDeviceCommand(Session* session, const DeviceJob* job)
+{
+    const FlashDesc* chip = session->chip;
+    bool bRet = true;
 
 	int size = chip->size_kb * 1024;
-	if (4 <= argc) {
-		size = atoi(argv[3])*1024;
+	if (job->size > 0) {
+		size = job->size;
+	}
+	bool differential = strcmp(job->command, "-d")==0;
+	if (strcmp(job->command, "-i")==0) {
+		IdentifyResult result;
+		IdentifyFirmware(job->index, size, ProbeBlockCRC,
+		                 IDENTIFY_MIN_PROBES, IDENTIFY_MAX_PROBES, &result);
+		bRet = result.best != NULL && result.matches > 0 &&
+		       result.matches == result.covered && result.ties == 0;
+		if (result.best == NULL)
+			fprintf(stderr, "Index is empty\n");
+		else
+			fprintf(stderr, "%s: %s, %u of %u probed block CRCs match (%u blocks)%s\n",
+			        bRet ? "Identified" : "Closest match", result.best->name,
+			        result.matches, result.covered, result.best->blocks,
+			        result.ties ? ", ambiguous" : "");
+		return bRet;
 	}
-	if (3 <= argc &&strcmp(argv[1], "-r")==0) {
-		fprintf(stderr, "SaveFlash %s size=%d(kbyte)\n", argv[2], size/1024);
-	    bRet = SaveFlash(argv[2], size);
+	if (strcmp(job->command, "-c")==0) {
+		fprintf(stderr, "CompareFlash %s size=%d(kbyte)\n", job->file, size/1024);
+		if (job->image)
+		    bRet = CompareImage(job->image, job->info, size);
+		else
+		    bRet = CompareFlash(job->file, size);
 	}
-	else if (3 <= argc &&strcmp(argv[1], "-w")==0) {
-		fprintf(stderr, "ProgramFlash %s size=%d(kbyte)\n\n", argv[2], size/1024);
-	    bRet = ProgramFlash(argv[2], size);
+	else if (strcmp(job->command, "-r")==0) {
+		char file[1024];
+		const char* name = job->file;
+		if (job->per_device && strlen(name) + 12 < sizeof(file)) {
+			sprintf(file, "%s.%d", name, session->index);
+			name = file;
+		}
+		fprintf(stderr, "SaveFlash %s size=%d(kbyte)\n", name, size/1024);
+	    bRet = SaveFlash(name, size, job->sparse);
 	}
 	else {
-		fprintf(stderr, "%s (-r/-w) filepath (size kbyte) (i2c port)\n", argv[0]);
-		goto L_RET;
+		fprintf(stderr, "ProgramFlash %s%s size=%d(kbyte)\n\n",
+		        differential ? "(differential) " : "", job->file, size/1024);
+		char journal[1024];
+		ProgramOptions options = {differential, job->verify, job->journal};
+		if (job->journal && job->per_device && strlen(job->journal) + 12 < sizeof(journal)) {
+			sprintf(journal, "%s.%d", job->journal, session->index);
+			options.journal = journal;
+		}
+		if (job->image)
+		    bRet = ProgramImage(job->image, job->info, size, chip, &options);
+		else
+		    bRet = ProgramFlash(job->file, size, chip, &options);
 	}
 	if (bRet) {
 		fprintf(stderr, "Success!\n");
@@ -753,10 +1955,331 @@ int _tmain(int argc, _TCHAR* argv[])
 	else {
 		fprintf(stderr, "Fail CRC unmatched!\n");
 	}
+	{
+		I2CStats stats = GetI2CStats();
+		fprintf(stderr, "I2C: %u transfers, %u bytes written, %u bytes read\n",
+		        stats.transfers, stats.bytes_written, stats.bytes_read);
+		I2CQuality quality = GetI2CQuality();
+		if (quality.adaptive || quality.nacks > 0 || quality.crc_errors > 0)
+			PrintI2CQuality();
+		PrintPollStats();
+	}
+    return bRet;
+}
+
+// Identify the flash behind the session's adapter and run the job on it.
+static bool RunDevice(Session* session, void* arg)
+{
+    const DeviceJob* job = (const DeviceJob*)arg;
+    return OpenDevice(session, job) && RunDeviceCommand(session, job);
+}
+
+static bool DaemonOpenDevice(Session* session, void* arg)
+{
+    return OpenDevice(session, (const DeviceJob*)arg);
+}
+
+// Run a daemon request with the options the daemon was started with.
+static bool DaemonRunJob(Session* session, const DaemonRequest* request, void* arg)
+{
+    DeviceJob job = *(const DeviceJob*)arg;
+    job.file = request->file;
+    job.size = request->size_kb * 1024;
+    job.sparse = job.sparse || request->sparse;
+    job.verify = job.verify || request->verify;
+    if (strcmp(request->command, "dump") == 0)
+        job.command = "-r";
+    else if (strcmp(request->command, "program") == 0)
+        job.command = request->differential ? "-d" : "-w";
+    else if (strcmp(request->command, "verify") == 0)
+        job.command = "-c";
+    else
+        job.command = "-i";
+
+    FirmwareIndex index;
+    memset(&index, 0, sizeof(index));
+    if (strcmp(job.command, "-i") == 0) {
+        if (!LoadIndex(job.file, &index))
+            return false;
+        job.index = &index;
+    }
+    bool ok = RunDeviceCommand(session, &job);
+    FreeIndex(&index);
+    return ok;
+}
+
+static bool BenchLoadImageHook(const char* file_name, uint32_t max_size)
+{
+    ImageSource image;
+    ImageInfo info;
+    if (!LoadImage(file_name, max_size, false, &image, &info))
+        return false;
+    FreeImage(&image, &info);
+    return true;
+}
+
+static bool BenchRunDevice(Session* session, const char* command, const char* file, uint32_t size)
+{
+    DeviceJob job;
+    memset(&job, 0, sizeof(job));
+    job.command = command;
+    job.file = file;
+    job.size = size;
+    job.port = 0x4a;
+    return RunDevice(session, &job);
+}
+
+#define MAX_DEVICES 64
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+#if 1
+    // Adapters to drive, one session each, selected by the options in
+    // front of the command. Without any the first CH341 is used.
+    I2CTransport* transports[MAX_DEVICES];
+    char names[MAX_DEVICES][64];
+    static char sim_images[MAX_DEVICES][1024];
+    int num_devices = 0;
+    int parallel = MAX_DEVICES;
+    int num_sims = 0;
+    const char* trace_file = NULL;
+    bool sparse = false;
+    bool verify = false;
+    uint32_t clock = 0;
+    bool tune = false;
+    const char* journal = NULL;
+    const char* chips_file = NULL;
+    SimConfig sim_config;
+    GetSimConfig(&sim_config);
+
+    while (2 <= argc && argv[1][0] == '-' && num_devices < MAX_DEVICES) {
+        int used = 1;
+        if (strcmp(argv[1], "-sim") == 0) {
+            // Simulated scalers instead of CH341s, "-sim 8" for eight.
+            int count = 1;
+            if (3 <= argc && isdigit((unsigned char)argv[2][0])) {
+                count = atoi(argv[2]);
+                used = 2;
+            }
+            for (int i = 0; i < count && num_devices < MAX_DEVICES; i++) {
+                SimConfig config = sim_config;
+                if (config.image_file && num_sims > 0 && strlen(config.image_file) + 12 < sizeof(sim_images[0])) {
+                    // Each simulated device keeps its own flash image.
+                    sprintf(sim_images[num_devices], "%s.%d", config.image_file, num_sims);
+                    config.image_file = sim_images[num_devices];
+                }
+                sprintf(names[num_devices], "sim %d", num_sims++);
+                transports[num_devices++] = CreateSimTransport(config);
+            }
+        }
+        else if (3 <= argc && strcmp(argv[1], "-ch341") == 0) {
+            sprintf(names[num_devices], "CH341 %d", atoi(argv[2]));
+            transports[num_devices++] = CreateCH341Transport(atoi(argv[2]));
+            used = 2;
+        }
+#ifdef __linux__
+        else if (3 <= argc && strcmp(argv[1], "-dev") == 0) {
+            // Kernel I2C adapter, e.g. the DDC bus of the graphics card.
+            strncpy(names[num_devices], argv[2], sizeof(names[0]) - 1);
+            names[num_devices][sizeof(names[0]) - 1] = 0;
+            transports[num_devices++] = CreateI2CDevTransport(argv[2]);
+            used = 2;
+        }
+#endif
+        else if (3 <= argc && strcmp(argv[1], "-jobs") == 0) {
+            parallel = atoi(argv[2]);
+            used = 2;
+        }
+        else if (strcmp(argv[1], "-sparse") == 0) {
+            // Dumps leave out the windows the chip's CRC reports blank.
+            sparse = true;
+        }
+        else if (strcmp(argv[1], "-verify") == 0) {
+            // Programming reads back and compares every page it wrote.
+            verify = true;
+        }
+        else if (3 <= argc && strcmp(argv[1], "-clock") == 0) {
+            // SCL clock in kHz: 20, 100, 400 or 750.
+            clock = atoi(argv[2]);
+            used = 2;
+        }
+        else if (3 <= argc && strcmp(argv[1], "-chips") == 0) {
+            // Chips added to or replacing the built-in ones.
+            chips_file = argv[2];
+            used = 2;
+        }
+        else if (strcmp(argv[1], "-tune") == 0) {
+            // Probe the fastest clean clock and adapt it to the link errors.
+            tune = true;
+        }
+        else if (3 <= argc && strcmp(argv[1], "-journal") == 0) {
+            // Programming records its progress there and resumes from it.
+            journal = argv[2];
+            used = 2;
+        }
+        else if (3 <= argc && strcmp(argv[1], "-trace") == 0) {
+            // Timeline of the transfers and operations, as Chrome trace JSON.
+            trace_file = argv[2];
+            used = 2;
+        }
+        else {
+            break;
+        }
+        for (int i = 1; i + used < argc; i++)
+            argv[i] = argv[i + used];
+        argc -= used;
+    }
+    if (num_devices == 0) {
+        strcpy(names[0], "CH341 0");
+        transports[num_devices++] = CreateCH341Transport(0);
+    }
+    if (!InitChipDatabase(chips_file)) {
+        for (int i = 0; i < num_devices; i++)
+            delete transports[i];
+        return 1;
+    }
+
+    if (2 <= argc && strcmp(argv[1], "-bench") == 0) {
+        for (int i = 0; i < num_devices; i++)
+            delete transports[i];
+        const char* json_file = NULL;
+        if (4 <= argc && strcmp(argv[2], "-json") == 0) {
+            json_file = argv[3];
+            argv += 2;
+            argc -= 2;
+        }
+        InitCRC();
+        InitGff();
+        BenchHooks hooks = {ShouldProgramPage, BenchLoadImageHook, BenchRunDevice};
+        return RunBenchmarks(argv + 2, argc - 2, &hooks, json_file);
+    }
+#ifdef __linux__
+    if (3 <= argc && strcmp(argv[1], "-daemon") == 0) {
+        // The devices stay open, jobs come in over the socket.
+        DeviceJob job;
+        memset(&job, 0, sizeof(job));
+        job.port = 0x4a;
+        job.clock = clock;
+        job.tune = tune;
+        job.sparse = sparse;
+        job.verify = verify;
+        InitCRC();
+        InitGff();
+        Session* sessions = new Session[num_devices];
+        for (int i = 0; i < num_devices; i++)
+            InitSession(&sessions[i], i, names[i], transports[i]);
+        if (trace_file)
+            StartTrace();
+        DaemonHooks hooks = {DaemonOpenDevice, DaemonRunJob, &job};
+        int failed = RunDaemon(argv[2], sessions, num_devices, &hooks);
+        if (trace_file)
+            StopTrace(trace_file);
+        PrintSessionReport(sessions, num_devices);
+        delete [] sessions;
+        return failed == 0 ? 0 : 1;
+    }
+#endif
+    if (4 <= argc && strcmp(argv[1], "-e") == 0) {
+        return EncodeFile(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (4 <= argc && strcmp(argv[1], "-index") == 0) {
+        for (int i = 0; i < num_devices; i++)
+            delete transports[i];
+        return BuildIndex(argv[2], argv + 3, argc - 3) ? 0 : 1;
+    }
+    if (argc < 3 || (strcmp(argv[1], "-r") != 0 && strcmp(argv[1], "-w") != 0 &&
+                     strcmp(argv[1], "-d") != 0 && strcmp(argv[1], "-c") != 0 &&
+                     strcmp(argv[1], "-i") != 0)) {
+		fprintf(stderr, "%s [adapters] (-r/-w/-d/-c) filepath (size kbyte) (i2c port)\n", argv[0]);
+		fprintf(stderr, "%s [adapters] -i index (size kbyte) (i2c port)\n", argv[0]);
+#ifdef __linux__
+		fprintf(stderr, "%s [adapters] -daemon socket\n", argv[0]);
+#endif
+		fprintf(stderr, "%s -e filepath output.gff\n", argv[0]);
+		fprintf(stderr, "%s -index index firmware files\n", argv[0]);
+		fprintf(stderr, "%s -bench [-json results.json] (firmware files)\n", argv[0]);
+		fprintf(stderr, "adapters: -ch341 index | -sim (count)");
+#ifdef __linux__
+		fprintf(stderr, " | -dev /dev/i2c-N");
+#endif
+		fprintf(stderr, ", repeatable, -jobs n to limit how many run at once\n");
+		fprintf(stderr, "-trace file.json records a timeline and latency histograms\n");
+		fprintf(stderr, "-sparse skips reading blank windows when dumping\n");
+		fprintf(stderr, "-verify reads back and compares the programmed pages\n");
+		fprintf(stderr, "-c compares the chip with the file without programming it\n");
+		fprintf(stderr, "-journal file resumes an interrupted programming run\n");
+		fprintf(stderr, "-chips file adds flash chips, unknown ones are described by their SFDP\n");
+		fprintf(stderr, "-clock kHz sets the I2C clock, -tune probes the fastest clean one\n");
+		fprintf(stderr, "and steps it down and back up with the link errors\n");
+        for (int i = 0; i < num_devices; i++)
+            delete transports[i];
+        return 1;
+    }
+
+    DeviceJob job;
+    memset(&job, 0, sizeof(job));
+    job.command = argv[1];
+    job.file = argv[2];
+    job.port = 0x4a;
+    job.per_device = num_devices > 1;
+    job.clock = clock;
+    job.tune = tune;
+    job.sparse = sparse;
+    job.verify = verify;
+    job.journal = journal;
+	if (4 <= argc) {
+		job.size = atoi(argv[3])*1024;
+	}
+    if (5 <= argc) {
+        job.port = strtol(argv[4], NULL, 0);
+    }
+    InitCRC();  // sets up the CRC and GFF tables before the sessions share them
+    InitGff();
+
+    FirmwareIndex index;
+    memset(&index, 0, sizeof(index));
+    if (strcmp(job.command, "-i") == 0) {
+        if (!LoadIndex(job.file, &index)) {
+            for (int i = 0; i < num_devices; i++)
+                delete transports[i];
+            return 1;
+        }
+        job.index = &index;
+    }
 
-L_RET:
-    CloseI2C();
-    return 0;
+    // Several sessions program from one decoded image and page summary.
+    ImageSource image;
+    ImageInfo info;
+    bool loaded = false;
+    if (num_devices > 1 && strcmp(job.command, "-r") != 0 && strcmp(job.command, "-i") != 0) {
+        uint32_t max_size = job.size > 0 ? job.size : 8 * 1024 * 1024;
+        loaded = LoadImage(job.file, max_size, true, &image, &info);
+        if (!loaded) {
+            for (int i = 0; i < num_devices; i++)
+                delete transports[i];
+            return 1;
+        }
+        job.image = &image;
+        job.info = &info;
+    }
+
+    Session* sessions = new Session[num_devices];
+    for (int i = 0; i < num_devices; i++)
+        InitSession(&sessions[i], i, names[i], transports[i]);
+    if (trace_file)
+        StartTrace();
+    int failed = RunSessions(sessions, num_devices, parallel, RunDevice, &job);
+    if (trace_file)
+        StopTrace(trace_file);
+    if (num_devices > 1) {
+        PrintSessionReport(sessions, num_devices);
+        fprintf(stderr, "%d of %d devices failed\n", failed, num_devices);
+    }
+    delete [] sessions;
+    if (loaded)
+        FreeImage(&image, &info);
+    FreeIndex(&index);
+    return failed == 0 ? 0 : 1;
 #else
 	ssd1306();
 #endif
@@ -0,0 +1,209 @@
+// mapfile.cpp : Memory mapped input and output files.
+//
+#include "stdafx.h"
+#include "mapfile.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Largest image read from a pipe.
+#define MAX_STREAM_SIZE (64 * 1024 * 1024)
+
+static void ResetMappedFile(MappedFile* mf)
+{
+    memset(mf, 0, sizeof(*mf));
+    mf->fd = -1;
+}
+
+static bool ReadStream(FILE* stream, MappedFile* mf)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stream), _O_BINARY);
+#endif
+    uint32_t capacity = 1024 * 1024;
+    mf->data = new uint8_t[capacity];
+    mf->stream = stream;
+    for (;;)
+    {
+        if (mf->size == capacity)
+        {
+            if (capacity >= MAX_STREAM_SIZE)
+            {
+                fprintf(stderr, "Input stream is too large\n");
+                return false;
+            }
+            uint8_t* grown = new uint8_t[capacity * 2];
+            memcpy(grown, mf->data, mf->size);
+            delete [] mf->data;
+            mf->data = grown;
+            capacity *= 2;
+        }
+        size_t n = fread(mf->data + mf->size, 1, capacity - mf->size, stream);
+        if (n == 0)
+            break;
+        mf->size += (uint32_t)n;
+    }
+    return ferror(stream) == 0;
+}
+
+bool MapInputFile(const char* file_name, MappedFile* mf)
+{
+    ResetMappedFile(mf);
+    if (strcmp(file_name, "-") == 0)
+        return ReadStream(stdin, mf);
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    mf->file_handle = file;
+    LARGE_INTEGER size;
+    if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size))
+    {
+        // Named pipes and the like: read through the C runtime.
+        CloseHandle(file);
+        mf->file_handle = NULL;
+        FILE* stream;
+        fopen_s(&stream, file_name, "rb");
+        if (NULL == stream)
+            return false;
+        bool ok = ReadStream(stream, mf);
+        fclose(stream);
+        mf->stream = NULL;
+        return ok;
+    }
+    if (size.QuadPart >= 0x100000000LL)
+    {
+        UnmapFile(mf);
+        return false;
+    }
+    mf->size = (uint32_t)size.QuadPart;
+    if (mf->size == 0)
+        return true;    // empty files can't be mapped
+    mf->map_handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (NULL == mf->map_handle)
+    {
+        UnmapFile(mf);
+        return false;
+    }
+    mf->data = (uint8_t*)MapViewOfFile(mf->map_handle, FILE_MAP_READ, 0, 0, 0);
+#else
+    mf->fd = open(file_name, O_RDONLY);
+    if (mf->fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(mf->fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        FILE* stream = fdopen(mf->fd, "rb");
+        mf->fd = -1;
+        if (NULL == stream)
+            return false;
+        bool ok = ReadStream(stream, mf);
+        fclose(stream);
+        mf->stream = NULL;
+        return ok;
+    }
+    if ((uint64_t)st.st_size >= 0x100000000ULL)
+    {
+        UnmapFile(mf);
+        return false;
+    }
+    mf->size = (uint32_t)st.st_size;
+    if (mf->size == 0)
+        return true;    // empty files can't be mapped
+    void* view = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE, mf->fd, 0);
+    mf->data = (view == MAP_FAILED) ? NULL : (uint8_t*)view;
+#endif
+    mf->mapped = NULL != mf->data;
+    if (!mf->mapped)
+        UnmapFile(mf);
+    return mf->mapped;
+}
+
+bool MapOutputFile(const char* file_name, uint32_t size, MappedFile* mf)
+{
+    ResetMappedFile(mf);
+    mf->writable = true;
+    mf->size = size;
+    if (strcmp(file_name, "-") == 0 || size == 0)
+    {
+        FILE* stream = stdout;
+        if (strcmp(file_name, "-") != 0)
+            fopen_s(&stream, file_name, "wb");
+        if (NULL == stream)
+            return false;
+#ifdef _WIN32
+        _setmode(_fileno(stream), _O_BINARY);
+#endif
+        mf->stream = stream;
+        mf->data = new uint8_t[size ? size : 1];
+        return true;
+    }
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    mf->file_handle = file;
+    // Creating the mapping extends the file to its full size.
+    mf->map_handle = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, size, NULL);
+    if (NULL != mf->map_handle)
+        mf->data = (uint8_t*)MapViewOfFile(mf->map_handle, FILE_MAP_WRITE, 0, 0, 0);
+#else
+    mf->fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (mf->fd < 0)
+        return false;
+    // Allocate the blocks up front: on a full disk a sparse file would only
+    // fail once written through the map, with SIGBUS instead of an error.
+    if (posix_fallocate(mf->fd, 0, size) == 0)
+    {
+        void* view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mf->fd, 0);
+        mf->data = (view == MAP_FAILED) ? NULL : (uint8_t*)view;
+    }
+#endif
+    mf->mapped = NULL != mf->data;
+    if (!mf->mapped)
+        UnmapFile(mf);
+    return mf->mapped;
+}
+
+bool UnmapFile(MappedFile* mf)
+{
+    bool ok = true;
+    if (mf->mapped)
+    {
+#ifdef _WIN32
+        ok = FlushViewOfFile(mf->data, 0) != FALSE || !mf->writable;
+        UnmapViewOfFile(mf->data);
+#else
+        ok = msync(mf->data, mf->size, MS_SYNC) == 0 || !mf->writable;
+        munmap(mf->data, mf->size);
+#endif
+    }
+    else if (NULL != mf->data)
+    {
+        if (mf->writable && NULL != mf->stream)
+        {
+            ok = fwrite(mf->data, 1, mf->size, mf->stream) == mf->size;
+            ok = fflush(mf->stream) == 0 && ok;
+            if (mf->stream != stdout)
+                fclose(mf->stream);
+        }
+        delete [] mf->data;
+    }
+#ifdef _WIN32
+    if (NULL != mf->map_handle)
+        CloseHandle(mf->map_handle);
+    if (NULL != mf->file_handle)
+        CloseHandle(mf->file_handle);
+#else
+    if (mf->fd >= 0)
+        close(mf->fd);
+#endif
+    ResetMappedFile(mf);
+    return ok;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+// A whole file accessed as memory. Regular files are memory mapped; pipes
+// and the name "-" (stdin/stdout) fall back to a heap buffer. Pipes are
+// buffered in full, not streamed: an input pipe is read to its end before
+// MapInputFile() returns (64MB at most), and nothing is written to an output
+// pipe until UnmapFile(). Programming needs the whole image up front, and
+// a dump may still be repaired after its last read.
+struct MappedFile
+{
+    uint8_t* data;
+    uint32_t size;
+    bool     mapped;        // data is a view of the file
+    bool     writable;
+    FILE*    stream;        // pipe behind the heap buffer
+    void*    file_handle;   // Win32 file and mapping handles
+    void*    map_handle;
+    int      fd;            // POSIX descriptor
+};
+
+// Map 'file_name' for reading. Fails for files of 4GB and more.
+bool MapInputFile(const char* file_name, MappedFile* mf);
+// Create 'file_name' with 'size' bytes and map it for writing.
+bool MapOutputFile(const char* file_name, uint32_t size, MappedFile* mf);
+// Unmap the file, first writing the buffer out for output pipes.
+bool UnmapFile(MappedFile* mf);
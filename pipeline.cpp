@@ -0,0 +1,131 @@
+#include "stdafx.h"
+#include "pipeline.h"
+#include "thread.h"
+
+bool InitRing(SpscRing* ring, uint32_t capacity)
+{
+    // Indices only grow; the power of two size keeps their wrap-around
+    // consistent with the slot mask.
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+        return false;
+    ring->slots = new PipeChunk[capacity];
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+    return true;
+}
+
+void FreeRing(SpscRing* ring)
+{
+    delete [] ring->slots;
+    ring->slots = NULL;
+}
+
+static uint32_t RingDepth(long head, long tail)
+{
+    return (uint32_t)(head - tail);
+}
+
+bool RingPush(SpscRing* ring, const PipeChunk* chunk)
+{
+    long head = ring->head;
+    if (RingDepth(head, AtomicLoadAcquire(&ring->tail)) == ring->capacity)
+        return false;
+    ring->slots[head & (ring->capacity - 1)] = *chunk;
+    AtomicStoreRelease(&ring->head, head + 1);
+    return true;
+}
+
+bool RingPop(SpscRing* ring, PipeChunk* chunk)
+{
+    long tail = ring->tail;
+    if (AtomicLoadAcquire(&ring->head) == tail)
+        return false;
+    *chunk = ring->slots[tail & (ring->capacity - 1)];
+    AtomicStoreRelease(&ring->tail, tail + 1);
+    return true;
+}
+
+// Yields before the first sleep, then the sleep doubles from the minimum
+// up to the maximum, in microseconds. The maximum bounds the latency added
+// to a chunk arriving while a stage sleeps.
+#define RING_SPIN_ROUNDS    64
+#define RING_MIN_SLEEP_US   50
+#define RING_MAX_SLEEP_US   1000
+
+void RingBackoff(uint32_t* round)
+{
+    uint32_t r = (*round)++;
+    if (r < RING_SPIN_ROUNDS)
+    {
+        YieldThread();
+        return;
+    }
+    uint32_t usec = RING_MIN_SLEEP_US;
+    for (r -= RING_SPIN_ROUNDS; r > 0 && usec < RING_MAX_SLEEP_US; r--)
+        usec *= 2;
+    SleepThread(usec < RING_MAX_SLEEP_US ? usec : RING_MAX_SLEEP_US);
+}
+
+static void CountItem(SpscRing* ring, StageStats* stage)
+{
+    uint32_t depth = RingDepth(AtomicLoadAcquire(&ring->head),
+                               AtomicLoadAcquire(&ring->tail));
+    stage->items++;
+    stage->depth_sum += depth;
+    if (depth > stage->depth_max)
+        stage->depth_max = depth;
+}
+
+void RingPushWait(SpscRing* ring, const PipeChunk* chunk, StageStats* stage)
+{
+    if (!RingPush(ring, chunk))
+    {
+        uint64_t start = HostTimeUs();
+        stage->stalls++;
+        uint32_t round = 0;
+        do
+            RingBackoff(&round);
+        while (!RingPush(ring, chunk));
+        stage->stall_us += HostTimeUs() - start;
+    }
+    CountItem(ring, stage);
+}
+
+void RingPopWait(SpscRing* ring, PipeChunk* chunk, StageStats* stage)
+{
+    if (!RingPop(ring, chunk))
+    {
+        uint64_t start = HostTimeUs();
+        stage->stalls++;
+        uint32_t round = 0;
+        do
+            RingBackoff(&round);
+        while (!RingPop(ring, chunk));
+        stage->stall_us += HostTimeUs() - start;
+    }
+    CountItem(ring, stage);
+}
+
+void StartStage(StageStats* stage, const char* name)
+{
+    memset(stage, 0, sizeof(*stage));
+    stage->name = name;
+    stage->start_us = HostTimeUs();
+}
+
+void FinishStage(StageStats* stage)
+{
+    uint64_t total = HostTimeUs() - stage->start_us;
+    stage->busy_us = total > stage->stall_us ? total - stage->stall_us : 0;
+}
+
+void PrintStageStats(const StageStats* stage, const SpscRing* ring)
+{
+    fprintf(stderr, "Stage %-6s %6u items %9.2fms busy %9.2fms stalled (%u)"
+            "  depth %.1f avg %u max of %u\n",
+            stage->name, stage->items, stage->busy_us / 1000.0,
+            stage->stall_us / 1000.0, stage->stalls,
+            stage->items ? (double)stage->depth_sum / stage->items : 0.0,
+            stage->depth_max, ring->capacity);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+// Piece of a transfer handed from one pipeline stage to the next. A chunk
+// of length 0 ends the stream.
+struct PipeChunk
+{
+    uint32_t addr;
+    uint8_t* data;
+    uint32_t len;
+};
+
+// Activity of one pipeline stage. Stall time is spent waiting on the ring,
+// for room when producing or for data when consuming; the rest of the time
+// between StartStage() and FinishStage() counts as busy.
+struct StageStats
+{
+    const char* name;
+    uint32_t    items;
+    uint32_t    stalls;
+    uint64_t    stall_us;
+    uint64_t    busy_us;
+    uint64_t    depth_sum;      // ring depth seen at each item
+    uint32_t    depth_max;
+    uint64_t    start_us;
+};
+
+// Lock-free ring passing chunks from exactly one producer thread to exactly
+// one consumer thread. Each index is written by one side only and published
+// with release semantics, so no lock or interlocked operation is needed.
+struct SpscRing
+{
+    PipeChunk*    slots;
+    uint32_t      capacity;     // power of two
+    volatile long head;         // next slot written, producer-owned
+    volatile long tail;         // next slot read, consumer-owned
+};
+
+bool InitRing(SpscRing* ring, uint32_t capacity);
+void FreeRing(SpscRing* ring);
+
+// Non-blocking; false when the ring is full or empty respectively.
+bool RingPush(SpscRing* ring, const PipeChunk* chunk);
+bool RingPop(SpscRing* ring, PipeChunk* chunk);
+
+// Blocking versions, backing off while they wait and accounting the wait
+// as a stall of 'stage'.
+void RingPushWait(SpscRing* ring, const PipeChunk* chunk, StageStats* stage);
+void RingPopWait(SpscRing* ring, PipeChunk* chunk, StageStats* stage);
+
+// One wait step, 'round' counting the steps of the current wait from 0.
+// The first steps only yield, so a short stall costs no wakeup latency;
+// later ones sleep for growing intervals so that a long one, like the CRC
+// stage waiting on a slow adapter, doesn't keep a core busy.
+void RingBackoff(uint32_t* round);
+
+void StartStage(StageStats* stage, const char* name);
+void FinishStage(StageStats* stage);
+void PrintStageStats(const StageStats* stage, const SpscRing* ring);
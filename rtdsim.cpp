@@ -0,0 +1,571 @@
+// rtdsim.cpp : Simulated RTD2662 ISP interface and SPI flash.
+//
+#include "stdafx.h"
+#include "rtdsim.h"
+#include "i2c.h"
+
+#define SIM_DEVICE 0x4a
+
+// Command stream bytes one USB transfer of the CH341 carries.
+#define SIM_STREAM_BYTES 3584
+
+// Longest read of one transfer, the CH341's buffer size.
+#define SIM_MAX_READ 4096
+
+static uint32_t GetEnvValue(const char* name, uint32_t value)
+{
+    const char* s = getenv(name);
+    return s ? strtoul(s, NULL, 0) : value;
+}
+
+void GetSimConfig(SimConfig* config)
+{
+    config->jedec_id = GetEnvValue("RTD_SIM_JEDEC", 0xEF4014);
+    config->flash_size_kb = GetEnvValue("RTD_SIM_SIZE_KB", 1024);
+    config->erase_kb[0] = 4;
+    config->erase_kb[1] = 32;
+    config->erase_kb[2] = 64;
+    config->page_program_us = GetEnvValue("RTD_SIM_PROGRAM_US", 700);
+    config->erase_us[0] = 45000;
+    config->erase_us[1] = 120000;
+    config->erase_us[2] = 150000;
+    config->chip_erase_us = 2000000;
+    config->crc_ns_per_byte = 100;
+    config->usb_latency_us = GetEnvValue("RTD_SIM_USB_US", 1000);
+    config->i2c_khz = GetEnvValue("RTD_SIM_I2C_KHZ", 400);
+    config->max_khz = GetEnvValue("RTD_SIM_MAX_KHZ", 750);
+    config->fault_rate = GetEnvValue("RTD_SIM_FAULTS", 0);
+    config->sfdp = GetEnvValue("RTD_SIM_SFDP", 1) != 0;
+    config->image_file = getenv("RTD_SIM_FLASH");
+}
+
+CRtdSimulator::CRtdSimulator(const SimConfig& config)
+    : config_(config)
+{
+    memset(&stats_, 0, sizeof(stats_));
+    memset(regs_, 0, sizeof(regs_));
+    memset(indirect_, 0, sizeof(indirect_));
+    flash_size_ = config.flash_size_kb * 1024;
+    flash_ = new uint8_t[flash_size_];
+    memset(flash_, 0xff, flash_size_);
+    fifo_len_ = 0;
+    read_addr_ = 0;
+    status_ = 0;
+    busy_until_ns_ = 0;
+    crc_until_ns_ = 0;
+    bus_ = E_BUS_IDLE;
+    reg_ = 0;
+    fault_seed_ = 1;
+    noise_seed_ = 1;
+    BuildSFDP();
+
+    FILE* fp = NULL;
+    if (config_.image_file && fopen_s(&fp, config_.image_file, "rb") == 0 && fp)
+    {
+        fread(flash_, 1, flash_size_, fp);
+        fclose(fp);
+    }
+}
+
+CRtdSimulator::~CRtdSimulator()
+{
+    FILE* fp = NULL;
+    if (config_.image_file && fopen_s(&fp, config_.image_file, "wb") == 0 && fp)
+    {
+        fwrite(flash_, 1, flash_size_, fp);
+        fclose(fp);
+    }
+    delete [] flash_;
+}
+
+static void PutDword(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+// Count and unit code of a JESD216 time field, 'max_count' being the
+// largest count it holds.
+static uint32_t EncodeTime(uint32_t time, const uint32_t* units, int num_units, uint32_t max_count)
+{
+    int u = 0;
+    while (u + 1 < num_units && (time + units[u] - 1) / units[u] > max_count)
+        u++;
+    uint32_t count = (time + units[u] - 1) / units[u];
+    if (count > max_count)
+        count = max_count;
+    return (u << 5) | (count ? count - 1 : 0);
+}
+
+// JESD216B header and a 16 DWORD basic flash parameter table at 0x30,
+// describing the configured chip: its size, the erase commands with their
+// times, 256 byte pages with their program time, volatile status register
+// bits written after EWSR and 1-1-2 fast reads.
+void CRtdSimulator::BuildSFDP()
+{
+    static const uint8_t opcodes[3] = {0x20, 0x52, 0xd8};
+    static const uint32_t erase_units_ms[4] = {1, 16, 128, 1000};
+    static const uint32_t program_units_us[2] = {8, 64};
+    memset(sfdp_, 0xff, sizeof(sfdp_));
+    static const uint8_t header[16] =
+    {
+        'S', 'F', 'D', 'P', 6, 1, 0, 0xff,
+        0x00, 6, 1, 16, 0x30, 0x00, 0x00, 0xff
+    };
+    memcpy(sfdp_, header, sizeof(header));
+    uint8_t* bfpt = sfdp_ + 0x30;
+    memset(bfpt, 0, 64);
+    uint32_t dw1 = 0xff000000 | (1 << 16) | (0x20 << 8) | (1 << 3) | (1 << 2);
+    if (config_.erase_kb[0] == 4)
+        dw1 |= 1;
+    PutDword(bfpt, dw1);
+    PutDword(bfpt + 4, config_.flash_size_kb * 8192 - 1);
+    uint32_t erase_types[2] = {0, 0};
+    uint32_t dw10 = 0;
+    int type = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        if (config_.erase_kb[i] == 0)
+            continue;
+        uint32_t log2_size = 10;
+        while ((1u << (log2_size - 10)) < config_.erase_kb[i])
+            log2_size++;
+        erase_types[type / 2] |= (log2_size | (opcodes[i] << 8)) << ((type % 2) * 16);
+        dw10 |= EncodeTime(config_.erase_us[i] / 1000, erase_units_ms, 4, 32) << (4 + 7 * type);
+        type++;
+    }
+    PutDword(bfpt + 28, erase_types[0]);
+    PutDword(bfpt + 32, erase_types[1]);
+    PutDword(bfpt + 36, dw10 | 2);
+    PutDword(bfpt + 40, (EncodeTime(config_.page_program_us, program_units_us, 2, 32) << 8) |
+                        (8 << 4) | 2);
+}
+
+void CRtdSimulator::PrintStats(const char* name) const
+{
+    fprintf(stderr, "%s: %.3fs simulated, %u USB transfers, %u bus bytes, "
+            "%u pages, %u erases, %u CRCs\n",
+            name, stats_.elapsed_ns / 1e9, stats_.transfers, stats_.bus_bytes,
+            stats_.pages, stats_.erases, stats_.crcs);
+    if (stats_.busy_violations > 0)
+        fprintf(stderr, "%s: %u flash operations started while busy\n",
+                name, stats_.busy_violations);
+}
+
+void CRtdSimulator::Clock(uint64_t ns)
+{
+    stats_.elapsed_ns += ns;
+}
+
+void CRtdSimulator::BeginTransfer()
+{
+    stats_.transfers++;
+    Clock((uint64_t)config_.usb_latency_us * 1000);
+}
+
+void CRtdSimulator::Wait(uint32_t usec)
+{
+    Clock((uint64_t)usec * 1000);
+}
+
+void CRtdSimulator::SetClock(uint32_t khz)
+{
+    config_.i2c_khz = khz;
+}
+
+// Whether a bus error hits now, about 1 in 'rate' times while the clock is
+// above what the wiring carries.
+bool CRtdSimulator::Noise(uint32_t rate)
+{
+    if (config_.i2c_khz <= config_.max_khz)
+        return false;
+    noise_seed_ = noise_seed_ * 1103515245 + 12345;
+    return (noise_seed_ >> 8) % rate == 0;
+}
+
+void CRtdSimulator::Start()
+{
+    bus_ = E_BUS_ADDRESS;
+}
+
+void CRtdSimulator::Stop()
+{
+    bus_ = E_BUS_IDLE;
+}
+
+bool CRtdSimulator::Out(uint8_t byte)
+{
+    stats_.bus_bytes++;
+    Clock(9000000 / config_.i2c_khz);
+    switch (bus_)
+    {
+    case E_BUS_ADDRESS:
+        if ((byte >> 1) != SIM_DEVICE || Noise(128))
+        {
+            bus_ = E_BUS_IGNORE;
+            return false;
+        }
+        bus_ = (byte & 1) ? E_BUS_READ : E_BUS_REGISTER;
+        return true;
+    case E_BUS_REGISTER:
+        reg_ = byte;
+        bus_ = E_BUS_WRITE;
+        return true;
+    case E_BUS_WRITE:
+        WriteRegister(reg_, byte);
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint8_t CRtdSimulator::In()
+{
+    stats_.bus_bytes++;
+    Clock(9000000 / config_.i2c_khz);
+    uint8_t b = (bus_ == E_BUS_READ) ? ReadRegister(reg_) : 0xff;
+    if (Noise(2048))
+        b ^= 1 << (noise_seed_ & 7);
+    return b;
+}
+
+// Return 'b' with a bit flipped at the configured fault rate.
+uint8_t CRtdSimulator::Fault(uint8_t b)
+{
+    if (config_.fault_rate == 0)
+        return b;
+    fault_seed_ = fault_seed_ * 1103515245 + 12345;
+    if ((fault_seed_ >> 8) % config_.fault_rate == 0)
+        b ^= 1 << ((fault_seed_ >> 4) & 7);
+    return b;
+}
+
+uint32_t CRtdSimulator::Reg24(uint8_t reg) const
+{
+    return (regs_[reg] << 16) | (regs_[reg + 1] << 8) | regs_[reg + 2];
+}
+
+bool CRtdSimulator::Busy() const
+{
+    return stats_.elapsed_ns < busy_until_ns_;
+}
+
+// A flash operation may only start once the previous one has finished.
+bool CRtdSimulator::CheckIdle()
+{
+    if (!Busy())
+        return true;
+    stats_.busy_violations++;
+    return false;
+}
+
+void CRtdSimulator::Erase(uint8_t opcode, uint32_t addr)
+{
+    if (opcode == 0xc7 || opcode == 0x60)
+    {
+        memset(flash_, 0xff, flash_size_);
+        busy_until_ns_ = stats_.elapsed_ns + (uint64_t)config_.chip_erase_us * 1000;
+        stats_.erases++;
+        return;
+    }
+    int level = (opcode == 0x20) ? 0 : (opcode == 0x52) ? 1 : 2;
+    uint32_t size = config_.erase_kb[level] * 1024;
+    if (size == 0 || size > flash_size_)
+        return;
+    addr = addr & ~(size - 1) & (flash_size_ - 1);
+    memset(&flash_[addr], 0xff, size);
+    busy_until_ns_ = stats_.elapsed_ns + (uint64_t)config_.erase_us[level] * 1000;
+    stats_.erases++;
+}
+
+// Common command engine: 0x60 holds the command type and the number of
+// address/data bytes written from 0x64-0x66 and read back into 0x67-0x69,
+// 0x61 the opcode. Bit 0 of 0x60 stays set until the flash is done.
+void CRtdSimulator::CommonCommand(uint8_t control)
+{
+    uint8_t cmd_type = control >> 5;
+    uint8_t opcode = regs_[0x61];
+    regs_[0x60] = control & ~1;
+    if ((regs_[0x6f] & 0x80) == 0)
+        return;
+    if (opcode == 0x05)
+    {
+        regs_[0x67] = status_ | (Busy() ? 0x01 : 0);
+        return;
+    }
+    if (!CheckIdle())
+        return;
+    switch (opcode)
+    {
+    case 0x9f:
+        regs_[0x67] = (uint8_t)(config_.jedec_id >> 16);
+        regs_[0x68] = (uint8_t)(config_.jedec_id >> 8);
+        regs_[0x69] = (uint8_t)config_.jedec_id;
+        break;
+    case 0x03:
+    case 0x0b:
+        read_addr_ = Reg24(0x64);
+        break;
+    case 0x5a:
+        if (config_.sfdp)
+        {
+            // The dummy byte after the address, then the data.
+            uint32_t addr = Reg24(0x64);
+            regs_[0x67] = 0xff;
+            regs_[0x68] = addr < sizeof(sfdp_) ? sfdp_[addr] : 0xff;
+            regs_[0x69] = addr + 1 < sizeof(sfdp_) ? sfdp_[addr + 1] : 0xff;
+        }
+        else
+        {
+            regs_[0x67] = regs_[0x68] = regs_[0x69] = 0;
+        }
+        break;
+    case 0x01:
+        if (cmd_type == 3 || cmd_type == 4)
+            status_ = regs_[0x64] & 0xfc;
+        break;
+    case 0xc7:
+    case 0x60:
+    case 0x20:
+    case 0x52:
+    case 0xd8:
+        if (cmd_type == 5)
+            Erase(opcode, Reg24(0x64));
+        break;
+    default:
+        regs_[0x67] = regs_[0x68] = regs_[0x69] = 0;
+        break;
+    }
+}
+
+void CRtdSimulator::WriteRegister(uint8_t reg, uint8_t value)
+{
+    switch (reg)
+    {
+    case 0x60:
+        if (value & 1)
+            CommonCommand(value);
+        else
+            regs_[reg] = value;
+        break;
+    case 0x6f:
+        // Bit 7 keeps the controller in ISP mode, bit 5 programs the FIFO
+        // and bit 2 starts the range CRC.
+        regs_[reg] = value & 0x80;
+        if ((value & 0x80) == 0)
+            break;
+        if ((value & 0x20) != 0 && CheckIdle())
+        {
+            // The flash can only clear bits.
+            uint32_t addr = Reg24(0x64);
+            uint32_t len = regs_[0x71] + 1;
+            for (uint32_t i = 0; i < len && i < fifo_len_; i++)
+                flash_[(addr + i) % flash_size_] &= Fault(fifo_[i]);
+            busy_until_ns_ = stats_.elapsed_ns + (uint64_t)config_.page_program_us * 1000;
+            stats_.pages++;
+        }
+        fifo_len_ = 0;
+        if ((value & 0x04) != 0 && CheckIdle())
+        {
+            uint32_t start = Reg24(0x64);
+            uint32_t end = Reg24(0x72);
+            unsigned crc = 0;
+            for (uint32_t addr = start; addr <= end && addr < flash_size_; addr++)
+            {
+                crc ^= (flash_[addr] << 8);
+                for (int i = 8; i; i--)
+                {
+                    if (crc & 0x8000)
+                        crc ^= (0x1070 << 3);
+                    crc <<= 1;
+                }
+            }
+            regs_[0x75] = (uint8_t)(crc >> 8);
+            uint64_t len = (end >= start) ? end - start + 1 : 0;
+            crc_until_ns_ = stats_.elapsed_ns + len * config_.crc_ns_per_byte;
+            regs_[reg] |= 0x04;
+            stats_.crcs++;
+        }
+        break;
+    case 0x70:
+        if (fifo_len_ < sizeof(fifo_))
+            fifo_[fifo_len_++] = value;
+        break;
+    case 0xee:
+        // Leaving ISP reboots the scaler firmware.
+        if (value & 0x02)
+            regs_[0x6f] = 0;
+        break;
+    case 0xf5:
+        indirect_[regs_[0xf4]] = value;
+        break;
+    default:
+        regs_[reg] = value;
+        break;
+    }
+}
+
+uint8_t CRtdSimulator::ReadRegister(uint8_t reg)
+{
+    switch (reg)
+    {
+    case 0x60:
+        return regs_[reg] | (Busy() ? 0x01 : 0);
+    case 0x6f:
+    {
+        uint8_t value = regs_[reg] & 0x80;
+        if (Busy())
+            value |= 0x40;
+        if ((regs_[reg] & 0x04) && stats_.elapsed_ns >= crc_until_ns_)
+            value |= 0x02;
+        return value;
+    }
+    case 0x70:
+        if (!CheckIdle())
+            return 0xff;
+        return Fault(flash_[read_addr_++ % flash_size_]);
+    case 0xf5:
+        return indirect_[regs_[0xf4]];
+    default:
+        return regs_[reg];
+    }
+}
+
+// Transport driving the simulator directly. It keeps the transfer pattern of
+// the CH341 packed stream: queued writes and delays share one USB round-trip
+// with the read or flush that ends them.
+class CSimTransport : public I2CTransport
+{
+public:
+    explicit CSimTransport(const SimConfig& config)
+        : config_(config), sim_(NULL), device_(SIM_DEVICE), queued_(0), pending_(false)
+    {
+    }
+    ~CSimTransport()
+    {
+        Close();
+    }
+
+    bool Open()
+    {
+        sim_ = new CRtdSimulator(config_);
+        fprintf(stderr, "Simulator: JEDEC ID 0x%06x, %uKB, %uus USB latency, %ukHz "
+                "(clean up to %ukHz)\n",
+                config_.jedec_id, config_.flash_size_kb, config_.usb_latency_us,
+                config_.i2c_khz, config_.max_khz);
+        return true;
+    }
+
+    void Close()
+    {
+        if (sim_ == NULL)
+            return;
+        sim_->PrintStats("Simulator");
+        delete sim_;
+        sim_ = NULL;
+    }
+
+    void SetAddress(uint8_t address)
+    {
+        device_ = address;
+    }
+
+    bool Write(uint8_t reg, const uint8_t* values, uint32_t len)
+    {
+        Begin(len + 4);
+        sim_->Start();
+        bool ok = sim_->Out((uint8_t)(device_ << 1));
+        sim_->Out(reg);
+        for (uint32_t i = 0; i < len; i++)
+            sim_->Out(values[i]);
+        sim_->Stop();
+        stats_.bytes_written += len + 2;
+        return ok;
+    }
+
+    bool Read(uint8_t reg, uint8_t* dest, uint32_t len)
+    {
+        Begin(8);
+        sim_->Start();
+        bool ok = sim_->Out((uint8_t)(device_ << 1));
+        sim_->Out(reg);
+        sim_->Start();
+        ok = sim_->Out((uint8_t)((device_ << 1) | 1)) && ok;
+        for (uint32_t i = 0; i < len; i++)
+            dest[i] = sim_->In();
+        sim_->Stop();
+        stats_.bytes_written += 3;
+        stats_.bytes_read += len;
+        pending_ = false;
+        return ok;
+    }
+
+    void Delay(uint32_t usec)
+    {
+        Begin((usec / 1000 + usec % 1000) / 15 + 2);
+        sim_->Wait(usec);
+    }
+
+    void Sleep(uint32_t usec)
+    {
+        sim_->Wait(usec);
+    }
+
+    bool Flush()
+    {
+        pending_ = false;
+        return true;
+    }
+
+    uint32_t MaxReadSize() const
+    {
+        return SIM_MAX_READ;
+    }
+
+    uint32_t Speed() const
+    {
+        return config_.i2c_khz;
+    }
+
+    bool SetSpeed(uint32_t khz)
+    {
+        config_.i2c_khz = khz;
+        if (sim_)
+            sim_->SetClock(khz);
+        return true;
+    }
+
+    uint64_t NowUs()
+    {
+        return sim_->Stats().elapsed_ns / 1000;
+    }
+
+private:
+    // Account for 'bytes' more command bytes in the current transfer.
+    void Begin(uint32_t bytes)
+    {
+        if (pending_ && queued_ + bytes > SIM_STREAM_BYTES)
+            pending_ = false;
+        if (!pending_)
+        {
+            sim_->BeginTransfer();
+            stats_.transfers++;
+            queued_ = 0;
+            pending_ = true;
+        }
+        queued_ += bytes;
+    }
+
+    SimConfig      config_;
+    CRtdSimulator* sim_;
+    uint8_t        device_;
+    uint32_t       queued_;
+    bool           pending_;
+};
+
+I2CTransport* CreateSimTransport(const SimConfig& config)
+{
+    return new CSimTransport(config);
+}
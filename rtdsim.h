@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+
+// Timing and identity of the simulated monitor controller and its flash.
+struct SimConfig
+{
+    uint32_t jedec_id;
+    uint32_t flash_size_kb;
+    uint16_t erase_kb[3];       // sizes erased by 0x20, 0x52, 0xD8, as in FlashDesc
+    uint32_t page_program_us;
+    uint32_t erase_us[3];       // per erase command above
+    uint32_t chip_erase_us;
+    uint32_t crc_ns_per_byte;   // CRC unit reading the flash
+    uint32_t usb_latency_us;    // per USB round-trip to the adapter
+    uint32_t i2c_khz;           // SCL clock, 9 clocks per byte
+    uint32_t max_khz;           // fastest clock the wiring carries cleanly
+    uint32_t fault_rate;        // flip a bit in about 1 of n flash bytes, 0 = never
+    bool     sfdp;              // answers 0x5A with a JESD216 parameter table
+    const char* image_file;     // flash content loaded on start, saved on exit
+};
+
+// W25Q80 behind a CH341 at 400kHz, overridden by RTD_SIM_JEDEC,
+// RTD_SIM_SIZE_KB, RTD_SIM_PROGRAM_US, RTD_SIM_USB_US, RTD_SIM_I2C_KHZ,
+// RTD_SIM_MAX_KHZ, RTD_SIM_FAULTS, RTD_SIM_SFDP (0 or 1) and RTD_SIM_FLASH
+// (image file) from the environment.
+void GetSimConfig(SimConfig* config);
+
+struct SimStats
+{
+    uint64_t elapsed_ns;    // simulated time
+    uint32_t transfers;     // USB round-trips
+    uint32_t bus_bytes;     // bytes clocked over I2C
+    uint32_t pages;         // page programs
+    uint32_t erases;
+    uint32_t crcs;
+    uint32_t busy_violations;  // flash operations started while busy
+};
+
+// Cycle-aware model of the RTD2662 ISP register block (0x60-0x75, the 0x70
+// FIFO, the common command engine, the range CRC unit and the 0xF4/0xF5
+// indirect registers) in front of a SPI flash. It is driven at the I2C
+// byte level and keeps a simulated clock: USB round-trips, bytes on the bus
+// and adapter-side delays advance it, and flash operations stay busy until
+// their latency has passed on it.
+class CRtdSimulator
+{
+public:
+    explicit CRtdSimulator(const SimConfig& config);
+    ~CRtdSimulator();
+
+    void BeginTransfer();       // one USB round-trip
+    void Start();
+    bool Out(uint8_t byte);     // returns the ACK
+    uint8_t In();
+    void Stop();
+    void Wait(uint32_t usec);   // adapter-side or host-side delay
+    // Above the configured max_khz bytes read over the bus get bits flipped
+    // and addresses go unacknowledged now and then.
+    void SetClock(uint32_t khz);
+
+    const SimStats& Stats() const
+    {
+        return stats_;
+    }
+    void PrintStats(const char* name) const;
+
+private:
+    enum EBusState
+    {
+        E_BUS_IDLE,
+        E_BUS_ADDRESS,
+        E_BUS_REGISTER,
+        E_BUS_WRITE,
+        E_BUS_READ,
+        E_BUS_IGNORE
+    };
+
+    void WriteRegister(uint8_t reg, uint8_t value);
+    uint8_t ReadRegister(uint8_t reg);
+    void CommonCommand(uint8_t control);
+    void Erase(uint8_t opcode, uint32_t addr);
+    void BuildSFDP();
+    bool Busy() const;
+    bool CheckIdle();
+    uint8_t Fault(uint8_t b);
+    bool Noise(uint32_t rate);
+    uint32_t Reg24(uint8_t reg) const;
+    void Clock(uint64_t ns);
+
+    SimConfig config_;
+    SimStats  stats_;
+    uint8_t*  flash_;
+    uint32_t  flash_size_;
+    uint8_t   regs_[256];
+    uint8_t   indirect_[256];   // behind 0xF4 (index) / 0xF5 (data)
+    uint8_t   fifo_[256];
+    uint8_t   sfdp_[128];       // SFDP header and basic flash parameter table
+    uint32_t  fifo_len_;
+    uint32_t  read_addr_;
+    uint8_t   status_;          // flash status register
+    uint64_t  busy_until_ns_;   // flash write/erase in progress
+    uint64_t  crc_until_ns_;
+    EBusState bus_;
+    uint8_t   reg_;
+    uint32_t  fault_seed_;
+    uint32_t  noise_seed_;
+};
+
+class I2CTransport;
+
+// Transport talking to a simulator instead of an adapter.
+I2CTransport* CreateSimTransport(const SimConfig& config);
+
+#ifdef __linux__
+// The i2c-dev transport with its kernel calls answered by a simulator, as
+// an adapter without I2C_RDWR when 'smbus' is set (see i2cdev.cpp).
+I2CTransport* CreateI2CDevSimTransport(const SimConfig& config, bool smbus);
+#endif
@@ -0,0 +1,142 @@
+// session.cpp : Per-adapter sessions and the scheduler running them.
+//
+#include "stdafx.h"
+#include <stdarg.h>
+#include "session.h"
+#include "thread.h"
+#include "trace.h"
+
+static THREAD_LOCAL Session* t_Session = NULL;
+static volatile long g_Running = 0;
+
+void InitSession(Session* session, int index, const char* name, I2CTransport* transport)
+{
+    memset(session, 0, sizeof(*session));
+    session->index = index;
+    strncpy(session->name, name, sizeof(session->name) - 1);
+    session->link.transport = transport;
+    session->link.batch_ok = true;
+}
+
+void BindSession(Session* session)
+{
+    t_Session = session;
+    BindI2CLink(session ? &session->link : NULL);
+    BindPollState(session ? &session->poll : NULL);
+    BindCRC(session ? &session->crc : NULL);
+}
+
+Session* CurrentSession()
+{
+    return t_Session;
+}
+
+static void RunSession(Session* session, SessionJob job, void* arg)
+{
+    BindSession(session);
+    TraceThreadName(session->name);
+    if (!InitI2C())
+    {
+        fprintf(stderr, "%s: can't open the I2C adapter\n", session->name);
+        session->ok = false;
+    }
+    else
+    {
+        uint64_t start = GetI2CTimeUs();
+        session->ok = job(session, arg);
+        session->elapsed_us = GetI2CTimeUs() - start;
+        session->stats = GetI2CStats();
+    }
+    CloseI2C();
+    BindSession(NULL);
+}
+
+struct SessionQueue
+{
+    Session*      sessions;
+    int           count;
+    SessionJob    job;
+    void*         arg;
+    volatile long next;
+};
+
+static void SessionWorker(void* param)
+{
+    SessionQueue* queue = (SessionQueue*)param;
+    for (;;)
+    {
+        long i = AtomicAdd(&queue->next, 1) - 1;
+        if (i >= queue->count)
+            break;
+        RunSession(&queue->sessions[i], queue->job, queue->arg);
+    }
+}
+
+int RunSessions(Session* sessions, int count, int parallel, SessionJob job, void* arg)
+{
+    if (parallel > count)
+        parallel = count;
+    if (parallel < 1)
+        parallel = 1;
+    g_Running = parallel;
+
+    SessionQueue queue = {sessions, count, job, arg, 0};
+    if (parallel == 1)
+    {
+        SessionWorker(&queue);
+    }
+    else
+    {
+        Thread* threads = new Thread[parallel];
+        int started = 0;
+        for (int t = 0; t < parallel; t++)
+        {
+            if (StartThread(&threads[t], SessionWorker, &queue))
+                started++;
+        }
+        // Without any thread the sessions still run, one by one.
+        if (started == 0)
+            SessionWorker(&queue);
+        for (int t = 0; t < parallel; t++)
+            JoinThread(&threads[t]);
+        delete [] threads;
+    }
+    g_Running = 0;
+
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (!sessions[i].ok)
+            failed++;
+    }
+    return failed;
+}
+
+void PrintSessionReport(const Session* sessions, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const Session* s = &sessions[i];
+        fprintf(stderr, "%-24s %-6s %8.2fs %7u transfers %9u bytes written %9u bytes read\n",
+                s->name, s->ok ? "OK" : "FAILED", s->elapsed_us / 1e6,
+                s->stats.transfers, s->stats.bytes_written, s->stats.bytes_read);
+    }
+}
+
+void PrintProgress(const char* format, ...)
+{
+    Session* session = t_Session;
+    bool hook = session && session->progress;
+    if (g_Running > 1 && !hook)
+        return;
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    text[sizeof(text) - 1] = 0;
+    if (hook)
+        session->progress(session, text);
+    if (g_Running <= 1)
+        fprintf(stderr, "%s\r", text);
+}
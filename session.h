@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include "i2c.h"
+#include "statuspoll.h"
+#include "crc.h"
+
+struct FlashDesc;
+struct Session;
+
+// Receives the progress lines of a session, see PrintProgress().
+typedef void (*ProgressHook)(Session* session, const char* text);
+
+// One programmer: the link to its scaler, the learned controller timings,
+// the running CRC of the data sent and the chip found behind it. While a
+// session is bound to a thread the I2C, polling and CRC functions work on
+// its state, so several adapters can be driven from one process.
+struct Session
+{
+    char             name[64];
+    int              index;
+    I2CLink          link;
+    PollState        poll;
+    CRCContext       crc;
+    const FlashDesc* chip;
+    ProgressHook     progress;      // or NULL
+    void*            progress_arg;
+
+    // Outcome, filled in by RunSessions()
+    bool             ok;
+    uint64_t         elapsed_us;    // on the clock of the link
+    I2CStats         stats;
+};
+
+// Prepare 'session' for 'transport', which it deletes when done.
+void InitSession(Session* session, int index, const char* name, I2CTransport* transport);
+void BindSession(Session* session);
+Session* CurrentSession();
+
+typedef bool (*SessionJob)(Session* session, void* arg);
+
+// Open every session's link, run 'job' on it and close it again, with up to
+// 'parallel' sessions at a time, each on its own thread. Shared data passed
+// in 'arg' must only be read. Returns the number of failed sessions.
+int RunSessions(Session* sessions, int count, int parallel, SessionJob job, void* arg);
+void PrintSessionReport(const Session* sessions, int count);
+
+// Progress line ending in '\r', dropped while several sessions run. The
+// session's progress hook gets it either way.
+void PrintProgress(const char* format, ...);
@@ -0,0 +1,187 @@
+// statuspoll.cpp : Status polling with learned completion times and deadlines.
+//
+#include "stdafx.h"
+#include "statuspoll.h"
+#include "i2c.h"
+#include "thread.h"
+#include "trace.h"
+
+struct PollOpDesc
+{
+    const char* name;
+    uint32_t    wait_us;    // initial delay before the first read, per unit
+    uint32_t    timeout_ms; // per unit
+    uint32_t    min_timeout_ms;
+};
+
+// Initial delays are below the typical times of the Winbond/Macronix parts,
+// timeouts well above their maximum ones.
+static const PollOpDesc PollOps[E_POLL_OPS] =
+{
+    {"command",      0,       1,      100},
+    {"read setup",   0,       1,      100},
+    {"page program", 600,     20,     20},
+    {"4KB erase",    35000,   1000,   1000},
+    {"32KB erase",   100000,  2000,   2000},
+    {"64KB erase",   120000,  3000,   3000},
+    {"chip erase",   1000000, 200000, 200000},
+    {"CRC",          20,      10,     1000},
+};
+
+// Longest delay between two reads once the first one found the
+// controller busy.
+#define POLL_MAX_INTERVAL_US 50000
+
+static PollState g_DefaultPoll;
+static THREAD_LOCAL PollState* t_Poll = NULL;
+
+void BindPollState(PollState* state)
+{
+    t_Poll = state;
+}
+
+static PollStats* GetState()
+{
+    PollState* state = t_Poll ? t_Poll : &g_DefaultPoll;
+    if (!state->init)
+    {
+        memset(state->stats, 0, sizeof(state->stats));
+        for (int op = 0; op < E_POLL_OPS; op++)
+            state->stats[op].wait_us = PollOps[op].wait_us;
+        state->init = true;
+    }
+    return state->stats;
+}
+
+void ResetPollStats()
+{
+    PollStats* stats = GetState();
+    for (int op = 0; op < E_POLL_OPS; op++)
+    {
+        uint32_t wait_us = stats[op].wait_us;
+        memset(&stats[op], 0, sizeof(stats[op]));
+        stats[op].wait_us = wait_us;
+    }
+}
+
+void SetPollTiming(EPollOp op, uint32_t typical_us)
+{
+    // A little below the typical time, like the defaults above.
+    PollStats* stats = &GetState()[op];
+    if (stats->ops == 0)
+        stats->wait_us = typical_us - typical_us / 8;
+}
+
+EPollOp ErasePollOp(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case 0x20:
+        return E_POLL_ERASE_4K;
+    case 0x52:
+        return E_POLL_ERASE_32K;
+    case 0xd8:
+        return E_POLL_ERASE_64K;
+    case 0xc7:
+    case 0x60:
+        return E_POLL_CHIP_ERASE;
+    }
+    return E_POLL_COMMAND;
+}
+
+// Leave the common command engine, program and CRC units idle.
+static void RecoverController()
+{
+    WriteReg(0x60, 0x00);
+    WriteReg(0x6f, 0x80);
+}
+
+bool PollRegister(EPollOp op, uint32_t units, uint8_t reg, uint8_t mask, uint8_t value)
+{
+    PollStats* stats = &GetState()[op];
+    const PollOpDesc* desc = &PollOps[op];
+    TraceScope trace("poll", desc->name);
+    if (units == 0)
+        units = 1;
+
+    uint64_t wait = (uint64_t)stats->wait_us * units;
+    uint64_t timeout = (uint64_t)desc->timeout_ms * units;
+    if (timeout < desc->min_timeout_ms)
+        timeout = desc->min_timeout_ms;
+    timeout *= 1000;
+    uint64_t interval = wait / 8;
+    if (interval > POLL_MAX_INTERVAL_US)
+        interval = POLL_MAX_INTERVAL_US;
+
+    uint64_t start = GetI2CTimeUs();
+    uint32_t polls = 0;
+    uint64_t last_busy = 0;
+    if (wait > 0)
+        QueueI2CDelay((uint32_t)wait);
+    for (;;)
+    {
+        uint8_t b = ReadReg(reg);
+        polls++;
+        uint64_t elapsed = GetI2CTimeUs() - start;
+        if ((b & mask) == value)
+        {
+            // Creep up on the completion time while the first read finds the
+            // operation done. When it took longer, the operation ended between
+            // the last two reads; move halfway to the middle of them.
+            uint64_t per_unit = (last_busy + elapsed) / 2 / units;
+            if (polls == 1)
+                stats->wait_us -= stats->wait_us / 32 + (stats->wait_us >= 10 ? 10 : stats->wait_us);
+            else if (per_unit > stats->wait_us)
+                stats->wait_us += (uint32_t)((per_unit - stats->wait_us) / 2);
+            stats->ops++;
+            stats->polls += polls;
+            stats->total_us += elapsed;
+            return true;
+        }
+        if (elapsed > timeout)
+            break;
+        last_busy = elapsed;
+        if (interval > 0)
+            QueueI2CDelay((uint32_t)interval);
+    }
+
+    fprintf(stderr, "\n%s timed out after %u status reads, resetting the controller\n",
+            desc->name, polls);
+    RecoverController();
+    stats->ops++;
+    stats->polls += polls;
+    stats->timeouts++;
+    stats->total_us += GetI2CTimeUs() - start;
+    return false;
+}
+
+PollStats GetPollStats(EPollOp op)
+{
+    return GetState()[op];
+}
+
+uint32_t GetPollCount()
+{
+    const PollStats* stats = GetState();
+    uint32_t polls = 0;
+    for (int op = 0; op < E_POLL_OPS; op++)
+        polls += stats[op].polls;
+    return polls;
+}
+
+void PrintPollStats()
+{
+    for (int op = 0; op < E_POLL_OPS; op++)
+    {
+        const PollStats* stats = &GetState()[op];
+        if (stats->ops == 0)
+            continue;
+        fprintf(stderr, "Poll %-12s %6u ops %7u reads %8.2fms avg  wait %uus%s",
+                PollOps[op].name, stats->ops, stats->polls,
+                stats->total_us / 1000.0 / stats->ops, stats->wait_us,
+                op == E_POLL_CRC ? "/KB" : "");
+        if (stats->timeouts > 0)
+            fprintf(stderr, "  %u timeouts", stats->timeouts);
+        fprintf(stderr, "\n");
+    }
+}
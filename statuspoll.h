@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+// Controller operations waited for by status polling.
+enum EPollOp
+{
+    E_POLL_COMMAND,         // common command other than erase
+    E_POLL_READ_SETUP,      // start of a flash read through 0x70
+    E_POLL_PAGE_PROGRAM,
+    E_POLL_ERASE_4K,
+    E_POLL_ERASE_32K,
+    E_POLL_ERASE_64K,
+    E_POLL_CHIP_ERASE,
+    E_POLL_CRC,             // per KB of the range
+    E_POLL_OPS
+};
+
+// Wait until (ReadReg(reg) & mask) == value after starting 'op' on 'units'
+// (KB for E_POLL_CRC, 1 otherwise). The first read is delayed until shortly
+// before the learned completion time of the operation, later ones are spaced
+// by a fraction of it. Inside an I2C batch short delays run on the adapter,
+// in front of the read (see QueueI2CDelay). When the deadline of the
+// operation passes, the controller is put back into plain ISP mode and false
+// is returned.
+bool PollRegister(EPollOp op, uint32_t units, uint8_t reg, uint8_t mask, uint8_t value);
+
+// Erase opcode to the operation it starts.
+EPollOp ErasePollOp(uint8_t opcode);
+
+struct PollStats
+{
+    uint32_t ops;
+    uint32_t polls;         // status reads
+    uint32_t timeouts;
+    uint64_t total_us;      // from the start of the wait to completion
+    uint32_t wait_us;       // current delay before the first read, per unit
+};
+
+// Learned timings and counts of one controller.
+struct PollState
+{
+    PollStats stats[E_POLL_OPS];
+    bool      init;
+};
+
+// Keep the timings of the calling thread in 'state', or in the process-wide
+// default state when NULL.
+void BindPollState(PollState* state);
+
+// Start the learned delay of 'op' from the chip's typical time of it, as
+// long as no operation has been timed yet.
+void SetPollTiming(EPollOp op, uint32_t typical_us);
+
+PollStats GetPollStats(EPollOp op);
+uint32_t GetPollCount();
+// Clear the counts, keeping the learned delays.
+void ResetPollStats();
+void PrintPollStats();
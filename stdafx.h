@@ -5,6 +5,8 @@
 
 #pragma once
 
+#ifdef _WIN32
+
 #include "targetver.h"
 
 #include <stdio.h>
@@ -16,6 +18,8 @@
 #include <atlbase.h>
 #include <atlstr.h>
 
+#endif // _WIN32
+
 // TODO: vOɕKvȒǉwb_[ŎQƂĂB
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,4 +35,40 @@
 #include <iostream>
 #include <iomanip>
 
+#ifndef _WIN32
+// Elsewhere (the Linux build of the simulator, i2c-dev and the daemon) the
+// Windows types of CH341DLL_EN.H and the few CRT calls used are mapped here.
+#include <errno.h>
+#include <unistd.h>
+
+typedef unsigned int   ULONG, *PULONG;
+typedef int            LONG, BOOL;
+typedef unsigned char  UCHAR, *PUCHAR;
+typedef unsigned short USHORT;
+typedef char           CHAR, *PCHAR;
+typedef void           *PVOID, *HANDLE;
+typedef uintptr_t      ULONG_PTR;
+typedef char           _TCHAR;
+
+#define VOID                 void
+#define WINAPI
+#define CALLBACK
+#define TRUE                 1
+#define FALSE                0
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define _tmain               main
+#define _T(x)                x
+
+static inline int fopen_s(FILE** fp, const char* name, const char* mode)
+{
+    *fp = fopen(name, mode);
+    return *fp ? 0 : errno;
+}
+
+static inline void Sleep(unsigned ms)
+{
+    usleep(ms * 1000);
+}
+#endif // _WIN32
+
 #include "CH341DLL_EN.H"
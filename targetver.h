@@ -5,4 +5,6 @@
 // ȑO Windows vbgtH[pɃAvP[Vrhꍇ́AWinSDKVer.h CN[hA
 // SDKDDKVer.h CN[hOɁAT|[gΏۂƂvbgtH[悤 _WIN32_WINNT }Nݒ肵܂B
 
+#ifdef _WIN32
 #include <SDKDDKVer.h>
+#endif
@@ -0,0 +1,178 @@
+// thread.cpp : Minimal threads on Win32 and POSIX.
+//
+#include "stdafx.h"
+#include "thread.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+struct ThreadStart
+{
+    ThreadProc proc;
+    void*      arg;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadMain(LPVOID param)
+#else
+static void* ThreadMain(void* param)
+#endif
+{
+    ThreadStart start = *(ThreadStart*)param;
+    delete (ThreadStart*)param;
+    start.proc(start.arg);
+    return 0;
+}
+
+bool StartThread(Thread* thread, ThreadProc proc, void* arg)
+{
+    ThreadStart* start = new ThreadStart;
+    start->proc = proc;
+    start->arg = arg;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, ThreadMain, start, 0, NULL);
+    if (NULL == thread->handle)
+#else
+    pthread_t* t = new pthread_t;
+    thread->handle = t;
+    if (pthread_create(t, NULL, ThreadMain, start) != 0)
+#endif
+    {
+        delete start;
+#ifndef _WIN32
+        delete t;
+#endif
+        thread->handle = NULL;
+        return false;
+    }
+    return true;
+}
+
+void JoinThread(Thread* thread)
+{
+    if (NULL == thread->handle)
+        return;
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_t* t = (pthread_t*)thread->handle;
+    pthread_join(*t, NULL);
+    delete t;
+#endif
+    thread->handle = NULL;
+}
+
+void InitMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    CRITICAL_SECTION* cs = new CRITICAL_SECTION;
+    InitializeCriticalSection(cs);
+    mutex->handle = cs;
+#else
+    pthread_mutex_t* m = new pthread_mutex_t;
+    pthread_mutex_init(m, NULL);
+    mutex->handle = m;
+#endif
+}
+
+void FreeMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    CRITICAL_SECTION* cs = (CRITICAL_SECTION*)mutex->handle;
+    DeleteCriticalSection(cs);
+    delete cs;
+#else
+    pthread_mutex_t* m = (pthread_mutex_t*)mutex->handle;
+    pthread_mutex_destroy(m);
+    delete m;
+#endif
+    mutex->handle = NULL;
+}
+
+void LockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection((CRITICAL_SECTION*)mutex->handle);
+#else
+    pthread_mutex_lock((pthread_mutex_t*)mutex->handle);
+#endif
+}
+
+void UnlockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection((CRITICAL_SECTION*)mutex->handle);
+#else
+    pthread_mutex_unlock((pthread_mutex_t*)mutex->handle);
+#endif
+}
+
+long AtomicAdd(volatile long* target, long value)
+{
+#ifdef _WIN32
+    return InterlockedExchangeAdd(target, value) + value;
+#else
+    return __sync_add_and_fetch(target, value);
+#endif
+}
+
+long AtomicLoadAcquire(volatile long* target)
+{
+#ifdef _MSC_VER
+    long value = *target;
+    _ReadWriteBarrier();
+    return value;
+#else
+    return __atomic_load_n(target, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void AtomicStoreRelease(volatile long* target, long value)
+{
+#ifdef _MSC_VER
+    _ReadWriteBarrier();
+    *target = value;
+#else
+    __atomic_store_n(target, value, __ATOMIC_RELEASE);
+#endif
+}
+
+void YieldThread()
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+void SleepThread(uint32_t usec)
+{
+#ifdef _WIN32
+    Sleep((usec + 999) / 1000);
+#else
+    usleep(usec);
+#endif
+}
+
+uint64_t HostTimeUs()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / (double)freq.QuadPart * 1e6);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
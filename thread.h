@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+// Per-thread variables. The VS2010 toolset has no C++11 thread_local.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct Thread
+{
+    void* handle;
+};
+
+typedef void (*ThreadProc)(void* arg);
+
+bool StartThread(Thread* thread, ThreadProc proc, void* arg);
+void JoinThread(Thread* thread);
+
+// Lock around state several threads update together.
+struct Mutex
+{
+    void* handle;
+};
+
+void InitMutex(Mutex* mutex);
+void FreeMutex(Mutex* mutex);
+void LockMutex(Mutex* mutex);
+void UnlockMutex(Mutex* mutex);
+
+// Add 'value' and return the new value, atomically.
+long AtomicAdd(volatile long* target, long value);
+
+// Loads and stores ordering the surrounding memory accesses like a lock
+// release/acquire, for lock-free handoffs between two threads.
+long AtomicLoadAcquire(volatile long* target);
+void AtomicStoreRelease(volatile long* target, long value);
+
+// Let other threads run before this one continues.
+void YieldThread();
+
+// Suspend this thread for at least 'usec' microseconds. Win32 rounds up to
+// whole milliseconds.
+void SleepThread(uint32_t usec);
+
+// Monotonic host time in microseconds.
+uint64_t HostTimeUs();
@@ -0,0 +1,289 @@
+// trace.cpp : Per-thread event buffers, Chrome trace export and histograms.
+//
+#include "stdafx.h"
+#include "trace.h"
+#include "thread.h"
+#include "i2c.h"
+
+struct TraceEvent
+{
+    const char* category;
+    const char* name;
+    uint64_t    start_us;
+    uint32_t    dur_us;
+    uint32_t    bytes_out;
+    uint32_t    bytes_in;
+};
+
+#define TRACE_BLOCK_EVENTS 4096
+#define TRACE_MAX_TIMELINES 256
+
+// Events are appended to fixed blocks, so recording never moves what was
+// already recorded.
+struct TraceBlock
+{
+    TraceEvent  events[TRACE_BLOCK_EVENTS];
+    uint32_t    count;
+    TraceBlock* next;
+};
+
+// Written only by its thread; read by StopTrace() after the thread is done.
+struct TraceTimeline
+{
+    char        name[64];
+    TraceBlock* first;
+    TraceBlock* last;
+};
+
+bool g_TraceEnabled = false;
+
+static TraceTimeline* g_Timelines[TRACE_MAX_TIMELINES];
+static volatile long g_NumTimelines = 0;
+static volatile long g_Dropped = 0;
+
+static THREAD_LOCAL TraceTimeline* t_Timeline = NULL;
+static THREAD_LOCAL const char* t_Name = NULL;
+static THREAD_LOCAL bool t_Dropped = false;
+
+void StartTrace()
+{
+    g_TraceEnabled = true;
+}
+
+void TraceThreadName(const char* name)
+{
+    t_Name = name;
+    t_Timeline = NULL;
+    t_Dropped = false;
+}
+
+static TraceEvent* NewEvent()
+{
+    TraceTimeline* timeline = t_Timeline;
+    if (timeline == NULL)
+    {
+        if (t_Dropped)
+            return NULL;
+        long slot = AtomicAdd(&g_NumTimelines, 1) - 1;
+        if (slot >= TRACE_MAX_TIMELINES)
+        {
+            AtomicAdd(&g_Dropped, 1);
+            t_Dropped = true;
+            return NULL;
+        }
+        timeline = new TraceTimeline;
+        memset(timeline, 0, sizeof(*timeline));
+        if (t_Name)
+            strncpy(timeline->name, t_Name, sizeof(timeline->name) - 1);
+        else
+            sprintf(timeline->name, "thread %ld", slot);
+        g_Timelines[slot] = timeline;
+        t_Timeline = timeline;
+    }
+    TraceBlock* block = timeline->last;
+    if (block == NULL || block->count == TRACE_BLOCK_EVENTS)
+    {
+        TraceBlock* next = new TraceBlock;
+        next->count = 0;
+        next->next = NULL;
+        if (block)
+            block->next = next;
+        else
+            timeline->first = next;
+        timeline->last = block = next;
+    }
+    return &block->events[block->count++];
+}
+
+static void Record(const char* category, const char* name, uint64_t start_us, uint64_t end_us,
+                   uint32_t bytes_out, uint32_t bytes_in)
+{
+    TraceEvent* event = NewEvent();
+    if (event == NULL)
+        return;
+    event->category = category;
+    event->name = name;
+    event->start_us = start_us;
+    event->dur_us = end_us > start_us ? (uint32_t)(end_us - start_us) : 0;
+    event->bytes_out = bytes_out;
+    event->bytes_in = bytes_in;
+}
+
+void TraceTransfer(uint64_t start_us, uint64_t end_us, uint32_t bytes_out, uint32_t bytes_in)
+{
+    if (g_TraceEnabled)
+        Record("usb", "transfer", start_us, end_us, bytes_out, bytes_in);
+}
+
+void TraceSpan(const char* category, const char* name, uint64_t start_us, uint64_t end_us)
+{
+    if (g_TraceEnabled)
+        Record(category, name, start_us, end_us, 0, 0);
+}
+
+TraceScope::TraceScope(const char* category, const char* name)
+    : category_(category), name_(name), start_(0), active_(g_TraceEnabled)
+{
+    if (active_)
+        start_ = GetI2CTimeUs();
+}
+
+TraceScope::~TraceScope()
+{
+    if (active_)
+        Record(category_, name_, start_, GetI2CTimeUs(), 0, 0);
+}
+
+static bool WriteChromeTrace(const char* json_file, int timelines)
+{
+    FILE* fp = fopen(json_file, "w");
+    if (fp == NULL)
+        return false;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    const char* sep = "";
+    for (int t = 0; t < timelines; t++)
+    {
+        const TraceTimeline* timeline = g_Timelines[t];
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", sep, t, timeline->name);
+        sep = ",\n";
+        for (const TraceBlock* block = timeline->first; block; block = block->next)
+        {
+            for (uint32_t i = 0; i < block->count; i++)
+            {
+                const TraceEvent* e = &block->events[i];
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                        "\"tid\":%d,\"ts\":%llu,\"dur\":%u", e->name, e->category, t,
+                        (unsigned long long)e->start_us, e->dur_us);
+                if (e->bytes_out || e->bytes_in)
+                    fprintf(fp, ",\"args\":{\"out\":%u,\"in\":%u}", e->bytes_out, e->bytes_in);
+                fprintf(fp, "}");
+            }
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(fp) == 0;
+}
+
+#define TRACE_MAX_NAMES 64
+#define TRACE_BUCKETS 28    // powers of two up to about 2 minutes
+
+struct LatencySummary
+{
+    const char* name;
+    uint32_t    count;
+    uint32_t    buckets[TRACE_BUCKETS];
+    uint32_t*   samples;
+    uint32_t    filled;
+};
+
+static int CompareUInt32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Bucket k counts durations up to 2^k us.
+static int Bucket(uint32_t dur_us)
+{
+    int k = 0;
+    while (k < TRACE_BUCKETS - 1 && ((uint64_t)1 << k) < dur_us)
+        k++;
+    return k;
+}
+
+static void PrintHistograms(int timelines)
+{
+    LatencySummary summary[TRACE_MAX_NAMES];
+    int names = 0;
+    memset(summary, 0, sizeof(summary));
+    for (int pass = 0; pass < 2; pass++)
+    {
+        // Count per name first, then collect the samples for percentiles.
+        for (int t = 0; t < timelines; t++)
+        {
+            for (const TraceBlock* block = g_Timelines[t]->first; block; block = block->next)
+            {
+                for (uint32_t i = 0; i < block->count; i++)
+                {
+                    const TraceEvent* e = &block->events[i];
+                    int n = 0;
+                    while (n < names && strcmp(summary[n].name, e->name) != 0)
+                        n++;
+                    if (n == names)
+                    {
+                        if (names == TRACE_MAX_NAMES)
+                            continue;
+                        summary[names++].name = e->name;
+                    }
+                    LatencySummary* s = &summary[n];
+                    if (pass == 0)
+                    {
+                        s->count++;
+                        s->buckets[Bucket(e->dur_us)]++;
+                    }
+                    else
+                    {
+                        s->samples[s->filled++] = e->dur_us;
+                    }
+                }
+            }
+        }
+        if (pass == 0)
+        {
+            for (int n = 0; n < names; n++)
+                summary[n].samples = new uint32_t[summary[n].count];
+        }
+    }
+
+    fprintf(stderr, "%-20s %8s %10s %10s %10s %10s %10s\n", "Latency (us)",
+            "count", "total ms", "p50", "p90", "p99", "max");
+    for (int n = 0; n < names; n++)
+    {
+        LatencySummary* s = &summary[n];
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < s->count; i++)
+            total += s->samples[i];
+        qsort(s->samples, s->count, sizeof(uint32_t), CompareUInt32);
+        fprintf(stderr, "%-20s %8u %10.1f %10u %10u %10u %10u\n", s->name, s->count,
+                total / 1000.0, s->samples[s->count / 2], s->samples[s->count * 9 / 10],
+                s->samples[s->count * 99 / 100], s->samples[s->count - 1]);
+        fprintf(stderr, "   ");
+        for (int k = 0; k < TRACE_BUCKETS; k++)
+        {
+            if (s->buckets[k])
+                fprintf(stderr, " <=%u:%u", 1u << k, s->buckets[k]);
+        }
+        fprintf(stderr, "\n");
+        delete [] s->samples;
+    }
+}
+
+bool StopTrace(const char* json_file)
+{
+    g_TraceEnabled = false;
+    int timelines = g_NumTimelines < TRACE_MAX_TIMELINES ? (int)g_NumTimelines : TRACE_MAX_TIMELINES;
+    if (g_Dropped > 0)
+        fprintf(stderr, "Trace: events of %ld threads dropped\n", (long)g_Dropped);
+    PrintHistograms(timelines);
+    bool ok = true;
+    if (json_file)
+    {
+        ok = WriteChromeTrace(json_file, timelines);
+        fprintf(stderr, "Trace %s %s\n", ok ? "written to" : "can't be written to", json_file);
+    }
+    for (int t = 0; t < timelines; t++)
+    {
+        TraceBlock* block = g_Timelines[t]->first;
+        while (block)
+        {
+            TraceBlock* next = block->next;
+            delete block;
+            block = next;
+        }
+        delete g_Timelines[t];
+        g_Timelines[t] = NULL;
+    }
+    g_NumTimelines = 0;
+    return ok;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// Timeline of the adapter traffic and of the controller operations issued
+// over it, kept in per-thread buffers without any locking. Times are on the
+// clock of the link (see GetI2CTimeUs). While tracing is off each probe
+// costs a single test of a flag.
+//
+// Names and categories must be string literals, the buffers keep only the
+// pointers.
+
+extern bool g_TraceEnabled;
+
+void StartTrace();
+
+// Stop tracing, write the timeline to 'json_file' (Chrome trace event
+// format, for chrome://tracing or Perfetto) unless it is NULL and print the
+// latency histogram of every operation. Call once the traced threads are
+// done.
+bool StopTrace(const char* json_file);
+
+// Name the timeline of the calling thread; events after the call go to a
+// new timeline, so a thread serving several sessions gets one per session.
+void TraceThreadName(const char* name);
+
+// One round-trip to the adapter carrying 'bytes_out' bytes of commands and
+// returning 'bytes_in' bytes.
+void TraceTransfer(uint64_t start_us, uint64_t end_us, uint32_t bytes_out, uint32_t bytes_in);
+
+void TraceSpan(const char* category, const char* name, uint64_t start_us, uint64_t end_us);
+
+// Traces the lifetime of the object as a span.
+class TraceScope
+{
+public:
+    TraceScope(const char* category, const char* name);
+    ~TraceScope();
+
+private:
+    const char* category_;
+    const char* name_;
+    uint64_t    start_;
+    bool        active_;
+};
@@ -0,0 +1,60 @@
+// verify.cpp : Readback comparison helpers.
+//
+#include "stdafx.h"
+#include "verify.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VERIFY_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+uint32_t FindMismatch(const uint8_t* a, const uint8_t* b, uint32_t len)
+{
+    uint32_t pos = 0;
+#ifdef VERIFY_HAVE_SSE2
+    // Equal 64 byte blocks are skipped with one mask test; the scalar loop
+    // below locates the byte within the first block that differs.
+    for (; pos + 64 <= len; pos += 64)
+    {
+        __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + pos)),
+                                     _mm_loadu_si128((const __m128i*)(b + pos)));
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + pos + 16)),
+                                     _mm_loadu_si128((const __m128i*)(b + pos + 16)));
+        __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + pos + 32)),
+                                     _mm_loadu_si128((const __m128i*)(b + pos + 32)));
+        __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + pos + 48)),
+                                     _mm_loadu_si128((const __m128i*)(b + pos + 48)));
+        __m128i eq = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+        if (_mm_movemask_epi8(eq) != 0xffff)
+            break;
+    }
+#endif
+    for (; pos < len; pos++)
+    {
+        if (a[pos] != b[pos])
+            return pos;
+    }
+    return len;
+}
+
+uint32_t CoalescePages(const bool* bad, uint32_t pages, uint32_t gap, PageRange* ranges)
+{
+    uint32_t count = 0;
+    for (uint32_t page = 0; page < pages; page++)
+    {
+        if (!bad[page])
+            continue;
+        if (count > 0 && page - ranges[count - 1].end < gap)
+        {
+            ranges[count - 1].end = page + 1;
+        }
+        else
+        {
+            ranges[count].first = page;
+            ranges[count].end = page + 1;
+            count++;
+        }
+    }
+    return count;
+}
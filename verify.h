@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// Offset of the first byte where 'a' and 'b' differ, 'len' if they are the
+// same. Compares 64 bytes per step with SSE2 where the build targets it.
+uint32_t FindMismatch(const uint8_t* a, const uint8_t* b, uint32_t len);
+
+// Half-open range of 256 byte pages.
+struct PageRange
+{
+    uint32_t first;
+    uint32_t end;
+};
+
+// Merge the pages flagged in 'bad' into ranges, joining ranges separated by
+// fewer than 'gap' (at least 1) good pages. 'ranges' must hold (pages + 1) / 2
+// entries. Returns the number of ranges.
+uint32_t CoalescePages(const bool* bad, uint32_t pages, uint32_t gap, PageRange* ranges);